@@ -0,0 +1,225 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <afc/Exception.h>
+#include <afc/string_util.hpp>
+
+#include "corpus.h"
+#include "utf.h"
+#include "vgm.h"
+
+using namespace std;
+using vgm::VGMFile;
+using vgm::bench::CorpusFile;
+using Format = vgm::VGMFile::Format;
+using LoadMode = vgm::VGMFile::LoadMode;
+using Tag = vgm::VGMFile::Tag;
+
+namespace
+{
+	const char * const DEFAULT_CORPUS_DIR = "build/bench-corpus";
+	const size_t DEFAULT_MAX_SIZE_MIB = 100;
+	const unsigned DEFAULT_REPEAT = 3;
+
+	struct Phase
+	{
+		const char *name;
+		function<void(const CorpusFile &, const string &)> run;
+	};
+
+	struct Measurement
+	{
+		unsigned files;
+		double octets;
+		double seconds;
+	};
+
+	const struct option options[] = {
+		{"corpus", required_argument, nullptr, 'd'},
+		{"max-size", required_argument, nullptr, 's'},
+		{"repeat", required_argument, nullptr, 'n'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0}
+	};
+
+	void printUsage(const char * const progName)
+	{
+		printf("Usage: %s [OPTION]...\n"
+				"Generates a synthetic VGM/VGZ corpus (if needed) and measures the throughput of vgmtag operations.\n\n"
+				"  -d, --corpus=DIR     the directory of the corpus (default: %s)\n"
+				"  -s, --max-size=MiB   the maximum size of the corpus files in MiB (default: %zu)\n"
+				"  -n, --repeat=N       the number of runs of each phase over the corpus (default: %u)\n"
+				"  -h, --help           display this help and exit\n",
+				progName, DEFAULT_CORPUS_DIR, DEFAULT_MAX_SIZE_MIB, DEFAULT_REPEAT);
+	}
+
+	bool parseNumber(const char * const str, unsigned long &dest)
+	{
+		char *end;
+		dest = strtoul(str, &end, 10);
+		return *str != '\0' && *end == '\0' && dest > 0;
+	}
+
+	size_t fileSize(const string &path)
+	{
+		struct stat fileStat;
+		if (stat(path.c_str(), &fileStat) != 0) {
+			throw runtime_error("Unable to stat " + path);
+		}
+		return static_cast<size_t>(fileStat.st_size);
+	}
+
+	void retag(const CorpusFile &file, const string &out, const Format format)
+	{
+		VGMFile vgmFile(file.path.c_str(), LoadMode::mappedData);
+		vgmFile.setTag(Tag::title, afc::stringToUTF16LE("Retagged Benchmark Track", "UTF-8"));
+		vgmFile.save(out.c_str(), format);
+	}
+
+	// The phases are run in-process so that process start-up does not dominate the timings of small files.
+	const Phase PHASES[] = {
+		{"load", [](const CorpusFile &file, const string &)
+			{
+				VGMFile vgmFile(file.path.c_str(), LoadMode::full);
+			}},
+		{"info", [](const CorpusFile &file, const string &)
+			{
+				// Mirrors --info under a UTF-8 locale: the tags are read and converted to UTF-8 natively.
+				VGMFile vgmFile(file.path.c_str(), LoadMode::tagsOnly);
+				string value;
+				for (int i = static_cast<int>(Tag::title); i <= static_cast<int>(Tag::notes); ++i) {
+					const afc::U16String &tag = vgmFile.getTag(static_cast<Tag>(i));
+					vgm::utf16ToUTF8(tag.data(), tag.size(), value);
+				}
+			}},
+		{"retag-vgm", [](const CorpusFile &file, const string &out) { retag(file, out, Format::vgm); }},
+		{"retag-vgz", [](const CorpusFile &file, const string &out) { retag(file, out, Format::vgz); }}
+	};
+
+	void printRow(const char * const phase, const string &group, const Measurement &m)
+	{
+		const double mib = m.octets / (1024.0 * 1024.0);
+		printf("%-10s %-10s %7u %11.1f %9.3f %10.1f %10.1f\n", phase, group.c_str(), m.files, mib, m.seconds,
+				m.seconds > 0 ? mib / m.seconds : 0.0, m.seconds > 0 ? m.files / m.seconds : 0.0);
+	}
+
+	string sizeGroup(const size_t size)
+	{
+		char buf[16];
+		if (size >= 1024 * 1024) {
+			snprintf(buf, sizeof(buf), "%zuM", size / (1024 * 1024));
+		} else {
+			snprintf(buf, sizeof(buf), "%zuK", size / 1024);
+		}
+		return buf;
+	}
+}
+
+int main(const int argc, char * argv[])
+try {
+	string corpusDir = DEFAULT_CORPUS_DIR;
+	unsigned long maxSizeMiB = DEFAULT_MAX_SIZE_MIB;
+	unsigned long repeat = DEFAULT_REPEAT;
+
+	int c;
+	while ((c = ::getopt_long(argc, argv, "d:s:n:h", options, nullptr)) != -1) {
+		switch (c) {
+		case 'd':
+			corpusDir = ::optarg;
+			break;
+		case 's':
+			if (!parseNumber(::optarg, maxSizeMiB)) {
+				fprintf(stderr, "Invalid maximum size: '%s'.\n", ::optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			if (!parseNumber(::optarg, repeat)) {
+				fprintf(stderr, "Invalid number of runs: '%s'.\n", ::optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			printUsage(argv[0]);
+			return 0;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (mkdir(corpusDir.c_str(), 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Unable to create the corpus directory '%s'.\n", corpusDir.c_str());
+		return 1;
+	}
+	printf("Preparing the corpus in '%s'...\n", corpusDir.c_str());
+	fflush(stdout);
+	const vector<CorpusFile> corpus = vgm::bench::generateCorpus(corpusDir, maxSizeMiB * 1024 * 1024);
+
+	vector<size_t> sizes;
+	sizes.reserve(corpus.size());
+	for (const CorpusFile &file : corpus) {
+		sizes.push_back(fileSize(file.path));
+	}
+	const string out = corpusDir + "/bench.out";
+
+	printf("%zu files, %lu run(s) per phase.\n\n", corpus.size(), repeat);
+	printf("%-10s %-10s %7s %11s %9s %10s %10s\n", "phase", "size", "files", "MiB", "seconds", "MiB/s", "files/s");
+	for (const Phase &phase : PHASES) {
+		// Grouped by the uncompressed size of the files; the throughput is measured in on-disk octets.
+		map<size_t, Measurement> groups;
+		Measurement total = {0, 0, 0};
+		for (unsigned long run = 0; run < repeat; ++run) {
+			for (size_t i = 0; i < corpus.size(); ++i) {
+				const auto start = chrono::steady_clock::now();
+				phase.run(corpus[i], out);
+				const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+				Measurement &group = groups.insert(make_pair(corpus[i].size, Measurement{0, 0, 0})).first->second;
+				for (Measurement * const m : {&group, &total}) {
+					++m->files;
+					m->octets += sizes[i];
+					m->seconds += seconds;
+				}
+			}
+		}
+		for (const auto &group : groups) {
+			printRow(phase.name, sizeGroup(group.first), group.second);
+		}
+		printRow(phase.name, "all", total);
+	}
+	unlink(out.c_str());
+	return 0;
+}
+catch (std::exception &ex) {
+	fprintf(stderr, "%s\n", ex.what());
+	return 1;
+}
@@ -0,0 +1,271 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "corpus.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+using namespace std;
+using namespace vgm::bench;
+
+namespace
+{
+	const uint32_t VERSIONS[] = {0x100, 0x101, 0x110, 0x150, 0x151, 0x160, 0x161};
+	const uint32_t LATEST_VERSION = 0x161;
+
+	const size_t SMALL_SIZES[] = {1024, 64 * 1024, 1024 * 1024};
+	const size_t LARGE_SIZES[] = {10 * 1024 * 1024, 100 * 1024 * 1024};
+
+	// Absolute positions of the header fields that are filled in.
+	const size_t POS_EOF = 0x04, POS_VERSION = 0x08, POS_SN_CLOCK = 0x0c, POS_GD3 = 0x14,
+			POS_TOTAL_SAMPLES = 0x18, POS_RATE = 0x24, POS_SN_FEEDBACK = 0x28, POS_YM2612_CLOCK = 0x2c,
+			POS_VGM_DATA = 0x34;
+
+	const char * const TAGS[] = {"Benchmark Track", "", "Synthetic Corpus", "", "Sega Mega Drive / Genesis", "",
+			"vgmtag", "", "2016/01/01", "vgmtag bench", "Generated for benchmarking.\nNot a real track."};
+
+	// xorshift32: the corpus must be the same on every run and platform.
+	class Random
+	{
+	public:
+		explicit Random(const uint32_t seed) : m_state(seed == 0 ? 1 : seed) {}
+
+		uint32_t next()
+		{
+			m_state ^= m_state << 13;
+			m_state ^= m_state >> 17;
+			m_state ^= m_state << 5;
+			return m_state;
+		}
+	private:
+		uint32_t m_state;
+	};
+
+	inline void putUInt32(vector<unsigned char> &buf, const size_t pos, const uint32_t val)
+	{
+		buf[pos] = val & 0xff;
+		buf[pos + 1] = (val >> 8) & 0xff;
+		buf[pos + 2] = (val >> 16) & 0xff;
+		buf[pos + 3] = val >> 24;
+	}
+
+	inline void appendUInt32(vector<unsigned char> &buf, const uint32_t val)
+	{
+		buf.resize(buf.size() + 4);
+		putUInt32(buf, buf.size() - 4, val);
+	}
+
+	/* Generates a command stream of exactly size octets that resembles real music: chip register writes
+	 * interleaved with waits, and PCM data blocks for versions that support them. Returns the total number
+	 * of samples the stream lasts.
+	 */
+	uint32_t generateData(vector<unsigned char> &data, const size_t size, const uint32_t version, Random &random)
+	{
+		data.clear();
+		data.reserve(size);
+		uint32_t samples = 0;
+		// One octet is reserved for the end of sound data command.
+		while (data.size() + 1 < size) {
+			const size_t room = size - 1 - data.size();
+			const uint32_t r = random.next();
+			const unsigned kind = r % 16;
+			if (version >= 0x150 && kind == 0 && room > 7 + 256) { // PCM data block for YM2612
+				const size_t blockSize = min(room - 7, static_cast<size_t>(256 + (r >> 8) % 4096));
+				data.push_back(0x67);
+				data.push_back(0x66);
+				data.push_back(0x00);
+				appendUInt32(data, static_cast<uint32_t>(blockSize));
+				unsigned char sample = 0x80;
+				for (size_t i = 0; i < blockSize; ++i) {
+					sample = static_cast<unsigned char>(sample + static_cast<int>(random.next() % 9) - 4);
+					data.push_back(sample);
+				}
+			} else if (version >= 0x110 && kind < 8 && room >= 3) { // YM2612 port 0 write
+				data.push_back(0x52);
+				data.push_back(static_cast<unsigned char>(0x28 + (r >> 8) % 0x90));
+				data.push_back(static_cast<unsigned char>(r >> 16));
+			} else if (kind < 11 && room >= 2) { // SN76489 write
+				data.push_back(0x50);
+				data.push_back(static_cast<unsigned char>(r >> 8));
+			} else if (kind < 14 && room >= 3) { // wait n samples
+				const uint32_t n = 1 + (r >> 8) % 2000;
+				data.push_back(0x61);
+				data.push_back(n & 0xff);
+				data.push_back(n >> 8);
+				samples += n;
+			} else { // wait n+1 samples, n = 0..15
+				const uint32_t n = (r >> 8) % 16;
+				data.push_back(static_cast<unsigned char>(0x70 + n));
+				samples += n + 1;
+			}
+		}
+		data.push_back(0x66);
+		return samples;
+	}
+
+	void appendGD3(vector<unsigned char> &buf)
+	{
+		vector<unsigned char> tags;
+		for (const char * const tag : TAGS) {
+			for (const char *p = tag; *p != '\0'; ++p) { // the tags are ASCII
+				tags.push_back(static_cast<unsigned char>(*p));
+				tags.push_back(0);
+			}
+			tags.push_back(0);
+			tags.push_back(0);
+		}
+		buf.push_back('G');
+		buf.push_back('d');
+		buf.push_back('3');
+		buf.push_back(' ');
+		appendUInt32(buf, 0x100);
+		appendUInt32(buf, static_cast<uint32_t>(tags.size()));
+		buf.insert(buf.end(), tags.begin(), tags.end());
+	}
+
+	void buildFile(vector<unsigned char> &content, const uint32_t version, const Layout layout,
+			const size_t size, Random &random)
+	{
+		const size_t headerSize = version < 0x151 ? 0x40 : 0xc0;
+
+		vector<unsigned char> gd3;
+		if (layout != Layout::noGD3) {
+			appendGD3(gd3);
+		}
+		const size_t dataSize = size > headerSize + gd3.size() + 1 ? size - headerSize - gd3.size() : 1;
+		vector<unsigned char> data;
+		const uint32_t samples = generateData(data, dataSize, version, random);
+
+		content.assign(headerSize, 0);
+		content[0] = 'V';
+		content[1] = 'g';
+		content[2] = 'm';
+		content[3] = ' ';
+		putUInt32(content, POS_VERSION, version);
+		putUInt32(content, POS_SN_CLOCK, 3579545);
+		putUInt32(content, POS_TOTAL_SAMPLES, samples);
+		if (version >= 0x101) {
+			putUInt32(content, POS_RATE, 60);
+		}
+		if (version >= 0x110) {
+			content[POS_SN_FEEDBACK] = 0x09;
+			content[POS_SN_FEEDBACK + 2] = 16;
+			putUInt32(content, POS_YM2612_CLOCK, 7670453);
+		}
+
+		size_t dataPos;
+		if (layout == Layout::gd3Data) {
+			putUInt32(content, POS_GD3, static_cast<uint32_t>(headerSize - POS_GD3));
+			content.insert(content.end(), gd3.begin(), gd3.end());
+			dataPos = content.size();
+			content.insert(content.end(), data.begin(), data.end());
+		} else {
+			dataPos = content.size();
+			content.insert(content.end(), data.begin(), data.end());
+			if (layout == Layout::dataGD3) {
+				putUInt32(content, POS_GD3, static_cast<uint32_t>(content.size() - POS_GD3));
+				content.insert(content.end(), gd3.begin(), gd3.end());
+			}
+		}
+		if (version >= 0x150) {
+			putUInt32(content, POS_VGM_DATA, static_cast<uint32_t>(dataPos - POS_VGM_DATA));
+		}
+		putUInt32(content, POS_EOF, static_cast<uint32_t>(content.size() - POS_EOF));
+	}
+
+	void writeFile(const CorpusFile &file, const vector<unsigned char> &content)
+	{
+		const string tmpPath = file.path + ".tmp";
+		if (file.compressed) {
+			const gzFile out = gzopen(tmpPath.c_str(), "wb9");
+			if (out == nullptr || gzwrite(out, content.data(), static_cast<unsigned>(content.size())) !=
+					static_cast<int>(content.size()) || gzclose(out) != Z_OK) {
+				throw runtime_error("Unable to write " + tmpPath);
+			}
+		} else {
+			FILE * const out = fopen(tmpPath.c_str(), "wb");
+			if (out == nullptr || fwrite(content.data(), 1, content.size(), out) != content.size() ||
+					fclose(out) != 0) {
+				throw runtime_error("Unable to write " + tmpPath);
+			}
+		}
+		// Interrupted generation must not leave incomplete files in the corpus.
+		if (rename(tmpPath.c_str(), file.path.c_str()) != 0) {
+			throw runtime_error("Unable to write " + file.path);
+		}
+	}
+
+	void addFile(vector<CorpusFile> &corpus, const string &dir, const uint32_t version, const Layout layout,
+			const size_t size)
+	{
+		for (const bool compressed : {false, true}) {
+			char name[64];
+			snprintf(name, sizeof(name), "v%03x-%s-%zu.%s", static_cast<unsigned>(version), layoutName(layout),
+					size, compressed ? "vgz" : "vgm");
+			const CorpusFile file = {dir + '/' + name, version, layout, size, compressed};
+
+			struct stat fileStat;
+			if (stat(file.path.c_str(), &fileStat) != 0) {
+				// The seed depends on the parameters only so that each file is reproducible on its own.
+				Random random(static_cast<uint32_t>(version * 7919 + static_cast<unsigned>(layout) * 104729 + size));
+				vector<unsigned char> content;
+				buildFile(content, version, layout, size, random);
+				writeFile(file, content);
+			}
+			corpus.push_back(file);
+		}
+	}
+}
+
+const char *vgm::bench::layoutName(const Layout layout)
+{
+	switch (layout) {
+	case Layout::dataGD3:
+		return "data-gd3";
+	case Layout::gd3Data:
+		return "gd3-data";
+	default:
+		return "no-gd3";
+	}
+}
+
+vector<CorpusFile> vgm::bench::generateCorpus(const string &dir, const size_t maxSize)
+{
+	vector<CorpusFile> corpus;
+	for (const size_t size : SMALL_SIZES) {
+		if (size > maxSize) {
+			continue;
+		}
+		for (const uint32_t version : VERSIONS) {
+			for (const Layout layout : {Layout::dataGD3, Layout::gd3Data, Layout::noGD3}) {
+				if (layout == Layout::gd3Data && version < 0x150) {
+					continue;
+				}
+				addFile(corpus, dir, version, layout, size);
+			}
+		}
+	}
+	for (const size_t size : LARGE_SIZES) {
+		if (size <= maxSize) {
+			addFile(corpus, dir, LATEST_VERSION, Layout::dataGD3, size);
+		}
+	}
+	return corpus;
+}
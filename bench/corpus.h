@@ -0,0 +1,59 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_BENCH_CORPUS_H_
+#define VGM_BENCH_CORPUS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vgm
+{
+namespace bench
+{
+	// The order of the sections of a VGM file.
+	enum class Layout
+	{
+		dataGD3, // header -> data -> gd3 -> eof
+		gd3Data, // header -> gd3 -> data -> eof; requires VGM 1.50+ to define the data offset
+		noGD3 // header -> data -> eof
+	};
+
+	struct CorpusFile
+	{
+		std::string path;
+		std::uint32_t version;
+		Layout layout;
+		// The size of the VGM content, i.e. the size of the uncompressed file.
+		std::size_t size;
+		bool compressed;
+	};
+
+	const char *layoutName(const Layout layout);
+
+	/*
+	 * Generates a reproducible corpus of synthetic VGM and VGZ files in the directory dir (which must exist)
+	 * and returns the descriptions of the files. Files that already exist are not generated again.
+	 *
+	 * All supported VGM versions and section layouts are generated for the sizes up to 1 MiB. Larger files,
+	 * up to maxSize, are generated for the latest version with the header -> data -> gd3 layout only.
+	 */
+	std::vector<CorpusFile> generateCorpus(const std::string &dir, const std::size_t maxSize);
+}
+}
+
+#endif // VGM_BENCH_CORPUS_H_
@@ -0,0 +1,229 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "bulkparse.h"
+
+#include "parallel.h"
+#include "uring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <afc/Exception.h>
+
+using namespace afc;
+using namespace std;
+using vgm::Extent;
+using vgm::ParseHandler;
+
+namespace
+{
+	// The number of files that are read at once, each having a single read in flight.
+	const unsigned QUEUE_DEPTH = 256;
+	// The size of the reads. The first one holds the header, and the GD3 info as well if the file is small.
+	const size_t READ_SIZE = 4096;
+	/* The limits of the reads of a file. A file that needs more reads (which happens only if its sections are
+	 * malformed) or a larger one is parsed with blocking I/O instead.
+	 */
+	const size_t MAX_READ_COUNT = 4;
+	const size_t MAX_READ_SIZE = 1024 * 1024;
+
+	// A file that is being read with io_uring.
+	struct PendingFile
+	{
+		size_t index;
+		int fd;
+		vector<unique_ptr<unsigned char[]>> buffers;
+		vector<Extent> extents;
+		// The end of the file once a read reaches it.
+		size_t end;
+		// The read in flight.
+		size_t readOffset;
+		size_t readSize;
+	};
+
+	string parseFile(const string &path, ParseHandler &handler)
+	{
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			return "Unable to open file";
+		}
+		string error;
+		try {
+			vgm::parse(fd, handler);
+		}
+		catch (Exception &ex) {
+			error = ex.what();
+		}
+		catch (std::exception &ex) {
+			error = ex.what();
+		}
+		::close(fd);
+		return error;
+	}
+
+	/* Parses the plain VGM files with io_uring. The files that have to be parsed with blocking I/O are marked
+	 * in blocking, and done() is not called for them.
+	 */
+	void parseWithRing(vgm::IoRing &ring, const vector<string> &paths,
+			const function<ParseHandler &(size_t i)> &handlerOf, const function<void(size_t i, const char *error)> &done,
+			vector<bool> &blocking)
+	{
+		const unsigned slotCount = ring.capacity();
+		vector<unique_ptr<PendingFile>> slots(slotCount);
+		vector<unsigned> freeSlots;
+		for (unsigned i = slotCount; i > 0; --i) {
+			freeSlots.push_back(i - 1);
+		}
+
+		auto queueRead = [&](const unsigned slot, const size_t offset, const size_t size)
+		{
+			PendingFile &file = *slots[slot];
+			file.buffers.emplace_back(new unsigned char[size]);
+			file.readOffset = offset;
+			file.readSize = size;
+			// There is at most one read per slot in flight, so the queue cannot be full.
+			ring.read(file.fd, file.buffers.back().get(), static_cast<unsigned>(size), offset, slot);
+		};
+		auto release = [&](const unsigned slot)
+		{
+			::close(slots[slot]->fd);
+			slots[slot].reset();
+			freeSlots.push_back(slot);
+		};
+		auto parseExtents = [&](PendingFile &file, ParseHandler &handler, size_t &missingOffset, size_t &missingSize,
+				string &error) -> bool
+		{
+			try {
+				return vgm::parse(file.extents.data(), file.extents.size(), handler, missingOffset, missingSize);
+			}
+			catch (Exception &ex) {
+				error = ex.what();
+			}
+			catch (std::exception &ex) {
+				error = ex.what();
+			}
+			return true;
+		};
+
+		size_t next = 0;
+		while (next < paths.size() || freeSlots.size() < slotCount) {
+			for (; next < paths.size() && !freeSlots.empty(); ++next) {
+				// The files have just been found by walking the tree, so opening them hits the cached metadata.
+				const int fd = ::open(paths[next].c_str(), O_RDONLY | O_CLOEXEC);
+				if (fd == -1) {
+					done(next, "Unable to open file");
+					continue;
+				}
+				const unsigned slot = freeSlots.back();
+				freeSlots.pop_back();
+				slots[slot].reset(new PendingFile());
+				slots[slot]->index = next;
+				slots[slot]->fd = fd;
+				slots[slot]->end = SIZE_MAX;
+				queueRead(slot, 0, READ_SIZE);
+			}
+			if (freeSlots.size() == slotCount) {
+				break; // none of the remaining files could be opened, so there is nothing to wait for
+			}
+			ring.submit(1);
+
+			uint64_t userData;
+			int result;
+			while (ring.complete(userData, result)) {
+				const unsigned slot = static_cast<unsigned>(userData);
+				PendingFile &file = *slots[slot];
+				if (result == -EINTR || result == -EAGAIN) {
+					file.buffers.pop_back();
+					queueRead(slot, file.readOffset, file.readSize);
+					continue;
+				}
+				if (result < 0) {
+					blocking[file.index] = true;
+					release(slot);
+					continue;
+				}
+				const size_t size = static_cast<size_t>(result);
+				const unsigned char * const data = file.buffers.back().get();
+				file.extents.push_back(Extent{file.readOffset, data, size});
+				if (size < file.readSize) {
+					file.end = min(file.end, file.readOffset + size);
+				}
+				if (file.readOffset == 0 && size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+					blocking[file.index] = true; // a VGZ file
+					release(slot);
+					continue;
+				}
+
+				// The file is parsed without a handler until all the content needed is read.
+				ParseHandler probe;
+				size_t missingOffset, missingSize;
+				string error;
+				if (parseExtents(file, probe, missingOffset, missingSize, error)) {
+					if (error.empty()) {
+						parseExtents(file, handlerOf(file.index), missingOffset, missingSize, error);
+					}
+					done(file.index, error.empty() ? nullptr : error.c_str());
+				} else if (missingOffset + missingSize <= file.end && missingSize <= MAX_READ_SIZE &&
+						file.extents.size() < MAX_READ_COUNT) {
+					queueRead(slot, missingOffset, max(missingSize, READ_SIZE));
+					continue;
+				} else {
+					// The content is beyond the end of the file; blocking I/O reports the error.
+					blocking[file.index] = true;
+				}
+				release(slot);
+			}
+		}
+	}
+}
+
+void vgm::parseFiles(const vector<string> &paths, const unsigned threadCount,
+		const function<ParseHandler &(size_t i)> &handlerOf, const function<void(size_t i, const char *error)> &done)
+{
+	vector<bool> blocking(paths.size(), false);
+	unique_ptr<IoRing> ring;
+	try {
+		ring.reset(new IoRing(QUEUE_DEPTH));
+	}
+	catch (Exception &ex) {
+		fill(blocking.begin(), blocking.end(), true);
+	}
+	if (ring != nullptr) {
+		parseWithRing(*ring, paths, handlerOf, done, blocking);
+		ring.reset();
+	}
+
+	vector<size_t> rest;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		if (blocking[i]) {
+			rest.push_back(i);
+		}
+	}
+	vector<string> errors(rest.size());
+	runOrdered(rest.size(), threadCount, [&](const size_t i)
+			{
+				errors[i] = parseFile(paths[rest[i]], handlerOf(rest[i]));
+			},
+			[&](const size_t i)
+			{
+				done(rest[i], errors[i].empty() ? nullptr : errors[i].c_str());
+			});
+}
@@ -0,0 +1,50 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_BULKPARSE_H_
+#define VGM_BULKPARSE_H_
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "parser.h"
+
+namespace vgm
+{
+	/*
+	 * Parses the header and the GD3 info of each of the files as parse(fd, handler) does, with the handler
+	 * handlerOf(i) that must not want the VGM data. done(i, error) is called once the file is parsed, with
+	 * error being nullptr if it is parsed successfully. Otherwise the handler may have received a part of
+	 * the callbacks.
+	 *
+	 * Plain VGM files are read with io_uring so that hundreds of reads are in flight across files at once:
+	 * the first page of each file, which holds the header, and then the GD3 info unless it is in the first page
+	 * already. Each file is parsed in the calling thread as soon as its reads are completed, so the scan is
+	 * limited by the throughput of the storage rather than by its latency. VGZ files, which have to be
+	 * decompressed from the start, and the files that are not read completely this way (e.g. truncated ones)
+	 * are parsed afterwards with blocking I/O in up to threadCount threads, as are all the files if io_uring
+	 * is not available.
+	 *
+	 * done() is called in the calling thread, not necessarily in the order of the files. handlerOf() can be
+	 * called from the worker threads, concurrently for different files.
+	 */
+	void parseFiles(const std::vector<std::string> &paths, const unsigned threadCount,
+			const std::function<ParseHandler &(std::size_t i)> &handlerOf,
+			const std::function<void(std::size_t i, const char *error)> &done);
+}
+
+#endif // VGM_BULKPARSE_H_
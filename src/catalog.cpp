@@ -0,0 +1,300 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "catalog.h"
+#include "bulkparse.h"
+#include "fileio.h"
+#include "tree.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+using namespace vgm;
+
+namespace
+{
+	const size_t TAG_COUNT = static_cast<size_t>(VGMFile::Tag::notes) + 1;
+
+	struct CatalogHeader
+	{
+		char magic[8];
+		// BYTE_ORDER_MARK in the byte order of the platform that wrote the catalog.
+		uint32_t byteOrderMark;
+		uint32_t formatVersion;
+		uint64_t entryCount;
+		uint64_t poolOffset;
+		uint64_t poolSize;
+	};
+
+	const char MAGIC[8] = {'V', 'G', 'M', 'T', 'C', 'A', 'T', '\0'};
+	const uint32_t BYTE_ORDER_MARK = 0x01020304;
+	const uint32_t FORMAT_VERSION = 1;
+
+	static_assert(sizeof(CatalogHeader) % 8 == 0 && sizeof(CatalogEntry) % 8 == 0,
+			"Catalog entries must be aligned when the catalog is mapped into memory.");
+
+	// The properties of a file that are stored in its catalog entry.
+	struct ParsedFile
+	{
+		ParsedFile() : handler(info) {}
+
+		TagInfo info;
+		TagInfoHandler handler;
+		bool valid = false;
+		string error;
+	};
+
+	// Builds the content of a catalog file.
+	class CatalogBuilder
+	{
+	public:
+		void add(const FileInfo &file, const ParsedFile &parsed)
+		{
+			const TagInfo &info = parsed.info;
+			CatalogEntry entry = newEntry(file, info.version, info.format == VGMFile::Format::vgz, parsed.valid);
+			for (size_t i = 0; i < TAG_COUNT; ++i) {
+				entry.tagOffsets[i] = addTag(info.tags[i].data(), info.tags[i].size());
+				entry.tagSizes[i] = static_cast<uint32_t>(info.tags[i].size());
+			}
+			m_entries.push_back(entry);
+		}
+
+		void add(const FileInfo &file, const Catalog &catalog, const CatalogEntry &old)
+		{
+			CatalogEntry entry = newEntry(file, old.version, old.format != 0, old.valid != 0);
+			for (size_t i = 0; i < TAG_COUNT; ++i) {
+				const VGMFile::Tag tag = static_cast<VGMFile::Tag>(i);
+				entry.tagOffsets[i] = addTag(catalog.tag(old, tag), catalog.tagSize(old, tag));
+				entry.tagSizes[i] = old.tagSizes[i];
+			}
+			m_entries.push_back(entry);
+		}
+
+		void write(const string &file) const
+		{
+			CatalogHeader header;
+			memcpy(header.magic, MAGIC, sizeof(MAGIC));
+			header.byteOrderMark = BYTE_ORDER_MARK;
+			header.formatVersion = FORMAT_VERSION;
+			header.entryCount = m_entries.size();
+			header.poolOffset = sizeof(CatalogHeader) + m_entries.size() * sizeof(CatalogEntry);
+			header.poolSize = m_pool.size();
+
+			struct iovec content[] = {{&header, sizeof(header)},
+					{const_cast<CatalogEntry *>(m_entries.data()), m_entries.size() * sizeof(CatalogEntry)},
+					{const_cast<char *>(m_pool.data()), m_pool.size()}};
+
+			/*
+			 * The catalog is replaced atomically so that readers never see a partially written one. Its content
+			 * is flushed before the replacement so that a crash does not leave an empty catalog behind.
+			 */
+			AtomicFile out(file.c_str());
+			writeAllV(out.fd(), content, 3);
+			out.commit(SyncMode::file);
+		}
+	private:
+		CatalogEntry newEntry(const FileInfo &file, const uint32_t version, const bool compressed, const bool valid)
+		{
+			CatalogEntry entry;
+			entry.mtime = file.mtime;
+			entry.size = file.size;
+			entry.pathOffset = static_cast<uint32_t>(m_pool.size());
+			entry.pathSize = static_cast<uint32_t>(file.path.size());
+			m_pool.append(file.path.c_str(), file.path.size() + 1);
+			entry.version = version;
+			entry.format = compressed ? 1 : 0;
+			entry.valid = valid ? 1 : 0;
+			entry.reserved = 0;
+			return entry;
+		}
+
+		uint32_t addTag(const char16_t * const value, const size_t size)
+		{
+			if (m_pool.size() % 2 != 0) { // the code units are accessed in place
+				m_pool.push_back('\0');
+			}
+			const uint32_t offset = static_cast<uint32_t>(m_pool.size());
+			m_pool.append(reinterpret_cast<const char *>(value), size * sizeof(char16_t));
+			return offset;
+		}
+
+		vector<CatalogEntry> m_entries;
+		string m_pool;
+	};
+}
+
+const char * const vgm::Catalog::FILE_NAME = ".vgmtag-catalog";
+
+vgm::Catalog::Catalog(const string &file)
+	: m_mapping(nullptr), m_mappingSize(0), m_entries(nullptr), m_entryCount(0), m_pool(nullptr), m_poolSize(0)
+{
+	const int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			return;
+		}
+		throw Exception("Unable to open the catalog file"_s);
+	}
+	struct stat fileStat;
+	if (::fstat(fd, &fileStat) != 0) {
+		::close(fd);
+		throw Exception("Unable to open the catalog file"_s);
+	}
+	const size_t size = static_cast<size_t>(fileStat.st_size);
+	if (size < sizeof(CatalogHeader)) {
+		::close(fd);
+		return;
+	}
+	void * const mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd); // the mapping stays valid
+	if (mapping == MAP_FAILED) {
+		throw Exception("Unable to map the catalog file into memory"_s);
+	}
+	m_mapping = mapping;
+	m_mappingSize = size;
+
+	const CatalogHeader &header = *static_cast<const CatalogHeader *>(mapping);
+	if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.byteOrderMark != BYTE_ORDER_MARK ||
+			header.formatVersion != FORMAT_VERSION ||
+			header.entryCount > (size - sizeof(CatalogHeader)) / sizeof(CatalogEntry) ||
+			header.poolOffset != sizeof(CatalogHeader) + header.entryCount * sizeof(CatalogEntry) ||
+			header.poolSize != size - header.poolOffset) {
+		return; // the catalog will be rebuilt from scratch
+	}
+	m_entries = reinterpret_cast<const CatalogEntry *>(static_cast<const char *>(mapping) + sizeof(CatalogHeader));
+	m_entryCount = header.entryCount;
+	m_pool = static_cast<const char *>(mapping) + header.poolOffset;
+	m_poolSize = header.poolSize;
+}
+
+vgm::Catalog::~Catalog()
+{
+	if (m_mapping != nullptr) {
+		::munmap(m_mapping, m_mappingSize);
+	}
+}
+
+const char *vgm::Catalog::path(const CatalogEntry &entry) const
+{
+	// The path must be NUL-terminated within the pool.
+	if (entry.pathOffset >= m_poolSize || entry.pathSize >= m_poolSize - entry.pathOffset ||
+			m_pool[entry.pathOffset + entry.pathSize] != '\0') {
+		throw Exception("Malformed catalog file"_s);
+	}
+	return m_pool + entry.pathOffset;
+}
+
+const char16_t *vgm::Catalog::tag(const CatalogEntry &entry, const VGMFile::Tag tag) const
+{
+	const size_t i = static_cast<size_t>(tag);
+	const size_t offset = entry.tagOffsets[i];
+	// The code units are accessed in place so they must be aligned.
+	if (offset > m_poolSize || offset % sizeof(char16_t) != 0 ||
+			entry.tagSizes[i] > (m_poolSize - offset) / sizeof(char16_t)) {
+		throw Exception("Malformed catalog file"_s);
+	}
+	return reinterpret_cast<const char16_t *>(m_pool + offset);
+}
+
+const CatalogEntry *vgm::Catalog::find(const char * const path) const
+{
+	const CatalogEntry * const end = m_entries + m_entryCount;
+	const CatalogEntry * const entry = lower_bound(m_entries, end, path,
+			[this](const CatalogEntry &e, const char * const p) { return strcmp(this->path(e), p) < 0; });
+	return entry != end && strcmp(this->path(*entry), path) == 0 ? entry : nullptr;
+}
+
+CatalogUpdate vgm::updateCatalog(const string &dir, const unsigned threadCount,
+		const function<void(const string &path, const char *message)> &onError)
+{
+	// The entries are sorted by path so that they can be looked up with a binary search.
+	vector<FileInfo> files;
+	findVGMFiles(dir, files);
+
+	const string catalogFile = dir + '/' + Catalog::FILE_NAME;
+	const Catalog catalog(catalogFile);
+
+	// The files that are not in the catalog or that were modified since it was written are parsed again.
+	vector<const CatalogEntry *> oldEntries(files.size());
+	vector<size_t> changed;
+	size_t catalogued = 0;
+	for (size_t i = 0; i < files.size(); ++i) {
+		const CatalogEntry * const old = catalog.find(files[i].path.c_str());
+		if (old == nullptr) {
+			changed.push_back(i);
+			continue;
+		}
+		++catalogued;
+		if (old->mtime == files[i].mtime && old->size == files[i].size) {
+			oldEntries[i] = old;
+		} else {
+			changed.push_back(i);
+		}
+	}
+	CatalogUpdate update = {files.size(), changed.size(), 0, catalog.size() - catalogued};
+
+	vector<string> paths;
+	paths.reserve(changed.size());
+	for (const size_t i : changed) {
+		paths.push_back(dir + '/' + files[i].path);
+	}
+	vector<unique_ptr<ParsedFile>> parsed(changed.size());
+	parseFiles(paths, threadCount, [&](const size_t i) -> ParseHandler &
+			{
+				parsed[i].reset(new ParsedFile());
+				return parsed[i]->handler;
+			},
+			[&](const size_t i, const char * const error)
+			{
+				if (error != nullptr) {
+					parsed[i].reset(new ParsedFile()); // the tags parsed so far are discarded
+					parsed[i]->error = error;
+				} else {
+					parsed[i]->valid = true;
+				}
+			});
+	for (size_t i = 0; i < changed.size(); ++i) {
+		if (!parsed[i]->valid) {
+			++update.failedCount;
+			onError(paths[i], parsed[i]->error.c_str());
+		}
+	}
+
+	CatalogBuilder builder;
+	for (size_t i = 0, j = 0; i < files.size(); ++i) {
+		if (oldEntries[i] != nullptr) {
+			builder.add(files[i], catalog, *oldEntries[i]);
+		} else {
+			builder.add(files[i], *parsed[j++]);
+		}
+	}
+	builder.write(catalogFile);
+	return update;
+}
@@ -0,0 +1,117 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_CATALOG_H_
+#define VGM_CATALOG_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "vgm.h"
+
+namespace vgm
+{
+	/*
+	 * An entry of the catalog. The catalog file is an array of entries sorted by path that is followed by
+	 * a pool of strings the entries refer to. The file is stored in the native byte order and layout, so that
+	 * it can be used while mapped into memory without being parsed.
+	 */
+	struct CatalogEntry
+	{
+		// The modification time of the file in nanoseconds since the epoch.
+		int64_t mtime;
+		uint64_t size;
+		// The NUL-terminated path relative to the catalogued directory, in the string pool.
+		uint32_t pathOffset;
+		uint32_t pathSize;
+		uint32_t version;
+		// 0 for VGM, 1 for VGZ.
+		uint8_t format;
+		// 0 if the file could not be parsed. The tags of such an entry are empty.
+		uint8_t valid;
+		uint16_t reserved;
+		// The tags as UTF-16 code units (not NUL-terminated) in the string pool.
+		uint32_t tagOffsets[static_cast<std::size_t>(VGMFile::Tag::notes) + 1];
+		uint32_t tagSizes[static_cast<std::size_t>(VGMFile::Tag::notes) + 1];
+	};
+
+	// A catalog file mapped into memory (read-only).
+	class Catalog
+	{
+	public:
+		// The name of the catalog file within the catalogued directory.
+		static const char * const FILE_NAME;
+
+		/* Maps the catalog file into memory. A catalog file that does not exist, or that was written on
+		 * a platform with another byte order or by another version of the program, is an empty catalog.
+		 */
+		explicit Catalog(const std::string &file);
+		~Catalog();
+
+		std::size_t size() const { return m_entryCount; }
+		const CatalogEntry &operator[](const std::size_t i) const { return m_entries[i]; }
+
+		/* The path and the tags of an entry are checked to lie within the string pool when they are accessed.
+		 * Throws afc::Exception if the entry refers to octets beyond the pool.
+		 */
+		const char *path(const CatalogEntry &entry) const;
+		const char16_t *tag(const CatalogEntry &entry, const VGMFile::Tag tag) const;
+
+		std::size_t tagSize(const CatalogEntry &entry, const VGMFile::Tag tag) const
+		{
+			return entry.tagSizes[static_cast<std::size_t>(tag)];
+		}
+
+		// Returns the entry of the file with the given relative path, or nullptr if there is no such entry.
+		const CatalogEntry *find(const char *path) const;
+	private:
+		Catalog(const Catalog &) = delete;
+		Catalog &operator=(const Catalog &) = delete;
+
+		void *m_mapping;
+		std::size_t m_mappingSize;
+		const CatalogEntry *m_entries;
+		std::size_t m_entryCount;
+		const char *m_pool;
+		std::size_t m_poolSize;
+	};
+
+	struct CatalogUpdate
+	{
+		// The number of files in the catalog.
+		std::size_t fileCount;
+		// The number of new or modified files that were parsed.
+		std::size_t parsedCount;
+		// The number of files that were parsed and turned out to be not valid VGM/VGZ files.
+		std::size_t failedCount;
+		// The number of files that were removed from the directory since the previous update.
+		std::size_t removedCount;
+	};
+
+	/*
+	 * Walks the directory recursively and updates its catalog, i.e. the file Catalog::FILE_NAME in it, so that
+	 * it describes all the files with the .vgm and .vgz extensions there. Only the files whose modification time
+	 * or size differ from those in the catalog are parsed, with up to threadCount threads. The errors of parsing
+	 * are reported with onError(path, message) in the order of the paths. The catalog file is replaced
+	 * atomically. Throws afc::Exception if the directory cannot be read, if the existing catalog is malformed,
+	 * or if the catalog cannot be written.
+	 */
+	CatalogUpdate updateCatalog(const std::string &dir, const unsigned threadCount,
+			const std::function<void(const std::string &path, const char *message)> &onError);
+}
+
+#endif // VGM_CATALOG_H_
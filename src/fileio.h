@@ -0,0 +1,234 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_FILEIO_H_
+#define VGM_FILEIO_H_
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+// Helpers for the file I/O that goes past afc streams and deals with file descriptors directly.
+namespace vgm
+{
+	inline void writeAt(const int fd, const unsigned char *buf, std::size_t n, off_t offset)
+	{
+		using afc::operator"" _s;
+
+		while (n > 0) {
+			const ssize_t written = ::pwrite(fd, buf, n, offset);
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw afc::Exception("Unable to write to file"_s);
+			}
+			buf += written;
+			n -= written;
+			offset += written;
+		}
+	}
+
+	inline void writeAll(const int fd, const unsigned char *buf, std::size_t n)
+	{
+		using afc::operator"" _s;
+
+		while (n > 0) {
+			const ssize_t written = ::write(fd, buf, n);
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw afc::Exception("Unable to write to file"_s);
+			}
+			buf += written;
+			n -= written;
+		}
+	}
+
+	/* Writes the content of count buffers to fd. The buffer descriptors are modified. There can be more than
+	 * IOV_MAX buffers; writev() is called for at most IOV_MAX of them at once.
+	 */
+	inline void writeAllV(const int fd, struct iovec *iov, std::size_t count)
+	{
+		using afc::operator"" _s;
+
+		while (count > 0) {
+			const ssize_t written = ::writev(fd, iov, static_cast<int>(count < IOV_MAX ? count : IOV_MAX));
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw afc::Exception("Unable to write to file"_s);
+			}
+			size_t remaining = written;
+			while (count > 0 && remaining >= iov->iov_len) {
+				remaining -= iov->iov_len;
+				++iov;
+				--count;
+			}
+			if (count > 0) {
+				iov->iov_base = static_cast<unsigned char *>(iov->iov_base) + remaining;
+				iov->iov_len -= remaining;
+			}
+		}
+	}
+
+	// Opens the file for writing. The file is created if it does not exist, or truncated otherwise.
+	inline int createFile(const char * const path)
+	{
+		using afc::operator"" _s;
+
+		const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd == -1) {
+			throw afc::Exception("Unable to open file"_s);
+		}
+		return fd;
+	}
+
+	inline void closeFile(const int fd)
+	{
+		using afc::operator"" _s;
+
+		if (::close(fd) != 0) {
+			throw afc::Exception("Unable to close file"_s);
+		}
+	}
+
+	// How durably a file is written.
+	enum class SyncMode
+	{
+		// The content is left in the page cache to be written back by the system.
+		none,
+		// The content of the file is flushed to the storage device before the file replaces its destination.
+		file,
+		// In addition, the directory entry of the file is flushed after the replacement.
+		full
+	};
+
+	/*
+	 * A file that is written atomically: the content is written to a temporary file in the directory of
+	 * the destination, which replaces the destination with a single rename() on commit(). Concurrent readers
+	 * see either the old or the new content, and the destination is left intact if writing fails. The
+	 * temporary file is removed if the AtomicFile is destroyed without being committed.
+	 *
+	 * If the destination exists then its permissions (and its owner, if possible) are preserved. If it is
+	 * a symbolic link then the file the link refers to is replaced.
+	 */
+	class AtomicFile
+	{
+	public:
+		explicit AtomicFile(const char * const dest) : m_fd(-1)
+		{
+			using afc::operator"" _s;
+
+			struct stat destStat;
+			const bool exists = ::stat(dest, &destStat) == 0;
+			char resolved[PATH_MAX];
+			m_dest = exists && ::realpath(dest, resolved) != nullptr ? resolved : dest;
+
+			const std::size_t slash = m_dest.rfind('/');
+			const std::string dir = slash == std::string::npos ? std::string(".") : m_dest.substr(0, slash + 1);
+			const std::string name = slash == std::string::npos ? m_dest : m_dest.substr(slash + 1);
+			static std::atomic<unsigned> counter(0);
+			for (unsigned attempt = 0; m_fd == -1; ++attempt) {
+				char suffix[32];
+				std::snprintf(suffix, sizeof(suffix), ".%ld.%u.tmp", static_cast<long>(::getpid()), counter++);
+				m_tmp = (slash == std::string::npos ? std::string() : dir) + '.' + name + suffix;
+				m_fd = ::open(m_tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+				if (m_fd == -1 && (errno != EEXIST || attempt == 100)) {
+					throw afc::Exception("Unable to create a temporary file"_s);
+				}
+			}
+			if (exists) {
+				::fchmod(m_fd, destStat.st_mode & 07777);
+				// Only the superuser can change the owner; the owner of the new file is kept otherwise.
+				if (::fchown(m_fd, destStat.st_uid, destStat.st_gid) != 0) {
+					::fchmod(m_fd, destStat.st_mode & 0777);
+				}
+			}
+		}
+
+		~AtomicFile()
+		{
+			if (m_fd != -1) {
+				::close(m_fd);
+			}
+			if (!m_tmp.empty()) {
+				::unlink(m_tmp.c_str());
+			}
+		}
+
+		int fd() const { return m_fd; }
+
+		void commit(const SyncMode sync)
+		{
+			using afc::operator"" _s;
+
+			if (sync != SyncMode::none && ::fdatasync(m_fd) != 0) {
+				throw afc::Exception("Unable to flush file"_s);
+			}
+			const int fd = m_fd;
+			m_fd = -1;
+			closeFile(fd);
+			if (::rename(m_tmp.c_str(), m_dest.c_str()) != 0) {
+				throw afc::Exception("Unable to replace file"_s);
+			}
+			m_tmp.clear();
+			if (sync == SyncMode::full) {
+				const std::size_t slash = m_dest.rfind('/');
+				const std::string dir = slash == std::string::npos ? std::string(".") :
+						slash == 0 ? std::string("/") : m_dest.substr(0, slash);
+				const int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (dirFd == -1 || ::fsync(dirFd) != 0) {
+					if (dirFd != -1) {
+						::close(dirFd);
+					}
+					throw afc::Exception("Unable to flush directory"_s);
+				}
+				::close(dirFd);
+			}
+		}
+	private:
+		AtomicFile(const AtomicFile &) = delete;
+		AtomicFile &operator=(const AtomicFile &) = delete;
+
+		std::string m_dest;
+		std::string m_tmp;
+		int m_fd;
+	};
+
+	inline bool isSameFile(const char * const file1, const char * const file2)
+	{
+		struct stat stat1, stat2;
+		return ::stat(file1, &stat1) == 0 && ::stat(file2, &stat2) == 0 &&
+				stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino;
+	}
+}
+
+#endif // VGM_FILEIO_H_
@@ -0,0 +1,269 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "fingerprint.h"
+#include "parallel.h"
+#include "parser.h"
+#include "tree.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+using vgm::FileInfo;
+using vgm::Fingerprint;
+using vgm::FingerprintedFile;
+using vgm::ParseHandler;
+
+const size_t vgm::XXH64Hasher::STRIPE_SIZE;
+
+namespace
+{
+	const uint64_t PRIME_1 = 0x9e3779b185ebca87, PRIME_2 = 0xc2b2ae3d27d4eb4f, PRIME_3 = 0x165667b19e3779f9,
+			PRIME_4 = 0x85ebca77c2b2ae63, PRIME_5 = 0x27d4eb2f165667c5;
+
+	inline uint64_t rotl(const uint64_t x, const unsigned n)
+	{
+		return (x << n) | (x >> (64 - n));
+	}
+
+	inline uint64_t read64(const unsigned char * const p)
+	{
+		uint64_t value;
+		memcpy(&value, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		return value;
+#else
+		return __builtin_bswap64(value);
+#endif
+	}
+
+	inline uint32_t read32(const unsigned char * const p)
+	{
+		uint32_t value;
+		memcpy(&value, p, 4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		return value;
+#else
+		return __builtin_bswap32(value);
+#endif
+	}
+
+	inline uint64_t round(uint64_t lane, const uint64_t input)
+	{
+		lane += input * PRIME_2;
+		return rotl(lane, 31) * PRIME_1;
+	}
+
+	inline uint64_t mergeRound(uint64_t hash, const uint64_t lane)
+	{
+		hash ^= round(0, lane);
+		return hash * PRIME_1 + PRIME_4;
+	}
+
+	/* Consumes the whole stripes at data. The four lanes are independent so that their rounds are
+	 * executed in parallel by the CPU.
+	 */
+	inline const unsigned char *consumeStripes(uint64_t lanes[], const unsigned char *data, const unsigned char * const end)
+	{
+		uint64_t lane0 = lanes[0], lane1 = lanes[1], lane2 = lanes[2], lane3 = lanes[3];
+		for (; end - data >= 32; data += 32) {
+			lane0 = round(lane0, read64(data));
+			lane1 = round(lane1, read64(data + 8));
+			lane2 = round(lane2, read64(data + 16));
+			lane3 = round(lane3, read64(data + 24));
+		}
+		lanes[0] = lane0;
+		lanes[1] = lane1;
+		lanes[2] = lane2;
+		lanes[3] = lane3;
+		return data;
+	}
+
+	class HashingHandler : public ParseHandler
+	{
+	public:
+		bool wantsData() const override { return true; }
+
+		void data(const unsigned char * const chunk, const size_t size) override
+		{
+			m_hasher.update(chunk, size);
+			m_dataSize += size;
+		}
+
+		Fingerprint fingerprint() const { return Fingerprint{m_hasher.digest(), m_dataSize}; }
+	private:
+		vgm::XXH64Hasher m_hasher;
+		uint64_t m_dataSize = 0;
+	};
+
+	struct Result
+	{
+		Fingerprint fingerprint;
+		string error;
+	};
+}
+
+vgm::XXH64Hasher::XXH64Hasher() : m_stripeSize(0), m_totalSize(0)
+{
+	m_lanes[0] = PRIME_1 + PRIME_2;
+	m_lanes[1] = PRIME_2;
+	m_lanes[2] = 0;
+	m_lanes[3] = 0 - PRIME_1;
+}
+
+void vgm::XXH64Hasher::update(const unsigned char *data, size_t size)
+{
+	m_totalSize += size;
+	if (m_stripeSize > 0) {
+		const size_t n = min(size, STRIPE_SIZE - m_stripeSize);
+		memcpy(m_stripe + m_stripeSize, data, n);
+		m_stripeSize += n;
+		data += n;
+		size -= n;
+		if (m_stripeSize < STRIPE_SIZE) {
+			return;
+		}
+		consumeStripes(m_lanes, m_stripe, m_stripe + STRIPE_SIZE);
+		m_stripeSize = 0;
+	}
+	const unsigned char * const end = data + size;
+	data = consumeStripes(m_lanes, data, end);
+	m_stripeSize = static_cast<size_t>(end - data);
+	if (m_stripeSize > 0) {
+		memcpy(m_stripe, data, m_stripeSize);
+	}
+}
+
+uint64_t vgm::XXH64Hasher::digest() const
+{
+	uint64_t hash;
+	if (m_totalSize >= STRIPE_SIZE) {
+		hash = rotl(m_lanes[0], 1) + rotl(m_lanes[1], 7) + rotl(m_lanes[2], 12) + rotl(m_lanes[3], 18);
+		for (const uint64_t lane : m_lanes) {
+			hash = mergeRound(hash, lane);
+		}
+	} else {
+		hash = PRIME_5;
+	}
+	hash += m_totalSize;
+
+	const unsigned char *p = m_stripe;
+	const unsigned char * const end = m_stripe + m_stripeSize;
+	for (; end - p >= 8; p += 8) {
+		hash ^= round(0, read64(p));
+		hash = rotl(hash, 27) * PRIME_1 + PRIME_4;
+	}
+	if (end - p >= 4) {
+		hash ^= static_cast<uint64_t>(read32(p)) * PRIME_1;
+		hash = rotl(hash, 23) * PRIME_2 + PRIME_3;
+		p += 4;
+	}
+	for (; p != end; ++p) {
+		hash ^= *p * PRIME_5;
+		hash = rotl(hash, 11) * PRIME_1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= PRIME_2;
+	hash ^= hash >> 29;
+	hash *= PRIME_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+Fingerprint vgm::fingerprintFile(const string &path)
+{
+	const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		throw Exception("Unable to open file"_s);
+	}
+	HashingHandler handler;
+	try {
+		parse(fd, handler);
+	}
+	catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+	return handler.fingerprint();
+}
+
+vector<FingerprintedFile> vgm::fingerprintTree(const string &dir, const unsigned threadCount,
+		const function<void(const string &path, const char *message)> &onError)
+{
+	vector<FileInfo> files;
+	findVGMFiles(dir, files);
+
+	vector<Result> results(files.size());
+	vector<FingerprintedFile> fingerprinted;
+	fingerprinted.reserve(files.size());
+	runOrdered(files.size(), threadCount, [&](const size_t i)
+			{
+				Result &result = results[i];
+				try {
+					result.fingerprint = fingerprintFile(dir + '/' + files[i].path);
+				}
+				catch (Exception &ex) {
+					result.error = ex.what();
+				}
+				catch (std::exception &ex) {
+					result.error = ex.what();
+				}
+				catch (...) {
+					result.error = "Unknown error";
+				}
+			},
+			[&](const size_t i)
+			{
+				const Result &result = results[i];
+				if (result.error.empty()) {
+					fingerprinted.push_back(FingerprintedFile{move(files[i].path), result.fingerprint});
+				} else {
+					onError(dir + '/' + files[i].path, result.error.c_str());
+				}
+			});
+	return fingerprinted;
+}
+
+vector<vector<const FingerprintedFile *>> vgm::findDuplicates(const vector<FingerprintedFile> &files)
+{
+	map<Fingerprint, vector<const FingerprintedFile *>> byFingerprint;
+	for (const FingerprintedFile &file : files) {
+		byFingerprint[file.fingerprint].push_back(&file);
+	}
+	vector<vector<const FingerprintedFile *>> groups;
+	for (auto &entry : byFingerprint) {
+		if (entry.second.size() > 1) {
+			groups.push_back(move(entry.second));
+		}
+	}
+	// The files are in the order given within each group, so the first ones give the order of the groups.
+	sort(groups.begin(), groups.end(),
+			[](const vector<const FingerprintedFile *> &g1, const vector<const FingerprintedFile *> &g2)
+			{
+				return g1.front() < g2.front();
+			});
+	return groups;
+}
@@ -0,0 +1,90 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_FINGERPRINT_H_
+#define VGM_FINGERPRINT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace vgm
+{
+	/*
+	 * Computes the XXH64 hash (with the seed 0) of a stream of octets that is fed in chunks of any size.
+	 * The hash is the same as any other XXH64 implementation computes for the whole stream, e.g. xxhsum -H64.
+	 */
+	class XXH64Hasher
+	{
+	public:
+		XXH64Hasher();
+
+		void update(const unsigned char *data, std::size_t size);
+		uint64_t digest() const;
+	private:
+		static const std::size_t STRIPE_SIZE = 32;
+
+		uint64_t m_lanes[4];
+		// The beginning of the stripe that is not complete yet.
+		unsigned char m_stripe[STRIPE_SIZE];
+		std::size_t m_stripeSize;
+		uint64_t m_totalSize;
+	};
+
+	/* The identity of the VGM data of a file, which does not depend on the header, on the GD3 info and on
+	 * whether the file is compressed.
+	 */
+	struct Fingerprint
+	{
+		// The XXH64 hash of the VGM data.
+		uint64_t hash;
+		uint64_t dataSize;
+
+		bool operator==(const Fingerprint &o) const { return hash == o.hash && dataSize == o.dataSize; }
+		bool operator<(const Fingerprint &o) const
+		{
+			return hash < o.hash || (hash == o.hash && dataSize < o.dataSize);
+		}
+	};
+
+	/* Computes the fingerprint of the VGM/VGZ file, streaming its VGM data through the hash without holding
+	 * it in memory. Throws afc::Exception if the file cannot be parsed.
+	 */
+	Fingerprint fingerprintFile(const std::string &path);
+
+	struct FingerprintedFile
+	{
+		// The path relative to the directory fingerprinted.
+		std::string path;
+		Fingerprint fingerprint;
+	};
+
+	/*
+	 * Fingerprints the VGM/VGZ files in the directory and its subdirectories using up to threadCount threads.
+	 * Returns the files fingerprinted, sorted by path. onError is called with the path of each file that cannot
+	 * be parsed (prefixed with dir), in the order of their paths. Throws afc::Exception if the directory cannot be read.
+	 */
+	std::vector<FingerprintedFile> fingerprintTree(const std::string &dir, const unsigned threadCount,
+			const std::function<void(const std::string &path, const char *message)> &onError);
+
+	/* Returns the groups of two or more files with equal fingerprints. The files of each group are in the order
+	 * they are given, and the groups are in the order of their first files.
+	 */
+	std::vector<std::vector<const FingerprintedFile *>> findDuplicates(const std::vector<FingerprintedFile> &files);
+}
+
+#endif // VGM_FINGERPRINT_H_
@@ -0,0 +1,269 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_FORMAT_H_
+#define VGM_FORMAT_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#include <afc/cpu/primitive.h>
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+// The layout rules and the encoding of the VGM format that are shared by VGMFile and the streaming parser and writer.
+namespace vgm
+{
+namespace format
+{
+	// The byte order of all the numbers and the text stored in VGM files.
+	const afc::endianness LE = afc::endianness::LE;
+
+	const uint32_t VERSION_1_00 = 0x00000100, VERSION_1_01 = 0x00000101, VERSION_1_10 = 0x00000110,
+			VERSION_1_50 = 0x00000150, VERSION_1_51 = 0x00000151, VERSION_1_60 = 0x00000160,
+			VERSION_1_61 = 0x00000161;
+
+	// The minimal normalised header size of supported VGM file formats in octets.
+	const std::size_t SHORT_HEADER_SIZE = 0x40;
+	// The maximal normalised header size of supported VGM file formats in octets.
+	const std::size_t LONG_HEADER_SIZE = 0xc0;
+
+	/* For versions prior to 1.50, VGM data offset should be 0 and the VGM data must start
+	 * at absolute offset 0x40 (relative 0x0c).
+	 */
+	const std::size_t DEFAULT_VGM_DATA_OFFSET = 0x0c;
+
+	// Absolute positions of VGM header constituents in the header.
+	const uint32_t POS_EOF = 0x4, POS_GD3 = 0x14, POS_VGM_DATA = 0x34;
+
+	// Index values to access VGM header elements, i.e. little-endian 32-bit words.
+	const uint32_t IDX_ID = 0x00, IDX_EOF_OFFSET = 0x01, IDX_VERSION = 0x02, IDX_GD3_OFFSET = 0x05,
+			IDX_RATE = 0x09, IDX_YM2612_CLOCK = 0x0b, IDX_YM2151_CLOCK = 0x0c, IDX_VGM_DATA_OFFSET = 0x0d;
+
+	// The maximal number of elements of the VGM header (for all supported versions).
+	const std::size_t HEADER_ELEMENT_COUNT = LONG_HEADER_SIZE / 4;
+
+	/* Despite of the platform endianness these values are stored in files in the little-endian format and
+	   are converted into the platform format while parsing the file. */
+	const uint32_t VGM_FILE_ID = 0x206d6756; // 'Vgm ' in ASCII as 4 bytes casted to little-endian int32.
+	const uint32_t GD3_ID = 0x20336447; // 'Gd3 ' as 4 bytes casted to little-endian int32
+	const uint32_t GD3_VERSION = 0x00000100;
+	const std::size_t GD3_HEADER_SIZE = 0x0c;
+	// The number of tags in the GD3 info, from the title to the notes.
+	const std::size_t GD3_TAG_COUNT = 11;
+
+	// The sections of a VGM file as its header describes them. All the offsets are absolute.
+	struct Layout
+	{
+		// The number of octets of the header stored in the file, which is less than 0xc0 if the VGM data starts earlier.
+		std::size_t headerSize;
+		std::size_t dataOffset;
+		std::size_t dataSize;
+		// Zero if there is no GD3 info.
+		std::size_t gd3Offset;
+		// The number of octets from the GD3 offset to the VGM data that follows it or to the end of the file.
+		std::size_t gd3Size;
+		std::size_t fileSize;
+	};
+
+	inline bool isSupportedVersion(const uint32_t ver)
+	{
+		return ver == VERSION_1_00 || ver == VERSION_1_01 || ver == VERSION_1_10 || ver == VERSION_1_50 ||
+				ver == VERSION_1_51 || ver == VERSION_1_60 || ver == VERSION_1_61;
+	}
+
+	inline std::size_t headerSize(const uint32_t ver)
+	{
+		return ver < VERSION_1_51 ? SHORT_HEADER_SIZE : LONG_HEADER_SIZE;
+	}
+
+	/*
+	 * Returns the layout described by the base header, given as the first SHORT_HEADER_SIZE / 4 header elements.
+	 * Throws afc::Exception if it is not a header of a supported VGM version, or if the sections it describes
+	 * do not fit into the file.
+	 */
+	inline Layout readLayout(const uint32_t elements[])
+	{
+		using afc::operator"" _s;
+
+		if (elements[IDX_ID] != VGM_FILE_ID) {
+			throw afc::Exception("Not a VGM/VGZ file"_s);
+		}
+		const uint32_t ver = elements[IDX_VERSION];
+		if (!isSupportedVersion(ver)) {
+			throw afc::Exception("Unsupported VGM version"_s);
+		}
+
+		Layout layout;
+		layout.dataOffset = POS_VGM_DATA + (ver < VERSION_1_50 ? DEFAULT_VGM_DATA_OFFSET : elements[IDX_VGM_DATA_OFFSET]);
+		layout.headerSize = SHORT_HEADER_SIZE;
+		if (ver >= VERSION_1_51) {
+			// If the VGM data starts at an offset that is lower than 0xC0, the overlapping header values are not stored.
+			layout.headerSize = std::max(SHORT_HEADER_SIZE, std::min(layout.dataOffset & ~static_cast<std::size_t>(3),
+					LONG_HEADER_SIZE));
+		}
+		layout.fileSize = POS_EOF + static_cast<std::size_t>(elements[IDX_EOF_OFFSET]);
+		layout.gd3Offset = elements[IDX_GD3_OFFSET] == 0 ? 0 : POS_GD3 + static_cast<std::size_t>(elements[IDX_GD3_OFFSET]);
+		// The VGM data takes the space up to the GD3 info that follows it, or up to the end of the file.
+		const std::size_t dataEnd = layout.gd3Offset > layout.dataOffset ? layout.gd3Offset : layout.fileSize;
+		if (layout.dataOffset < layout.headerSize || dataEnd < layout.dataOffset || layout.fileSize < dataEnd ||
+				(layout.gd3Offset != 0 && (layout.gd3Offset < layout.headerSize || layout.gd3Offset > layout.fileSize))) {
+			throw afc::Exception("Malformed VGM file"_s);
+		}
+		layout.dataSize = dataEnd - layout.dataOffset;
+		layout.gd3Size = layout.gd3Offset == 0 ? 0 :
+				(layout.gd3Offset < layout.dataOffset ? layout.dataOffset : layout.fileSize) - layout.gd3Offset;
+		return layout;
+	}
+
+	/*
+	 * Returns the length of the tag block declared by the GD3 header of GD3_HEADER_SIZE octets at src,
+	 * with the GD3 info taking gd3Size octets of the file (see Layout). Throws afc::Exception if it is not
+	 * a GD3 header of the supported version, or if the tag block does not fit into the GD3 info.
+	 */
+	inline uint32_t readGD3Header(const unsigned char * const src, const std::size_t gd3Size)
+	{
+		using afc::operator"" _s;
+		using afc::UInt32;
+
+		if (UInt32<>::fromBytes<LE>(src) != GD3_ID) {
+			throw afc::Exception("Not a VGM file"_s);
+		}
+		if (UInt32<>::fromBytes<LE>(src + 4) != GD3_VERSION) {
+			throw afc::Exception("Unsupported GD3 version"_s);
+		}
+		const uint32_t length = UInt32<>::fromBytes<LE>(src + 8);
+		// Checked before the tag block is allocated.
+		if (gd3Size < GD3_HEADER_SIZE || length > gd3Size - GD3_HEADER_SIZE) {
+			throw afc::Exception("Malformed VGM file"_s);
+		}
+		return length;
+	}
+
+	// Encodes the GD3 header with the given length of the tag block into GD3_HEADER_SIZE octets at dest.
+	inline void encodeGD3Header(const std::size_t length, unsigned char * const dest)
+	{
+		using afc::UInt32;
+
+		UInt32<>(GD3_ID).toBytes<LE>(dest);
+		UInt32<>(GD3_VERSION).toBytes<LE>(dest + 4);
+		UInt32<>(static_cast<uint32_t>(length)).toBytes<LE>(dest + 8);
+	}
+
+	/* Returns the offset of the first UTF-16 NUL code unit within the n octets at p (n must be even),
+	 * or n if there is no NUL code unit there.
+	 */
+	inline std::size_t findTagEnd(const unsigned char * const p, const std::size_t n)
+	{
+		std::size_t i = 0;
+#ifdef __SSE2__
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= n; i += 16) {
+			const __m128i codeUnits = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+			const int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(codeUnits, zero));
+			if (mask != 0) {
+				// Both octets of a matching code unit are set in the mask, so the result is even.
+				return i + __builtin_ctz(static_cast<unsigned>(mask));
+			}
+		}
+#endif
+		for (; i < n; i += 2) {
+			if (p[i] == 0 && p[i + 1] == 0) {
+				return i;
+			}
+		}
+		return n;
+	}
+
+	/*
+	 * Splits the UTF-16LE tag block of blockSize octets (blockSize must be even) into GD3_TAG_COUNT tags
+	 * by their NUL terminators, storing the offset and the size in octets of each tag. If the block is
+	 * truncated then its end terminates the current tag and the remaining tags are empty. Returns the number
+	 * of octets the tags take, including their terminators.
+	 */
+	inline std::size_t splitGD3Tags(const unsigned char * const block, const std::size_t blockSize,
+			std::size_t offsets[GD3_TAG_COUNT], std::size_t sizes[GD3_TAG_COUNT])
+	{
+		std::size_t pos = 0;
+		for (std::size_t i = 0; i < GD3_TAG_COUNT; ++i) {
+			const std::size_t tagSize = findTagEnd(block + pos, blockSize - pos);
+			offsets[i] = pos;
+			sizes[i] = tagSize;
+			pos = std::min(pos + tagSize + 2, blockSize);
+		}
+		return pos;
+	}
+
+	// Decodes charCount UTF-16LE code units at src into dest.
+	inline void decodeUTF16LE(const unsigned char * const src, const std::size_t charCount, char16_t * const dest)
+	{
+		for (std::size_t i = 0; i < charCount; ++i) {
+			dest[i] = afc::UInt16<>::fromBytes<LE>(src + 2*i);
+		}
+	}
+
+	// Encodes charCount code units at src into 2 * charCount octets at dest in UTF-16LE.
+	inline void encodeUTF16LE(const char16_t * const src, const std::size_t charCount, unsigned char * const dest)
+	{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		if (charCount > 0) {
+			std::memcpy(dest, src, 2*charCount);
+		}
+#else
+		for (std::size_t i = 0; i < charCount; ++i) {
+			afc::UInt16<>(src[i]).toBytes<LE>(dest + 2*i);
+		}
+#endif
+	}
+
+	/*
+	 * Updates the header elements so that they describe the normalised layout
+	 * header -> data -> gd3 -> eof, with the header of headerSize(version) octets.
+	 */
+	inline void normaliseHeader(uint32_t elements[HEADER_ELEMENT_COUNT], const std::size_t dataSize,
+			const std::size_t gd3InfoSize)
+	{
+		const uint32_t ver = elements[IDX_VERSION];
+		const std::size_t hdrSize = headerSize(ver);
+
+		elements[IDX_EOF_OFFSET] = hdrSize + dataSize + gd3InfoSize - POS_EOF;
+		// The GD3 info is always written right after the VGM data.
+		elements[IDX_GD3_OFFSET] = hdrSize + dataSize - POS_GD3;
+
+		if (ver < VERSION_1_01) {
+			// VGM 1.00 files will have a value of 0. Overriding the real value in this case.
+			elements[IDX_RATE] = 0;
+		}
+		if (ver < VERSION_1_10) {
+			// For version 1.01 and earlier files, the YM2413 clock rate should be used for the clock rate of the YM2612.
+			elements[IDX_YM2612_CLOCK] = 0;
+			// For version 1.01 and earlier files, the YM2413 clock rate should be used for the clock rate of the YM2151.
+			elements[IDX_YM2151_CLOCK] = 0;
+		}
+		/* Forcing the VGM data to start at minimal absolute offset allowed for the given version of the VGM format.
+		 * For versions prior to 1.50, it should be 0 and the VGM data must start at offset 0x40.
+		 */
+		elements[IDX_VGM_DATA_OFFSET] = ver < VERSION_1_50 ? 0 : hdrSize - POS_VGM_DATA;
+	}
+}
+}
+
+#endif // VGM_FORMAT_H_
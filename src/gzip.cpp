@@ -0,0 +1,724 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "gzip.h"
+
+#include "fileio.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <afc/cpu/primitive.h>
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+	static const afc::endianness LE = afc::endianness::LE;
+
+	// The size of the input chunks that are deflated independently by different threads.
+	const size_t CHUNK_SIZE = 128 * 1024;
+	// The size of the deflate window. The tail of this size of the previous chunk is the dictionary of a chunk.
+	const size_t DICTIONARY_SIZE = 32 * 1024;
+	// The size of the output buffer used while compressing the content tail in place.
+	const size_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+	/* The maximal size of the output buffer used while compressing the content in a single thread.
+	 * Larger content is written in pieces of this size.
+	 */
+	const size_t MAX_SINGLE_SHOT_BUFFER_SIZE = 64 * 1024 * 1024;
+
+	// Raw deflate: the gzip header and trailer are written by writeGZip().
+	const int RAW_DEFLATE_WINDOW_BITS = -15;
+	// Automatic gzip header processing for reading gzip files.
+	const int GZIP_WINDOW_BITS = 16 + 15;
+	const int MEM_LEVEL = 8;
+
+	/* The gzip header: magic, the deflate method, no flags, no modification time, no extra flags
+	 * and the Unix operating system.
+	 */
+	const unsigned char GZIP_HEADER[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+	const size_t GZIP_TRAILER_SIZE = 8;
+	// The maximal compression ratio of deflate.
+	const size_t MAX_DEFLATE_RATIO = 1032;
+
+	// Provides access to the concatenation of a sequence of spans.
+	class SpanSequence
+	{
+	public:
+		SpanSequence(const vgm::Span spans[], const size_t spanCount) : m_spans(spans), m_spanCount(spanCount),
+				m_size(0)
+		{
+			for (size_t i = 0; i < spanCount; ++i) {
+				m_size += spans[i].size;
+			}
+		}
+
+		size_t size() const { return m_size; }
+
+		/* Returns a pointer to n consecutive octets that start at the given offset. If they belong to
+		 * different spans then they are copied to buf and a pointer to buf is returned.
+		 */
+		const unsigned char *get(size_t offset, const size_t n, vector<unsigned char> &buf) const
+		{
+			size_t i = 0;
+			while (i < m_spanCount && offset >= m_spans[i].size) {
+				offset -= m_spans[i].size;
+				++i;
+			}
+			if (i == m_spanCount || offset + n <= m_spans[i].size) {
+				return i == m_spanCount ? nullptr : m_spans[i].data + offset;
+			}
+			buf.resize(n);
+			for (size_t copied = 0; copied < n; ++i, offset = 0) {
+				const size_t chunkSize = min(n - copied, m_spans[i].size - offset);
+				memcpy(buf.data() + copied, m_spans[i].data + offset, chunkSize);
+				copied += chunkSize;
+			}
+			return buf.data();
+		}
+	private:
+		const vgm::Span * const m_spans;
+		const size_t m_spanCount;
+		size_t m_size;
+	};
+
+	inline void initDeflate(z_stream &stream, const vgm::GZipSettings &settings)
+	{
+		stream.zalloc = Z_NULL;
+		stream.zfree = Z_NULL;
+		stream.opaque = Z_NULL;
+		if (deflateInit2(&stream, settings.level, Z_DEFLATED, RAW_DEFLATE_WINDOW_BITS, MEM_LEVEL,
+				settings.strategy) != Z_OK) {
+			throw Exception("Unable to initialise compression"_s);
+		}
+	}
+
+	// A point in a deflate stream where a block starts.
+	struct BlockBoundary
+	{
+		// The position of the first bit of the block within the compressed file.
+		size_t bitPos;
+		// The position within the uncompressed content.
+		size_t pos;
+	};
+
+	inline void readFile(const char * const file, vector<unsigned char> &dest)
+	{
+		const int fd = ::open(file, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			throw Exception("Unable to open file"_s);
+		}
+		struct stat fileStat;
+		if (::fstat(fd, &fileStat) != 0) {
+			::close(fd);
+			throw Exception("Unable to read file"_s);
+		}
+		dest.resize(fileStat.st_size);
+		size_t pos = 0;
+		while (pos < dest.size()) {
+			const ssize_t n = ::read(fd, dest.data() + pos, dest.size() - pos);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				::close(fd);
+				throw Exception("Unable to read file"_s);
+			}
+			pos += n;
+		}
+		::close(fd);
+	}
+
+	/* Copies bitCount bits that start at the bit bitPos of src to dest that starts at a byte boundary.
+	 * The bits are ordered from the least significant one within an octet, as in deflate streams.
+	 * The last incomplete octet is not written but returned in the least significant bits.
+	 */
+	unsigned copyBits(const unsigned char * const src, const size_t bitPos, const size_t bitCount,
+			unsigned char * const dest)
+	{
+		const unsigned char * const in = src + bitPos / 8;
+		const unsigned shift = bitPos % 8;
+		const size_t byteCount = bitCount / 8;
+		if (shift == 0) {
+			memcpy(dest, in, byteCount);
+		} else {
+			for (size_t i = 0; i < byteCount; ++i) {
+				dest[i] = static_cast<unsigned char>((in[i] >> shift) | (in[i + 1] << (8 - shift)));
+			}
+		}
+		const unsigned lastBitCount = bitCount % 8;
+		if (lastBitCount == 0) {
+			return 0;
+		}
+		unsigned last = in[byteCount] >> shift;
+		if (shift + lastBitCount > 8) {
+			last |= in[byteCount + 1] << (8 - shift);
+		}
+		return last & ((1u << lastBitCount) - 1);
+	}
+
+	/* Inflates the gzip content up to tailOffset to find the start of the deflate stream, the first block
+	 * boundary that is at least DICTIONARY_SIZE octets past the head (if any), and the last block boundary
+	 * that is not past tailOffset. The first headSize octets of the content are stored to head.
+	 */
+	bool findBlockBoundaries(vector<unsigned char> &src, const size_t headSize, const size_t tailOffset,
+			unsigned char * const head, BlockBoundary &start, BlockBoundary &afterHead, bool &afterHeadFound,
+			BlockBoundary &tail)
+	{
+		z_stream stream;
+		stream.zalloc = Z_NULL;
+		stream.zfree = Z_NULL;
+		stream.opaque = Z_NULL;
+		stream.next_in = src.data();
+		stream.avail_in = static_cast<uInt>(src.size());
+		if (src.size() > UINT_MAX || inflateInit2(&stream, GZIP_WINDOW_BITS) != Z_OK) {
+			return false;
+		}
+
+		bool startFound = false, tailFound = false;
+		afterHeadFound = false;
+		unsigned char out[DICTIONARY_SIZE];
+		for (;;) {
+			stream.next_out = out;
+			stream.avail_out = DICTIONARY_SIZE;
+			const int ret = inflate(&stream, Z_BLOCK);
+			if (ret != Z_OK && ret != Z_STREAM_END) {
+				break;
+			}
+			const size_t outSize = DICTIONARY_SIZE - stream.avail_out;
+			const size_t outPos = stream.total_out - outSize;
+			if (outPos < headSize) {
+				memcpy(head + outPos, out, min(outSize, headSize - outPos));
+			}
+			if (stream.total_out > tailOffset || ret == Z_STREAM_END) {
+				break;
+			}
+			// Either the gzip header or a block that is not the last one is just decoded.
+			if ((stream.data_type & 128) != 0 && (stream.data_type & 64) == 0) {
+				const BlockBoundary boundary = {stream.total_in * 8 - (stream.data_type & 7), stream.total_out};
+				if (!startFound) {
+					start = boundary;
+					startFound = true;
+				}
+				if (!afterHeadFound && boundary.pos >= headSize + DICTIONARY_SIZE) {
+					afterHead = boundary;
+					afterHeadFound = true;
+				}
+				tail = boundary;
+				tailFound = true;
+			}
+		}
+		const bool headComplete = stream.total_out >= headSize;
+		inflateEnd(&stream);
+		return startFound && tailFound && headComplete;
+	}
+
+	inline void fillStats(vgm::CompressionStats &stats, const int fd, const off_t startPos,
+			const size_t uncompressedSize, const steady_clock::time_point startTime)
+	{
+		stats.uncompressedSize = uncompressedSize;
+		const off_t endPos = ::lseek(fd, 0, SEEK_CUR);
+		stats.compressedSize = endPos < startPos ? 0 : endPos - startPos;
+		stats.seconds = duration_cast<duration<double>>(steady_clock::now() - startTime).count();
+	}
+
+	inline void writeTrailer(const int fd, const uLong crc, const size_t size)
+	{
+		unsigned char trailer[GZIP_TRAILER_SIZE];
+		UInt32<>(static_cast<uint32_t>(crc)).toBytes<LE>(trailer);
+		UInt32<>(static_cast<uint32_t>(size)).toBytes<LE>(trailer + 4); // ISIZE is the size modulo 2^32
+		vgm::writeAll(fd, trailer, GZIP_TRAILER_SIZE);
+	}
+
+	// Deflates the pending input of the stream and writes all the output produced to fd.
+	inline int deflateToFile(z_stream &stream, const int flush, const int fd)
+	{
+		unsigned char out[OUTPUT_BUFFER_SIZE];
+		int ret;
+		do {
+			stream.next_out = out;
+			stream.avail_out = OUTPUT_BUFFER_SIZE;
+			ret = deflate(&stream, flush);
+			if (ret == Z_STREAM_ERROR) {
+				throw Exception("Unable to compress data"_s);
+			}
+			vgm::writeAll(fd, out, OUTPUT_BUFFER_SIZE - stream.avail_out);
+		} while (stream.avail_out == 0);
+		return ret;
+	}
+
+	/* Deflates the pending input of the stream into the output buffer of which outSize octets are already
+	 * used. The buffer is written to fd only when it is full.
+	 */
+	inline int deflateToBuffer(z_stream &stream, const int flush, const int fd, vector<unsigned char> &out,
+			size_t &outSize)
+	{
+		int ret;
+		do {
+			if (outSize == out.size()) {
+				vgm::writeAll(fd, out.data(), outSize);
+				outSize = 0;
+			}
+			stream.next_out = out.data() + outSize;
+			stream.avail_out = static_cast<uInt>(out.size() - outSize);
+			ret = deflate(&stream, flush);
+			if (ret == Z_STREAM_ERROR) {
+				throw Exception("Unable to compress data"_s);
+			}
+			outSize = out.size() - stream.avail_out;
+		} while (stream.avail_out == 0);
+		return ret;
+	}
+
+	void compressSerially(const int fd, const vgm::Span spans[], const size_t spanCount,
+			const vgm::GZipSettings &settings)
+	{
+		z_stream stream;
+		initDeflate(stream, settings);
+		uLong crc = crc32(0, Z_NULL, 0);
+		size_t totalSize = 0;
+		for (size_t i = 0; i < spanCount; ++i) {
+			totalSize += spans[i].size;
+		}
+		try {
+			// Normally the output buffer is large enough for the whole compressed content.
+			vector<unsigned char> out(min(static_cast<size_t>(deflateBound(&stream, totalSize)),
+					MAX_SINGLE_SHOT_BUFFER_SIZE));
+			size_t outSize = 0;
+			for (size_t i = 0; i < spanCount; ++i) {
+				const unsigned char *in = spans[i].data;
+				size_t remaining = spans[i].size;
+				while (remaining > 0) {
+					// zlib accepts no more than UINT_MAX octets at once.
+					const uInt inSize = static_cast<uInt>(min(remaining, static_cast<size_t>(UINT_MAX)));
+					crc = crc32(crc, in, inSize);
+					stream.next_in = const_cast<unsigned char *>(in);
+					stream.avail_in = inSize;
+					deflateToBuffer(stream, Z_NO_FLUSH, fd, out, outSize);
+					in += inSize;
+					remaining -= inSize;
+				}
+			}
+			stream.next_in = Z_NULL;
+			stream.avail_in = 0;
+			if (deflateToBuffer(stream, Z_FINISH, fd, out, outSize) != Z_STREAM_END) {
+				throw Exception("Unable to compress data"_s);
+			}
+			vgm::writeAll(fd, out.data(), outSize);
+		}
+		catch (...) {
+			deflateEnd(&stream);
+			throw;
+		}
+		deflateEnd(&stream);
+		writeTrailer(fd, crc, totalSize);
+	}
+
+	/* Deflates a chunk of input. Each but the last chunk ends with a sync flush so that it ends at a byte
+	 * boundary and the compressed chunks can be concatenated.
+	 */
+	void deflateChunk(const unsigned char * const dictionary, const size_t dictionarySize,
+			const unsigned char * const in, const size_t inSize, const bool last,
+			const vgm::GZipSettings &settings, vector<unsigned char> &out)
+	{
+		z_stream stream;
+		initDeflate(stream, settings);
+		// deflateBound() does not take the sync flush marker into account.
+		out.resize(deflateBound(&stream, inSize) + 16);
+		if (dictionarySize > 0) {
+			deflateSetDictionary(&stream, dictionary, static_cast<uInt>(dictionarySize));
+		}
+		stream.next_in = const_cast<unsigned char *>(in);
+		stream.avail_in = static_cast<uInt>(inSize);
+		stream.next_out = out.data();
+		stream.avail_out = static_cast<uInt>(out.size());
+		const int ret = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+		const bool failed = last ? ret != Z_STREAM_END : ret != Z_OK || stream.avail_in != 0;
+		out.resize(out.size() - stream.avail_out);
+		deflateEnd(&stream);
+		if (failed) {
+			throw Exception("Unable to compress data"_s);
+		}
+	}
+
+	void compressInParallel(const int fd, const vgm::Span spans[], const size_t spanCount,
+			const vgm::GZipSettings &settings)
+	{
+		const SpanSequence content(spans, spanCount);
+		const size_t size = content.size();
+		const size_t chunkCount = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+		struct Chunk
+		{
+			vector<unsigned char> compressed;
+			uLong crc;
+			bool failed;
+		};
+		vector<Chunk> chunks(chunkCount);
+
+		auto compress = [&](const size_t i)
+		{
+			Chunk &chunk = chunks[i];
+			try {
+				const size_t start = i * CHUNK_SIZE;
+				const size_t chunkSize = min(CHUNK_SIZE, size - start);
+				const size_t dictionarySize = min(start, DICTIONARY_SIZE);
+				vector<unsigned char> inBuf, dictionaryBuf;
+				const unsigned char * const in = content.get(start, chunkSize, inBuf);
+				const unsigned char * const dictionary = dictionarySize == 0 ? nullptr :
+						content.get(start - dictionarySize, dictionarySize, dictionaryBuf);
+				deflateChunk(dictionary, dictionarySize, in, chunkSize, i == chunkCount - 1, settings,
+						chunk.compressed);
+				chunk.crc = crc32(0, in, static_cast<uInt>(chunkSize));
+				chunk.failed = false;
+			}
+			catch (...) {
+				chunk.failed = true;
+			}
+		};
+
+		bool failed = false;
+		uLong crc = crc32(0, Z_NULL, 0);
+		auto write = [&](const size_t i)
+		{
+			Chunk &chunk = chunks[i];
+			if (!failed) {
+				if (chunk.failed) {
+					failed = true;
+				} else {
+					try {
+						vgm::writeAll(fd, chunk.compressed.data(), chunk.compressed.size());
+						const size_t chunkSize = min(CHUNK_SIZE, size - i * CHUNK_SIZE);
+						crc = crc32_combine(crc, chunk.crc, static_cast<z_off_t>(chunkSize));
+					}
+					catch (...) {
+						failed = true;
+					}
+				}
+			}
+			vector<unsigned char>().swap(chunk.compressed);
+		};
+
+		vgm::runOrdered(chunkCount, settings.threadCount, compress, write);
+
+		if (failed) {
+			throw Exception("Unable to write compressed data"_s);
+		}
+		writeTrailer(fd, crc, size);
+	}
+}
+
+void vgm::writeGZip(const int fd, const Span spans[], const size_t spanCount, const GZipSettings &settings)
+{
+	const steady_clock::time_point startTime = steady_clock::now();
+	const off_t startPos = settings.stats == nullptr ? 0 : ::lseek(fd, 0, SEEK_CUR);
+
+	writeAll(fd, GZIP_HEADER, sizeof(GZIP_HEADER));
+
+	size_t size = 0;
+	for (size_t i = 0; i < spanCount; ++i) {
+		size += spans[i].size;
+	}
+	if (settings.threadCount <= 1 || size <= CHUNK_SIZE) {
+		compressSerially(fd, spans, spanCount, settings);
+	} else {
+		compressInParallel(fd, spans, spanCount, settings);
+	}
+
+	if (settings.stats != nullptr) {
+		fillStats(*settings.stats, fd, startPos, size, startTime);
+	}
+}
+
+void vgm::deflateGZip(const Span spans[], const size_t spanCount, const GZipSettings &settings,
+		vector<unsigned char> &dest)
+{
+	z_stream stream;
+	initDeflate(stream, settings);
+	uLong crc = crc32(0, Z_NULL, 0);
+	size_t totalSize = 0;
+	for (size_t i = 0; i < spanCount; ++i) {
+		totalSize += spans[i].size;
+	}
+	// The buffer is normally large enough for the whole compressed content, and grows otherwise.
+	dest.resize(sizeof(GZIP_HEADER) + deflateBound(&stream, totalSize) + GZIP_TRAILER_SIZE);
+	memcpy(dest.data(), GZIP_HEADER, sizeof(GZIP_HEADER));
+	size_t outSize = sizeof(GZIP_HEADER);
+	auto deflateToDest = [&](const int flush) -> int
+	{
+		int ret;
+		do {
+			if (outSize == dest.size()) {
+				dest.resize(dest.size() * 2);
+			}
+			stream.next_out = dest.data() + outSize;
+			stream.avail_out = static_cast<uInt>(min(dest.size() - outSize, static_cast<size_t>(UINT_MAX)));
+			const uInt outAvailable = stream.avail_out;
+			ret = deflate(&stream, flush);
+			if (ret == Z_STREAM_ERROR) {
+				throw Exception("Unable to compress data"_s);
+			}
+			outSize += outAvailable - stream.avail_out;
+		} while (stream.avail_out == 0);
+		return ret;
+	};
+	try {
+		for (size_t i = 0; i < spanCount; ++i) {
+			const unsigned char *in = spans[i].data;
+			size_t remaining = spans[i].size;
+			while (remaining > 0) {
+				// zlib accepts no more than UINT_MAX octets at once.
+				const uInt inSize = static_cast<uInt>(min(remaining, static_cast<size_t>(UINT_MAX)));
+				crc = crc32(crc, in, inSize);
+				stream.next_in = const_cast<unsigned char *>(in);
+				stream.avail_in = inSize;
+				deflateToDest(Z_NO_FLUSH);
+				in += inSize;
+				remaining -= inSize;
+			}
+		}
+		stream.next_in = Z_NULL;
+		stream.avail_in = 0;
+		if (deflateToDest(Z_FINISH) != Z_STREAM_END) {
+			throw Exception("Unable to compress data"_s);
+		}
+	}
+	catch (...) {
+		deflateEnd(&stream);
+		throw;
+	}
+	deflateEnd(&stream);
+
+	dest.resize(outSize + GZIP_TRAILER_SIZE);
+	UInt32<>(static_cast<uint32_t>(crc)).toBytes<LE>(dest.data() + outSize);
+	UInt32<>(static_cast<uint32_t>(totalSize)).toBytes<LE>(dest.data() + outSize + 4);
+}
+
+size_t vgm::inflatedSizeHint(const size_t compressedSize, const uint32_t trailerSize)
+{
+	const size_t maxSize = compressedSize > SIZE_MAX / MAX_DEFLATE_RATIO ? SIZE_MAX : compressedSize * MAX_DEFLATE_RATIO;
+	return max(min(static_cast<size_t>(trailerSize), maxSize), static_cast<size_t>(1));
+}
+
+void vgm::inflateGZip(const unsigned char * const src, const size_t size, vector<unsigned char> &dest,
+		const function<void(size_t n)> &onGrow)
+{
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	stream.next_in = Z_NULL;
+	stream.avail_in = 0;
+	if (inflateInit2(&stream, GZIP_WINDOW_BITS) != Z_OK) {
+		throw Exception("Unable to initialise decompression"_s);
+	}
+	/* The trailer of the last member holds the size of its content modulo 2^32, which is the size of
+	 * the whole content for the files of a single member. It is only a hint for the buffer size.
+	 */
+	dest.resize(size >= GZIP_TRAILER_SIZE ? inflatedSizeHint(size, UInt32<>::fromBytes<LE>(src + size - 4)) : 1);
+	size_t inPos = 0, outSize = 0;
+	int ret = Z_OK;
+	while (inPos < size) {
+		if (outSize == dest.size()) {
+			if (onGrow) {
+				onGrow(dest.size());
+			}
+			dest.resize(dest.size() * 2);
+		}
+		stream.next_in = const_cast<unsigned char *>(src + inPos);
+		stream.avail_in = static_cast<uInt>(min(size - inPos, static_cast<size_t>(UINT_MAX)));
+		stream.next_out = dest.data() + outSize;
+		stream.avail_out = static_cast<uInt>(min(dest.size() - outSize, static_cast<size_t>(UINT_MAX)));
+		const uInt inAvailable = stream.avail_in, outAvailable = stream.avail_out;
+		ret = inflate(&stream, Z_NO_FLUSH);
+		inPos += inAvailable - stream.avail_in;
+		outSize += outAvailable - stream.avail_out;
+		if (ret == Z_STREAM_END) {
+			// Another member may follow.
+			if (inPos == size || src[inPos] != 0x1f) {
+				break;
+			}
+			if (inflateReset(&stream) != Z_OK) {
+				break;
+			}
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			break;
+		} else if (ret == Z_BUF_ERROR && stream.avail_out != 0) {
+			break; // the input is truncated
+		}
+	}
+	inflateEnd(&stream);
+	if (ret != Z_STREAM_END) {
+		throw Exception("Invalid compressed data"_s);
+	}
+	dest.resize(outSize);
+}
+
+vgm::GZipWriter::GZipWriter(const int fd, const GZipSettings &settings)
+	: m_fd(fd), m_stats(settings.stats), m_startTime(steady_clock::now()),
+	  m_startPos(settings.stats == nullptr ? 0 : ::lseek(fd, 0, SEEK_CUR)), m_crc(crc32(0, Z_NULL, 0)), m_size(0)
+{
+	initDeflate(m_stream, settings);
+	try {
+		writeAll(fd, GZIP_HEADER, sizeof(GZIP_HEADER));
+	}
+	catch (...) {
+		deflateEnd(&m_stream);
+		throw;
+	}
+}
+
+void vgm::GZipWriter::write(const unsigned char *data, size_t size)
+{
+	m_size += size;
+	while (size > 0) {
+		// zlib accepts no more than UINT_MAX octets at once.
+		const uInt inSize = static_cast<uInt>(min(size, static_cast<size_t>(UINT_MAX)));
+		m_crc = crc32(m_crc, data, inSize);
+		m_stream.next_in = const_cast<unsigned char *>(data);
+		m_stream.avail_in = inSize;
+		deflateToFile(m_stream, Z_NO_FLUSH, m_fd);
+		data += inSize;
+		size -= inSize;
+	}
+}
+
+void vgm::GZipWriter::finish()
+{
+	m_stream.next_in = Z_NULL;
+	m_stream.avail_in = 0;
+	if (deflateToFile(m_stream, Z_FINISH, m_fd) != Z_STREAM_END) {
+		throw Exception("Unable to compress data"_s);
+	}
+	writeTrailer(m_fd, m_crc, m_size);
+
+	if (m_stats != nullptr) {
+		fillStats(*m_stats, m_fd, m_startPos, m_size, m_startTime);
+	}
+}
+
+unique_ptr<vgm::AtomicFile> vgm::updateGZip(const char * const file, const Span spans[], const size_t spanCount,
+		const size_t headSize, const size_t tailOffset, const GZipSettings &settings)
+{
+	const steady_clock::time_point startTime = steady_clock::now();
+	const SpanSequence content(spans, spanCount);
+	const size_t size = content.size();
+	if (tailOffset > size || headSize > tailOffset) {
+		return nullptr;
+	}
+
+	vector<unsigned char> src;
+	readFile(file, src);
+
+	unique_ptr<unsigned char[]> oldHead(new unsigned char[headSize]);
+	BlockBoundary start, afterHead, tail;
+	bool afterHeadFound;
+	if (!findBlockBoundaries(src, headSize, tailOffset, oldHead.get(), start, afterHead, afterHeadFound, tail)) {
+		return nullptr;
+	}
+	vector<unsigned char> buf;
+	const bool headChanged = headSize > 0 && memcmp(oldHead.get(), content.get(0, headSize, buf), headSize) != 0;
+	if (headChanged && !afterHeadFound) {
+		return nullptr;
+	}
+	// The blocks in [copyFrom, tail) are copied as is.
+	const BlockBoundary &copyFrom = headChanged ? afterHead : start;
+	if (copyFrom.pos >= tail.pos) {
+		return nullptr; // nothing to copy; the file must be compressed from scratch
+	}
+
+	unique_ptr<AtomicFile> dest(new AtomicFile(file));
+	const int fd = dest->fd();
+	{
+		// The gzip header is kept as is.
+		writeAll(fd, src.data(), start.bitPos / 8);
+
+		z_stream stream;
+		if (headChanged) {
+			// The block sync flush ends at a byte boundary and leaves the stream open.
+			initDeflate(stream, settings);
+			try {
+				stream.next_in = const_cast<unsigned char *>(content.get(0, copyFrom.pos, buf));
+				stream.avail_in = static_cast<uInt>(copyFrom.pos);
+				deflateToFile(stream, Z_SYNC_FLUSH, fd);
+			}
+			catch (...) {
+				deflateEnd(&stream);
+				throw;
+			}
+			deflateEnd(&stream);
+		}
+
+		const size_t bitCount = tail.bitPos - copyFrom.bitPos;
+		vector<unsigned char> copied(bitCount / 8);
+		const unsigned lastBits = copyBits(src.data(), copyFrom.bitPos, bitCount, copied.data());
+		writeAll(fd, copied.data(), copied.size());
+		vector<unsigned char>().swap(copied);
+
+		// The tail continues the bit stream of the copied blocks and refers to the content before it.
+		initDeflate(stream, settings);
+		try {
+			if (bitCount % 8 != 0 && deflatePrime(&stream, static_cast<int>(bitCount % 8),
+					static_cast<int>(lastBits)) != Z_OK) {
+				throw Exception("Unable to compress data"_s);
+			}
+			const size_t dictionarySize = min(tail.pos, DICTIONARY_SIZE);
+			vector<unsigned char> dictionaryBuf;
+			deflateSetDictionary(&stream, content.get(tail.pos - dictionarySize, dictionarySize, dictionaryBuf),
+					static_cast<uInt>(dictionarySize));
+			const size_t tailSize = size - tail.pos;
+			stream.next_in = const_cast<unsigned char *>(content.get(tail.pos, tailSize, buf));
+			stream.avail_in = static_cast<uInt>(tailSize);
+			if (deflateToFile(stream, Z_FINISH, fd) != Z_STREAM_END) {
+				throw Exception("Unable to compress data"_s);
+			}
+		}
+		catch (...) {
+			deflateEnd(&stream);
+			throw;
+		}
+		deflateEnd(&stream);
+
+		uLong crc = crc32(0, Z_NULL, 0);
+		for (size_t i = 0; i < spanCount; ++i) {
+			for (size_t pos = 0; pos < spans[i].size;) {
+				const uInt n = static_cast<uInt>(min(spans[i].size - pos, static_cast<size_t>(UINT_MAX)));
+				crc = crc32(crc, spans[i].data + pos, n);
+				pos += n;
+			}
+		}
+		writeTrailer(fd, crc, size);
+
+		if (settings.stats != nullptr) {
+			fillStats(*settings.stats, fd, 0, size, startTime);
+		}
+	}
+	return dest;
+}
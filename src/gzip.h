@@ -0,0 +1,147 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_GZIP_H_
+#define VGM_GZIP_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "fileio.h"
+
+namespace vgm
+{
+	// A contiguous block of octets that does not own its content.
+	struct Span
+	{
+		const unsigned char *data;
+		std::size_t size;
+	};
+
+	struct CompressionStats
+	{
+		std::size_t uncompressedSize;
+		std::size_t compressedSize;
+		// The wall-clock time spent on compressing and writing the content.
+		double seconds;
+	};
+
+	struct GZipSettings
+	{
+		GZipSettings() : level(Z_DEFAULT_COMPRESSION), strategy(Z_DEFAULT_STRATEGY), threadCount(1),
+				stats(nullptr) {}
+
+		// The compression level from 0 (no compression) to 9 (best compression), or Z_DEFAULT_COMPRESSION.
+		int level;
+		// The deflate strategy: Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED.
+		int strategy;
+		/* The number of threads to compress the content with. If it is greater than one then the content is
+		 * split into chunks that are deflated independently, each chunk using the end of the previous one as
+		 * the dictionary (as pigz does). The output is still a single gzip member that any gzip reader accepts.
+		 */
+		unsigned threadCount;
+		// If not null then the statistics of the compression are stored there.
+		CompressionStats *stats;
+	};
+
+	/*
+	 * Writes the concatenation of the spans as a gzip file to the file descriptor fd, starting at its
+	 * current position. Throws afc::Exception if the content cannot be compressed or written.
+	 *
+	 * If a single thread is used then the whole content is deflated at once into an output buffer of the
+	 * maximal compressed size (unless the content is very large), which is then written with a single call.
+	 */
+	void writeGZip(const int fd, const Span spans[], const std::size_t spanCount, const GZipSettings &settings);
+
+	/*
+	 * Compresses the concatenation of the spans as a gzip file into dest, replacing its content. The content
+	 * is compressed in a single thread regardless of settings.threadCount, and settings.stats is not filled.
+	 * Throws afc::Exception if the content cannot be compressed.
+	 */
+	void deflateGZip(const Span spans[], const std::size_t spanCount, const GZipSettings &settings,
+			std::vector<unsigned char> &dest);
+
+	/*
+	 * Returns the estimated size of the content of a gzip file of compressedSize octets with the given size
+	 * stored in its trailer. The trailer is not trusted: the estimate never exceeds what deflate can expand
+	 * compressedSize octets into.
+	 */
+	std::size_t inflatedSizeHint(const std::size_t compressedSize, const std::uint32_t trailerSize);
+
+	/*
+	 * Decompresses the gzip file stored in the buffer into dest, replacing its content. Concatenated gzip
+	 * members are decompressed as one stream, as gzip does. Throws afc::Exception if the content is not
+	 * a valid gzip file.
+	 *
+	 * dest is first sized by inflatedSizeHint() and then doubled as needed. If onGrow is not empty then
+	 * onGrow(n) is called before dest grows by n octets beyond the estimate.
+	 */
+	void inflateGZip(const unsigned char *src, const std::size_t size, std::vector<unsigned char> &dest,
+			const std::function<void(std::size_t n)> &onGrow = nullptr);
+
+	/*
+	 * Writes a gzip file to the file descriptor fd piece by piece, starting at its current position, so that
+	 * the content does not have to be in memory at once. The content is compressed in a single thread
+	 * regardless of settings.threadCount, and the compressed output is written as it is produced.
+	 * Throws afc::Exception if the content cannot be compressed or written.
+	 */
+	class GZipWriter
+	{
+	public:
+		GZipWriter(const int fd, const GZipSettings &settings);
+		~GZipWriter() { deflateEnd(&m_stream); }
+
+		void write(const unsigned char *data, std::size_t size);
+		// Writes the rest of the compressed content and the gzip trailer.
+		void finish();
+	private:
+		GZipWriter(const GZipWriter &) = delete;
+		GZipWriter &operator=(const GZipWriter &) = delete;
+
+		const int m_fd;
+		CompressionStats * const m_stats;
+		const std::chrono::steady_clock::time_point m_startTime;
+		const off_t m_startPos;
+		z_stream m_stream;
+		uLong m_crc;
+		std::size_t m_size;
+	};
+
+	/*
+	 * Replaces the uncompressed content of the gzip file with the concatenation of the spans without
+	 * recompressing all of it. The new content must be equal to the old one everywhere except in the first
+	 * headSize octets and from tailOffset on.
+	 *
+	 * The file is inflated once to find deflate block boundaries. The compressed blocks that lie between the
+	 * head and tailOffset are copied as is (shifted to the new bit position, if needed), and only the head
+	 * (if it changed) and the tail are compressed again. The head is recompressed together with the first
+	 * 32 KiB after it, so that no copied block refers to the changed octets.
+	 *
+	 * Returns the new file, which replaces the old one once the caller commits it (see AtomicFile), or null
+	 * without creating it if the file has no suitable block boundaries, e.g. if it is too small for this to
+	 * pay off. Throws afc::Exception if the file cannot be read or written.
+	 */
+	std::unique_ptr<AtomicFile> updateGZip(const char * const file, const Span spans[], const std::size_t spanCount,
+			const std::size_t headSize, const std::size_t tailOffset, const GZipSettings &settings);
+}
+
+#endif // VGM_GZIP_H_
@@ -13,17 +13,47 @@ GNU General Public License for more details.
 
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cerrno>
+#include <cinttypes>
 #include <clocale>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <new>
 #include <ostream>
+#include <sstream>
+#include <string>
 #include <utility>
+#include <vector>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
+#include "catalog.h"
+#include "fingerprint.h"
+#include "manifest.h"
+#include "parallel.h"
+#include "parser.h"
+#include "scan.h"
+#include "search.h"
+#include "server.h"
+#include "stats.h"
+#include "transcode.h"
+#include "utf.h"
 #include "version.h"
 #include "vgm.h"
 
@@ -39,11 +69,38 @@ using Tag = vgm::VGMFile::Tag;
 using Format = vgm::VGMFile::Format;
 using afc::operator"" _s;
 
+/* Memory allocations are counted per thread for --stats. Array allocations are counted as well since
+ * the default operator new[] calls operator new.
+ */
+void *operator new(const std::size_t size)
+{
+	++vgm::threadAllocationCount();
+	for (;;) {
+		void * const p = std::malloc(size == 0 ? 1 : size);
+		if (p != nullptr) {
+			return p;
+		}
+		const std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+void operator delete(void * const p) noexcept
+{
+	std::free(p);
+}
+
 namespace {
 // TODO resolve it dynamically using argv[0]?
 const char * const programName = "vgmtag";
 const int getopt_tagStartValue = 1000;
 static afc::String systemEncoding;
+// The system encoding with transliteration of unmappable characters.
+static std::string failSafeEncoding;
+static bool systemEncodingIsUTF8 = false;
 
 static const struct option options[] = {
 	{"title", required_argument, nullptr, getopt_tagStartValue + static_cast<int>(Tag::title)},
@@ -61,6 +118,33 @@ static const struct option options[] = {
 	{"version", no_argument, nullptr, 'v'},
 	{"info", no_argument, nullptr, 'i'},
 	{"info-failsafe", no_argument, nullptr, 's'},
+	{"batch", no_argument, nullptr, 'b'},
+	{"files0-from", required_argument, nullptr, 'f'},
+	{"jobs", required_argument, nullptr, 'j'},
+	{"compression", required_argument, nullptr, 'c'},
+	{"compression-report", no_argument, nullptr, 'r'},
+	{"gzip-threads", required_argument, nullptr, 'g'},
+	{"fsync", required_argument, nullptr, 'y'},
+	{"atomic", no_argument, nullptr, 'A'},
+	{"in-place", no_argument, nullptr, 'U'},
+	{"stream", no_argument, nullptr, 'S'},
+	{"scan", no_argument, nullptr, 'n'},
+	{"stats", no_argument, nullptr, 'P'},
+	{"catalog", required_argument, nullptr, 'a'},
+	{"catalog-list", required_argument, nullptr, 'l'},
+	{"search", required_argument, nullptr, 'q'},
+	{"transcode", required_argument, nullptr, 'x'},
+	{"memory-budget", required_argument, nullptr, 'M'},
+	{"apply-manifest", required_argument, nullptr, 'e'},
+	{"dry-run", no_argument, nullptr, 'D'},
+	{"serve", required_argument, nullptr, 'd'},
+	{"client", required_argument, nullptr, 'k'},
+	{"fingerprint", required_argument, nullptr, 'p'},
+	{"where", required_argument, nullptr, 'w'},
+	{"ignore-case", no_argument, nullptr, 'I'},
+	{"date-from", required_argument, nullptr, 'F'},
+	{"date-to", required_argument, nullptr, 'T'},
+	{"format", required_argument, nullptr, 'o'},
 	{0}
 };
 
@@ -73,8 +157,19 @@ void printUsage(bool success, const char * const programName = ::programName)
 	} else {
 		std::cout <<
 "Usage: " << programName << " [OPTION]... SOURCE [DEST]\n\
+  or:  " << programName << " [OPTION]... --batch FILE...\n\
+  or:  " << programName << " [OPTION]... --files0-from=F\n\
+  or:  " << programName << " [-j N] --catalog=DIR\n\
+  or:  " << programName << " [--info-failsafe] --catalog-list=DIR [FILE]...\n\
+  or:  " << programName << " [OPTION]... --search=DIR\n\
+  or:  " << programName << " -m|-z [OPTION]... --transcode=DIR DEST_DIR\n\
+  or:  " << programName << " [OPTION]... --apply-manifest=F\n\
+  or:  " << programName << " [-j N] --serve=SOCKET\n\
+  or:  " << programName << " --client=SOCKET REQUEST [ARG]...\n\
+  or:  " << programName << " [-j N] [--format=F] --fingerprint=DIR\n\
 Updates GD3 tags of the SOURCE file of the VGM or VGZ format and saves the\n\
 result to the DEST file (or to SOURCE if DEST is omitted).\n\
+In the batch mode, each FILE is updated (or its info is displayed) in place.\n\
 \n\
 All options are optional. If the tag is omitted then it is not updated.\n\
 An empty string as a tag argument indicates that the tag is to be cleared.\n\
@@ -98,6 +193,96 @@ Only the 'notes' tag can be multi-line.\n\
       --info\t\tdisplay SOURCE file format and GD3 info and exit\n\
       --info-failsafe\tdisplay SOURCE file format and GD3 info (transliterating\n\
       \t\t\t  unmappable characters, if needed) and exit\n\
+      --scan\t\twith --info or --info-failsafe, scan the VGM commands to\n\
+      \t\t\t  display the duration, the loop and the size of the data\n\
+      \t\t\t  blocks, and check the stream against the header. The\n\
+      \t\t\t  exit status is 1 if the stream has errors\n\
+      --stats\t\tdisplay the wall-clock and CPU time, the octets read and\n\
+      \t\t\t  written and the memory allocations of each phase of\n\
+      \t\t\t  loading and saving (summed up over all the files) as\n\
+      \t\t\t  a JSON object on the standard error\n\
+  -b, --batch\t\tprocess each FILE argument in place\n\
+      --files0-from=F\tprocess in place the files whose names are listed in\n\
+      \t\t\t  the file F (or in the standard input if F is -),\n\
+      \t\t\t  separated by NUL characters\n\
+  -j, --jobs=N\t\tuse N worker threads in the batch mode (the number of\n\
+      \t\t\t  CPU cores by default)\n\
+      --compression=L[,S]\tcompress VGZ output with the level L: from 0 (no\n\
+      \t\t\t  compression) to 9, fast, default or max; and with\n\
+      \t\t\t  the deflate strategy S: default, filtered, huffman, rle\n\
+      \t\t\t  or fixed\n\
+      --compression-report\tdisplay the compression ratio and time of VGZ output\n\
+      --gzip-threads=N\tcompress VGZ output with N threads (the number of CPU\n\
+      \t\t\t  cores by default, 1 in the batch mode)\n\
+      --fsync=MODE\tflush the saved files to the storage device: none (the\n\
+      \t\t\t  default), file (the content before it replaces the\n\
+      \t\t\t  old file) or full (the directory entry as well)\n\
+      --atomic\t\treplace the files being saved atomically (the default)\n\
+      --in-place\t\tupdate the header and the GD3 info of VGM files in\n\
+      \t\t\t  place where possible, which is faster for large files\n\
+      \t\t\t  but can leave a file inconsistent if writing it fails\n\
+      --stream\t\tcopy the VGM data from SOURCE to DEST through a small\n\
+      \t\t\t  buffer instead of loading it, so that memory use does\n\
+      \t\t\t  not depend on the file size (VGZ files are then\n\
+      \t\t\t  decompressed twice)\n\
+      --catalog=DIR\tcreate or update the catalog of the VGM/VGZ files in\n\
+      \t\t\t  DIR and its subdirectories. Only new and modified\n\
+      \t\t\t  files are parsed\n\
+      --catalog-list=DIR\tdisplay the format and GD3 info of each catalogued\n\
+      \t\t\t  file (or of each FILE given by its path relative to\n\
+      \t\t\t  DIR) without reading the files themselves\n\
+      --search=DIR\tdisplay the VGM/VGZ files in DIR and its subdirectories\n\
+      \t\t\t  which GD3 info matches all the conditions given, one\n\
+      \t\t\t  file per line (UTF-8-encoded)\n\
+      --where=TAG=VALUE\tcondition: the tag TAG (title, titleJP, game etc.)\n\
+      \t\t\t  is VALUE\n\
+      --where=TAG~VALUE\tcondition: the tag TAG contains VALUE\n\
+      --ignore-case\tcompare tags with VALUE ignoring case\n\
+      --date-from=DATE\tcondition: the date tag is not earlier than DATE, which\n\
+      \t\t\t  is yyyy/mm/dd, yyyy/mm or yyyy\n\
+      --date-to=DATE\tcondition: the date tag is not later than DATE\n\
+      --transcode=DIR\tconvert the VGM/VGZ files in DIR and its subdirectories\n\
+      \t\t\t  to the format forced with -m or -z, writing them to\n\
+      \t\t\t  the same paths in DEST_DIR. The files are read,\n\
+      \t\t\t  decompressed, normalised, compressed and written\n\
+      \t\t\t  concurrently; -j sets the number of threads that\n\
+      \t\t\t  decompress and that compress the files\n\
+      --memory-budget=N\twith --transcode, hold at most N MiB of file content\n\
+      \t\t\t  in memory at once (256 by default)\n\
+      --apply-manifest=F\tset the tags of the files listed in the manifest F\n\
+      \t\t\t  (or in the standard input if F is -) in place. F is\n\
+      \t\t\t  a UTF-8 CSV or TSV table with a header row that names\n\
+      \t\t\t  the columns: path and any of the tags (title, titleJP,\n\
+      \t\t\t  game etc.). An empty value leaves the tag unchanged,\n\
+      \t\t\t  and \"\" clears it. The files are updated concurrently\n\
+      \t\t\t  and the result is displayed for each of them\n\
+      --dry-run\t\twith --apply-manifest, display the tags to be changed\n\
+      \t\t\t  (UTF-8-encoded) without writing the files\n\
+      --serve=SOCKET\tserve the requests of clients on the Unix domain socket\n\
+      \t\t\t  SOCKET with N worker threads (-j) until interrupted.\n\
+      \t\t\t  The tags of the files read recently are cached\n\
+      --client=SOCKET\tsend REQUEST to the server on SOCKET and display the\n\
+      \t\t\t  response. The requests are:\n\
+      \t\t\t    info FILE - the format and the tags of FILE as a\n\
+      \t\t\t      JSON object (see --format)\n\
+      \t\t\t    set-tags FILE TAG=VALUE... - set the tags (title,\n\
+      \t\t\t      titleJP, game etc.) of FILE in place\n\
+      \t\t\t    transcode SOURCE DEST vgm|vgz - save SOURCE to DEST\n\
+      \t\t\t      in the format given\n\
+      \t\t\t  The values and the output are UTF-8-encoded\n\
+      --fingerprint=DIR\tfingerprint the VGM data of the VGM/VGZ files in DIR\n\
+      \t\t\t  and its subdirectories, and display the groups of the\n\
+      \t\t\t  files with the same data regardless of their tags and\n\
+      \t\t\t  compression, separated by empty lines. With --format=tsv\n\
+      \t\t\t  or json, the fingerprint of each file is displayed\n\
+      \t\t\t  instead. The fingerprint is the XXH64 hash of the\n\
+      \t\t\t  uncompressed VGM data in hexadecimal\n\
+      --format=F\t\tdisplay the info (with --info, --info-failsafe or\n\
+      \t\t\t  --catalog-list) or the files found (with --search or\n\
+      \t\t\t  --fingerprint) as human-readable text (text; the\n\
+      \t\t\t  default for the info), tab-separated values (tsv; the\n\
+      \t\t\t  default for the search) or JSON objects (json). tsv and\n\
+      \t\t\t  json are UTF-8-encoded\n\
   -h, --help\t\tdisplay this help and exit\n\
       --version\t\tdisplay version information and exit\n\
 \n\
@@ -156,214 +341,1760 @@ void printOutputFormatConflict()
 	std::cerr << "Cannot force both VGM and VGZ output formats." << std::endl;
 }
 
-void printInfo(const VGMFile &vgmFile, const bool failSafeInfo)
+void printUnmappableTagsError()
 {
 	using std::operator<<;
 
-	afc::FastStringBuffer<char, afc::AllocMode::accurate> encoding(
-			systemEncoding.size() + (failSafeInfo ? "//TRANSLIT"_s.size() : 0));
-	encoding.append(systemEncoding.data(), systemEncoding.size());
-	if (failSafeInfo) {
-		encoding.append("//TRANSLIT"_s);
-	}
-
-	const char * const encodingStr = encoding.c_str();
-
-	const afc::String title(utf16leToString(vgmFile.getTag(Tag::title), encodingStr));
-	const afc::String titleJP(utf16leToString(vgmFile.getTag(Tag::titleJP), encodingStr));
-	const afc::String game(utf16leToString(vgmFile.getTag(Tag::game), encodingStr));
-	const afc::String gameJP(utf16leToString(vgmFile.getTag(Tag::gameJP), encodingStr));
-	const afc::String system(utf16leToString(vgmFile.getTag(Tag::system), encodingStr));
-	const afc::String systemJP(utf16leToString(vgmFile.getTag(Tag::systemJP), encodingStr));
-	const afc::String author(utf16leToString(vgmFile.getTag(Tag::author), encodingStr));
-	const afc::String authorJP(utf16leToString(vgmFile.getTag(Tag::authorJP), encodingStr));
-	const afc::String date(utf16leToString(vgmFile.getTag(Tag::date), encodingStr));
-	const afc::String converter(utf16leToString(vgmFile.getTag(Tag::converter), encodingStr));
-	const afc::String notes(utf16leToString(vgmFile.getTag(Tag::notes), encodingStr));
-
-	std::cout << "File format:\t\t" << (vgmFile.getFormat() == Format::vgm ? "VGM" : "VGZ") << '\n';
-	std::cout << "--------\n";
-	std::cout << "Title (Latin):\t\t" << title.c_str() << '\n';
-	std::cout << "Title (Japanese):\t" << titleJP.c_str() << '\n';
-	std::cout << "Game (Latin):\t\t" << game.c_str() << '\n';
-	std::cout << "Game (Japanese):\t" << gameJP.c_str() << '\n';
-	std::cout << "System (Latin):\t\t" << system.c_str() << '\n';
-	std::cout << "System (Japanese):\t" << systemJP.c_str() << '\n';
-	std::cout << "Author (Latin):\t\t" << author.c_str() << '\n';
-	std::cout << "Author (Japanese):\t" << authorJP.c_str() << '\n';
-	std::cout << "Date:\t\t\t" << date.c_str() << '\n';
-	std::cout << "Converter:\t\t" << converter.c_str() << '\n';
-	std::cout << "Notes:\t\t\t" << notes.c_str() << std::endl;
+	std::cerr << "There are characters in the GD3 tags that cannot be mapped to the system encoding (" <<
+			systemEncoding.c_str() << "). Try to run the program with the --info-failsafe option." << std::endl;
 }
 
-void initLocaleContext()
+// The format of --info and --search output.
+enum class OutputFormat
 {
-	std::setlocale(LC_ALL, "");
-	systemEncoding = afc::systemCharset();
+	text, tsv, json
+};
+
+afc::U16String toU16String(const char16_t * const value, const std::size_t size)
+{
+	afc::FastStringBuffer<char16_t, afc::AllocMode::accurate> buf(size);
+	buf.append(value, size);
+	afc::U16String result;
+	result.attach(buf.detach(), size);
+	return result;
 }
 
-VGMFile loadFile(const char * const src)
+// Unpaired surrogates are replaced with U+FFFD so that machine-readable output is always valid UTF-8.
+std::string toUTF8(const char16_t * const value, const std::size_t size)
 {
-	try {
-		return VGMFile(src);
+	std::string result;
+	vgm::utf16ToUTF8(value, size, result);
+	return result;
+}
+
+/* Converts a tag value to the system encoding. Throws afc::Exception if the value has characters that cannot
+ * be mapped to it, unless failSafe is true. The conversion to UTF-8 is done natively; iconv is used for other
+ * encodings and for transliteration.
+ */
+std::string toSystemEncoding(const afc::U16String &value, const bool failSafe)
+{
+	std::string result;
+	if (systemEncodingIsUTF8 && !failSafe) {
+		if (!vgm::utf16ToUTF8(value.data(), value.size(), result)) {
+			throw afc::Exception("Unpaired UTF-16 surrogate"_s);
+		}
+		return result;
 	}
-	catch (afc::Exception &ex) {
-		throw afc::Exception("Unable to load VGM/VGZ data."_s, &ex);
+	const afc::String converted(afc::utf16leToString(value,
+			failSafe ? failSafeEncoding.c_str() : systemEncoding.c_str()));
+	result.assign(converted.c_str(), converted.size());
+	return result;
+}
+
+// Converts a command line argument from the system encoding to UTF-16.
+afc::U16String fromSystemEncoding(const char * const value)
+{
+	if (systemEncodingIsUTF8) {
+		std::u16string result;
+		if (!vgm::utf8ToUTF16(value, std::strlen(value), result)) {
+			throw afc::Exception("Invalid UTF-8 argument"_s);
+		}
+		return toU16String(result.data(), result.size());
 	}
+	return afc::stringToUTF16LE(value, systemEncoding.c_str());
 }
 
-using TagValue = afc::Optional<afc::U16String>;
-using TagArray = std::array<TagValue, static_cast<int>(Tag::notes) - static_cast<int>(Tag::title) + 1>;
+// Writes the value in the given output format, escaping the characters that have special meaning there.
+void printValue(const OutputFormat format, const std::string &value, std::ostream &out)
+{
+	using std::operator<<;
+
+	if (format == OutputFormat::json) {
+		out << '"';
+	}
+	for (const char c : value) {
+		switch (c) {
+		case '\\':
+			out << "\\\\";
+			break;
+		case '\t':
+			out << "\\t";
+			break;
+		case '\n':
+			out << "\\n";
+			break;
+		case '\r':
+			out << "\\r";
+			break;
+		case '"':
+			out << (format == OutputFormat::json ? "\\\"" : "\"");
+			break;
+		default:
+			if (format == OutputFormat::json && static_cast<unsigned char>(c) < 0x20) {
+				const char hex[] = "0123456789abcdef";
+				out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+			} else {
+				out << c;
+			}
+		}
+	}
+	if (format == OutputFormat::json) {
+		out << '"';
+	}
 }
 
-// TODO add support of migrating to another VGM file version.
-int main(const int argc, char * argv[])
-try {
+void printTSVHeader(std::ostream &out, const bool withStats = false)
+{
 	using std::operator<<;
 
-	initLocaleContext();
+	out << "path\tformat\tversion";
+	for (int i = static_cast<int>(Tag::title); i <= static_cast<int>(Tag::notes); ++i) {
+		out << '\t' << options[i].name;
+	}
+	if (withStats) {
+		out << "\ttotal_samples\tloop_samples\terrors";
+	}
+	out << '\n';
+}
 
-	TagArray tags = {TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none(),
-			TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none()};
-	assert(!tags.back().hasValue()); // Ensuring that the array is initialised completely.
+std::string dataBlockName(const unsigned type)
+{
+	const char * const name = vgm::dataBlockTypeName(type);
+	if (name != nullptr) {
+		return name;
+	}
+	char buf[16];
+	std::snprintf(buf, sizeof(buf), "type 0x%02x", type);
+	return buf;
+}
 
-	bool nonInfoSpecified = false;
-	bool forceVGM = false;
-	bool forceVGZ = false;
-	bool showInfo = false;
-	bool failSafeInfo = false;
-	int c;
-	int optionIndex = -1;
-	while ((c = ::getopt_long(argc, argv, "hmz", options, &optionIndex)) != -1) {
-		if (c >= getopt_tagStartValue + static_cast<int>(Tag::title) &&
-				c <= getopt_tagStartValue + static_cast<int>(Tag::notes)) { // processing a tag argument
-			nonInfoSpecified = true;
-			const Tag tag = static_cast<Tag>(c - getopt_tagStartValue);
-			// TODO for Tag::notes - think about non-Unix platforms which use not \n as the line delimiter. The GD3 1.00 spec requires '\n'
-			tags[static_cast<int>(tag)] = TagValue(afc::stringToUTF16LE(::optarg, systemEncoding.c_str()));
-		} else {
-			switch (c) {
-			case 'i':
-				showInfo = true;
-				break;
-			case 's':
-				showInfo = true;
-				failSafeInfo = true;
-				break;
-			case 'h':
-				printUsage(true);
-				return 0;
-			case 'v':
-				printVersion();
-				return 0;
-			case 'm':
-				nonInfoSpecified = true;
-				if (forceVGZ) {
-					printOutputFormatConflict();
-					return 1;
-				}
-				forceVGM = true;
-				break;
-			case 'z':
-				nonInfoSpecified = true;
-				if (forceVGM) {
-					printOutputFormatConflict();
-					return 1;
-				}
-				forceVGZ = true;
-				break;
-			case '?':
-				// getopt_long takes care of informing the user about the error option
-				printUsage(false);
-				return 1;
-			default:
-				std::cerr << "Unhandled option: ";
-				if (optionIndex == -1) {
-					std::cerr << '-' << static_cast<char>(c);
-				} else {
-					std::cerr << "--" << options[optionIndex].name;
-				}
-				std::cerr << std::endl;
-				return 1;
+// Writes the statistics of the command stream as tab-separated values or as JSON object members.
+void printStatsFields(const OutputFormat format, const vgm::CommandStats &stats, std::ostream &out)
+{
+	using std::operator<<;
+
+	if (format == OutputFormat::tsv) {
+		out << '\t' << stats.totalSamples << '\t';
+		if (stats.loopFound) {
+			out << stats.loopSamples;
+		}
+		out << '\t';
+		std::string errors;
+		for (const std::string &error : stats.errors) {
+			if (!errors.empty()) {
+				errors.append("; ");
 			}
+			errors.append(error);
 		}
-		optionIndex = -1;
+		printValue(format, errors, out);
+		return;
 	}
-	if (optind == argc) {
-		std::cerr << "No SOURCE file." << std::endl;
-		printUsage(false);
-		return 1;
+	out << ",\"totalSamples\":" << stats.totalSamples << ",\"loopSamples\":";
+	if (stats.loopFound) {
+		out << stats.loopSamples;
+	} else {
+		out << "null";
 	}
-	if (optind < argc-2) {
-		std::cerr << "Only SOURCE and DEST files can be specified." << std::endl;
-		printUsage(false);
-		return 1;
+	out << ",\"dataBlocks\":{";
+	bool first = true;
+	for (unsigned type = 0; type < 256; ++type) {
+		if (stats.dataBlockBytes[type] != 0) {
+			out << (first ? "" : ",");
+			printValue(format, dataBlockName(type), out);
+			out << ':' << stats.dataBlockBytes[type];
+			first = false;
+		}
+	}
+	out << "},\"errors\":[";
+	for (std::size_t i = 0; i < stats.errors.size(); ++i) {
+		out << (i == 0 ? "" : ",");
+		printValue(format, stats.errors[i], out);
 	}
+	out << ']';
+}
 
-	const char * const src(argv[optind]);
+void printSamples(const uint64_t samples, std::ostream &out)
+{
+	using std::operator<<;
 
-	bool saveToSameFile;
-	const char *destFile;
-	if (optind < argc-1) { // there is DEST file
-		if (showInfo) {
-			std::cerr << "Only SOURCE can be specified with --info or --info-failsafe." << std::endl;
-			return 1;
+	// VGM samples are always at 44100 Hz.
+	const uint64_t centiseconds = samples / 441;
+	char buf[48];
+	std::snprintf(buf, sizeof(buf), "%llu:%02u.%02u (%llu samples)",
+			static_cast<unsigned long long>(centiseconds / 6000), static_cast<unsigned>(centiseconds / 100 % 60),
+			static_cast<unsigned>(centiseconds % 100), static_cast<unsigned long long>(samples));
+	out << buf;
+}
+
+// Displays the statistics of the command stream after the info of the file.
+void printStats(const vgm::CommandStats &stats, std::ostream &out)
+{
+	using std::operator<<;
+
+	out << "--------\n";
+	out << "Duration:\t\t";
+	printSamples(stats.totalSamples, out);
+	out << "\nLoop:\t\t\t";
+	if (stats.loopFound) {
+		printSamples(stats.loopSamples, out);
+	} else {
+		out << "none";
+	}
+	out << "\nData blocks:\t\t";
+	bool first = true;
+	for (unsigned type = 0; type < 256; ++type) {
+		if (stats.dataBlockBytes[type] != 0) {
+			out << (first ? "" : "\t\t\t") << dataBlockName(type).c_str() << ": " << stats.dataBlockBytes[type] <<
+					" octets\n";
+			first = false;
 		}
-		saveToSameFile = false;
-		destFile = argv[optind+1];
-	} else { // there is no DEST file
-		saveToSameFile = true;
-		destFile = argv[optind];
 	}
+	if (first) {
+		out << "none\n";
+	}
+	out << "Errors:\t\t\t";
+	for (std::size_t i = 0; i < stats.errors.size(); ++i) {
+		out << (i == 0 ? "" : "\t\t\t") << stats.errors[i].c_str() << '\n';
+	}
+	if (stats.errors.empty()) {
+		out << "none\n";
+	}
+	out.flush();
+}
 
-	if (showInfo) {
-		if (nonInfoSpecified) {
-			std::cerr << "No other options can be specified with --info or --info-failsafe." << std::endl;
-			return 1;
+/* Writes the format, version and tags of a file (and the statistics of its command stream, if given) as a line
+ * of tab-separated values or as a JSON object on a single line. Tags are written in UTF-8. getTag(tag) returns
+ * the value of the tag as a string of UTF-16 code units (std::u16string or afc::U16String, or a reference to it).
+ */
+template<typename GetTag>
+void printRecord(const OutputFormat format, const std::string &path, const Format fileFormat,
+		const uint32_t version, GetTag getTag, std::ostream &out, const vgm::CommandStats * const stats = nullptr)
+{
+	using std::operator<<;
+
+	char versionStr[16];
+	std::snprintf(versionStr, sizeof(versionStr), "%x.%02x", version >> 8, version & 0xff);
+	const char * const formatStr = fileFormat == Format::vgm ? "VGM" : "VGZ";
+
+	if (format == OutputFormat::tsv) {
+		printValue(format, path, out);
+		out << '\t' << formatStr << '\t' << versionStr;
+	} else {
+		out << "{\"path\":";
+		printValue(format, path, out);
+		out << ",\"format\":\"" << formatStr << "\",\"version\":\"" << versionStr << '"';
+	}
+	for (int i = static_cast<int>(Tag::title); i <= static_cast<int>(Tag::notes); ++i) {
+		const auto &value = getTag(static_cast<Tag>(i));
+		if (format == OutputFormat::tsv) {
+			out << '\t';
+		} else {
+			out << ",\"" << options[i].name << "\":";
 		}
-		// TODO load only GD3 in the --info mode
-		VGMFile vgmFile = loadFile(src);
-		try {
-			printInfo(vgmFile, failSafeInfo);
+		printValue(format, toUTF8(value.data(), value.size()), out);
+	}
+	if (stats != nullptr) {
+		printStatsFields(format, *stats, out);
+	}
+	if (format == OutputFormat::json) {
+		out << '}';
+	}
+	out << '\n';
+}
+
+/* Displays the format and the tags of a file. getTag(tag) returns the value of the tag as an afc::U16String
+ * (or a reference to it).
+ */
+template<typename GetTag>
+void printInfo(const Format format, GetTag getTag, const bool failSafeInfo, std::ostream &out = std::cout)
+{
+	using std::operator<<;
+
+	const std::string title(toSystemEncoding(getTag(Tag::title), failSafeInfo));
+	const std::string titleJP(toSystemEncoding(getTag(Tag::titleJP), failSafeInfo));
+	const std::string game(toSystemEncoding(getTag(Tag::game), failSafeInfo));
+	const std::string gameJP(toSystemEncoding(getTag(Tag::gameJP), failSafeInfo));
+	const std::string system(toSystemEncoding(getTag(Tag::system), failSafeInfo));
+	const std::string systemJP(toSystemEncoding(getTag(Tag::systemJP), failSafeInfo));
+	const std::string author(toSystemEncoding(getTag(Tag::author), failSafeInfo));
+	const std::string authorJP(toSystemEncoding(getTag(Tag::authorJP), failSafeInfo));
+	const std::string date(toSystemEncoding(getTag(Tag::date), failSafeInfo));
+	const std::string converter(toSystemEncoding(getTag(Tag::converter), failSafeInfo));
+	const std::string notes(toSystemEncoding(getTag(Tag::notes), failSafeInfo));
+
+	out << "File format:\t\t" << (format == Format::vgm ? "VGM" : "VGZ") << '\n';
+	out << "--------\n";
+	out << "Title (Latin):\t\t" << title.c_str() << '\n';
+	out << "Title (Japanese):\t" << titleJP.c_str() << '\n';
+	out << "Game (Latin):\t\t" << game.c_str() << '\n';
+	out << "Game (Japanese):\t" << gameJP.c_str() << '\n';
+	out << "System (Latin):\t\t" << system.c_str() << '\n';
+	out << "System (Japanese):\t" << systemJP.c_str() << '\n';
+	out << "Author (Latin):\t\t" << author.c_str() << '\n';
+	out << "Author (Japanese):\t" << authorJP.c_str() << '\n';
+	out << "Date:\t\t\t" << date.c_str() << '\n';
+	out << "Converter:\t\t" << converter.c_str() << '\n';
+	out << "Notes:\t\t\t" << notes.c_str() << std::endl;
+}
+
+// Displays the info of the file in the given format.
+void printInfo(const VGMFile &vgmFile, const char * const path, const OutputFormat format, const bool failSafeInfo,
+		std::ostream &out = std::cout)
+{
+	auto getTag = [&vgmFile](const Tag tag) -> const afc::U16String & { return vgmFile.getTag(tag); };
+	if (format == OutputFormat::text) {
+		printInfo(vgmFile.getFormat(), getTag, failSafeInfo, out);
+	} else {
+		printRecord(format, path, vgmFile.getFormat(), vgmFile.getVersion(), getTag, out);
+	}
+}
+
+void initLocaleContext()
+{
+	std::setlocale(LC_ALL, "");
+	systemEncoding = afc::systemCharset();
+	failSafeEncoding.assign(systemEncoding.c_str(), systemEncoding.size());
+	failSafeEncoding.append("//TRANSLIT");
+	systemEncodingIsUTF8 = vgm::isUTF8Charset(systemEncoding.c_str());
+}
+
+VGMFile loadFile(const char * const src, const VGMFile::LoadMode mode = VGMFile::LoadMode::full,
+		vgm::Stats * const stats = nullptr)
+{
+	try {
+		return VGMFile(src, mode, stats);
+	}
+	catch (afc::Exception &ex) {
+		throw afc::Exception("Unable to load VGM/VGZ data."_s, &ex);
+	}
+}
+
+// The info of a file and the statistics of its command stream.
+struct ScannedFile
+{
+	Format format;
+	uint32_t version;
+	afc::U16String tags[static_cast<std::size_t>(Tag::notes) + 1];
+	vgm::CommandStats stats;
+	uint64_t dataSize = 0; // the number of octets of the (uncompressed) VGM data scanned
+};
+
+// Parses the file in a single pass, scanning the VGM data as it is read.
+void scanFile(const char * const src, ScannedFile &result)
+{
+	class Handler : public vgm::ParseHandler
+	{
+	public:
+		explicit Handler(ScannedFile &result) : m_result(result) {}
+
+		void header(const unsigned char * const header, const std::size_t size) override
+		{
+			m_header.assign(header, header + size);
 		}
-		catch (afc::Exception &ex) {
-			std::cerr << "There are characters in the GD3 tags that cannot be mapped to the system encoding (" <<
-					systemEncoding.c_str() << "). Try to run the program with the --info-failsafe option." << std::endl;
-			return 1;
+
+		void sections(const vgm::VGMSections &sections) override
+		{
+			m_result.format = sections.format;
+			m_result.version = sections.version;
+			m_scanner.reset(new vgm::CommandScanner(
+					vgm::readStreamHeader(m_header.data(), m_header.size(), sections.dataOffset)));
 		}
-		return 0;
+
+		void tag(const Tag tag, const char16_t * const value, const std::size_t size) override
+		{
+			m_result.tags[static_cast<std::size_t>(tag)] = toU16String(value, size);
+		}
+
+		bool wantsData() const override { return true; }
+
+		void data(const unsigned char * const chunk, const std::size_t size) override
+		{
+			m_scanner->scan(chunk, size);
+			m_result.dataSize += size;
+		}
+
+		void finish() { m_result.stats = m_scanner->finish(); }
+	private:
+		ScannedFile &m_result;
+		std::vector<unsigned char> m_header;
+		std::unique_ptr<vgm::CommandScanner> m_scanner;
+	};
+
+	const int fd = ::open(src, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		afc::Exception cause("Unable to open file"_s);
+		throw afc::Exception("Unable to load VGM/VGZ data."_s, &cause);
+	}
+	Handler handler(result);
+	try {
+		vgm::parse(fd, handler);
+	}
+	catch (afc::Exception &ex) {
+		::close(fd);
+		throw afc::Exception("Unable to load VGM/VGZ data."_s, &ex);
+	}
+	::close(fd);
+	handler.finish();
+}
+
+// Displays the info of the file followed by the statistics of its command stream in the given format.
+void printInfo(const ScannedFile &file, const char * const path, const OutputFormat format, const bool failSafeInfo,
+		std::ostream &out = std::cout)
+{
+	auto getTag = [&file](const Tag tag) -> const afc::U16String & { return file.tags[static_cast<std::size_t>(tag)]; };
+	if (format == OutputFormat::text) {
+		printInfo(file.format, getTag, failSafeInfo, out);
+		printStats(file.stats, out);
+	} else {
+		printRecord(format, path, file.format, file.version, getTag, out, &file.stats);
 	}
+}
 
-	VGMFile vgmFile = loadFile(src);
+using TagValue = afc::Optional<afc::U16String>;
+using TagArray = std::array<TagValue, static_cast<int>(Tag::notes) - static_cast<int>(Tag::title) + 1>;
 
+void applyTags(VGMFile &vgmFile, const TagArray &tags)
+{
 	for (std::size_t i = 0, n = tags.size(); i < n; ++i) {
 		const TagValue &entry = tags[i];
 		if (entry.hasValue()) {
 			vgmFile.setTag(static_cast<Tag>(i), std::move(entry.value()));
 		}
 	}
+}
 
+Format resolveOutputFormat(const VGMFile &vgmFile, const char * const destFile, const bool saveToSameFile,
+		const bool forceVGM, const bool forceVGZ)
+{
 	afc::ConstStringRef vgzExt = ".vgz"_s;
 
-	Format outputFormat;
 	if (forceVGM) {
-		outputFormat = Format::vgm;
+		return Format::vgm;
 	} else if (forceVGZ) {
-		outputFormat = Format::vgz;
+		return Format::vgz;
 	} else if (saveToSameFile) {
-		outputFormat = vgmFile.getFormat();
+		return vgmFile.getFormat();
 	} else if (afc::endsWith(destFile, destFile + std::strlen(destFile), vgzExt.begin(), vgzExt.end())) {
-		outputFormat = Format::vgz;
+		return Format::vgz;
 	} else {
-		outputFormat = Format::vgm;
+		return Format::vgm;
 	}
+}
 
-	try {
-		vgmFile.save(destFile, outputFormat);
+bool parseNumber(const char * const str, const unsigned long min, const unsigned long max, unsigned &result)
+{
+	char *end;
+	errno = 0;
+	const unsigned long n = std::strtoul(str, &end, 10);
+	if (*str == '\0' || *end != '\0' || errno != 0 || n < min || n > max) {
+		return false;
 	}
-	catch (afc::Exception &ex) {
-		std::cerr << "Unable to save VGM/VGZ data to '" << destFile << "':\n  " << ex.what() << std::endl;
-		return 1;
+	result = static_cast<unsigned>(n);
+	return true;
+}
+
+bool parseCompression(const char * const str, vgm::GZipSettings &settings)
+{
+	const char * const separator = std::strchr(str, ',');
+	const std::string level(str, separator == nullptr ? std::strlen(str) : separator - str);
+	unsigned levelNumber;
+	if (level == "fast") {
+		settings.level = Z_BEST_SPEED;
+	} else if (level == "default") {
+		settings.level = Z_DEFAULT_COMPRESSION;
+	} else if (level == "max") {
+		settings.level = Z_BEST_COMPRESSION;
+	} else if (parseNumber(level.c_str(), Z_NO_COMPRESSION, Z_BEST_COMPRESSION, levelNumber)) {
+		settings.level = static_cast<int>(levelNumber);
+	} else {
+		return false;
+	}
+
+	if (separator == nullptr) {
+		return true;
+	}
+	const char * const strategy = separator + 1;
+	if (std::strcmp(strategy, "default") == 0) {
+		settings.strategy = Z_DEFAULT_STRATEGY;
+	} else if (std::strcmp(strategy, "filtered") == 0) {
+		settings.strategy = Z_FILTERED;
+	} else if (std::strcmp(strategy, "huffman") == 0) {
+		settings.strategy = Z_HUFFMAN_ONLY;
+	} else if (std::strcmp(strategy, "rle") == 0) {
+		settings.strategy = Z_RLE;
+	} else if (std::strcmp(strategy, "fixed") == 0) {
+		settings.strategy = Z_FIXED;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void printCompressionReport(const vgm::CompressionStats &stats, std::ostream &out)
+{
+	using std::operator<<;
+
+	const double ratio = stats.uncompressedSize == 0 ? 0 :
+			100.0 * static_cast<double>(stats.compressedSize) / static_cast<double>(stats.uncompressedSize);
+	const std::ios::fmtflags flags = out.flags();
+	const std::streamsize precision = out.precision();
+	out << std::fixed << std::setprecision(2) << "Compressed " << stats.uncompressedSize << " octets to " <<
+			stats.compressedSize << " octets (" << ratio << "%) in " << std::setprecision(3) << stats.seconds <<
+			" s.\n";
+	out.flags(flags);
+	out.precision(precision);
+}
+
+// Reads the whole file (or the standard input if file is -).
+bool readContent(const char * const file, std::string &content)
+{
+	if (std::strcmp(file, "-") == 0) {
+		content.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+	} else {
+		std::ifstream in(file, std::ios::binary);
+		if (!in) {
+			return false;
+		}
+		content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	return true;
+}
+
+bool readFileList(const char * const listFile, std::vector<std::string> &files)
+{
+	std::string content;
+	if (!readContent(listFile, content)) {
+		return false;
+	}
+	for (std::size_t start = 0, n = content.size(); start < n;) {
+		std::size_t end = content.find('\0', start);
+		if (end == std::string::npos) {
+			end = n;
+		}
+		if (end > start) {
+			files.emplace_back(content, start, end - start);
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+// Displays the per-phase counters as a JSON object on a single line.
+void printPhaseStats(const vgm::Stats &stats, std::ostream &out)
+{
+	using std::operator<<;
+
+	out << "{\"files\":" << stats.fileCount << ",\"phases\":{";
+	for (std::size_t i = 0; i < vgm::PHASE_COUNT; ++i) {
+		const vgm::PhaseStats &phase = stats.phases[i];
+		char times[64];
+		std::snprintf(times, sizeof(times), "\"wallSeconds\":%.6f,\"cpuSeconds\":%.6f", phase.wallSeconds,
+				phase.cpuSeconds);
+		out << (i == 0 ? "" : ",") << '"' << vgm::phaseName(static_cast<Phase>(i)) << "\":{\"calls\":" <<
+				phase.calls << ',' << times << ",\"bytesIn\":" << phase.bytesIn << ",\"bytesOut\":" <<
+				phase.bytesOut << ",\"allocations\":" << phase.allocations << '}';
+	}
+	out << "}}" << std::endl;
+}
+
+// Displays the stats collected (if any) on the standard error when the program finishes.
+class StatsReport
+{
+public:
+	explicit StatsReport(const vgm::Stats * const stats) : m_stats(stats) {}
+	~StatsReport()
+	{
+		if (m_stats != nullptr) {
+			std::cout.flush();
+			printPhaseStats(*m_stats, std::cerr);
+		}
+	}
+private:
+	const vgm::Stats * const m_stats;
+};
+
+/* Formats the info of a file processed in the batch mode with print(out). Throws afc::Exception with a hint
+ * to use --info-failsafe if a tag cannot be mapped to the system encoding.
+ */
+template<typename Print>
+std::string formatBatchInfo(const char * const file, const OutputFormat format, Print print)
+{
+	using std::operator<<;
+
+	std::ostringstream out;
+	if (format == OutputFormat::text) {
+		out << "File:\t\t\t" << file << '\n';
+	}
+	try {
+		print(out);
+	}
+	catch (afc::Exception &ex) {
+		throw afc::Exception("There are characters in the GD3 tags that cannot be mapped to the "
+				"system encoding. Try to run the program with the --info-failsafe option."_s);
+	}
+	return out.str();
+}
+
+/* Updates tags of (or displays info about) each file in place. The files are processed concurrently
+ * but the results are reported in the order of the files. Returns the exit code of the program.
+ */
+int processBatch(const std::vector<std::string> &files, const unsigned threadCount, const TagArray &tags,
+		const bool forceVGM, const bool forceVGZ, const bool showInfo, const bool failSafeInfo, const bool scan,
+		const OutputFormat infoFormat, const vgm::GZipSettings &gzipSettings, const vgm::SaveSettings &saveSettings,
+		const bool streamData, const bool compressionReport, vgm::Stats * const phaseStats)
+{
+	using std::operator<<;
+
+	struct Result
+	{
+		std::string output;
+		std::string error;
+		// True if the command stream of the file has errors (they are a part of the output).
+		bool invalid;
+		vgm::Stats stats;
+	};
+
+	const std::size_t fileCount = files.size();
+	std::vector<Result> results(fileCount);
+	bool failed = false;
+
+	auto process = [&](const std::size_t i)
+	{
+		const char * const file = files[i].c_str();
+		Result &result = results[i];
+		// Each file is measured separately since the files are processed concurrently.
+		vgm::Stats * const fileStats = phaseStats == nullptr ? nullptr : &result.stats;
+		if (fileStats != nullptr) {
+			fileStats->fileCount = 1;
+		}
+		try {
+			if (showInfo && scan) {
+				ScannedFile scanned;
+				{
+					PhaseTimer timer(fileStats, Phase::scan);
+					scanFile(file, scanned);
+					timer.addBytesIn(scanned.dataSize);
+				}
+				result.output = formatBatchInfo(file, infoFormat, [&](std::ostream &out)
+						{
+							PhaseTimer timer(fileStats, Phase::info);
+							printInfo(scanned, file, infoFormat, failSafeInfo, out);
+						});
+				result.invalid = !scanned.stats.errors.empty();
+			} else if (showInfo) {
+				VGMFile vgmFile = loadFile(file, VGMFile::LoadMode::tagsOnly, fileStats);
+				result.output = formatBatchInfo(file, infoFormat, [&](std::ostream &out)
+						{
+							PhaseTimer timer(fileStats, Phase::info);
+							printInfo(vgmFile, file, infoFormat, failSafeInfo, out);
+						});
+			} else {
+				VGMFile vgmFile = loadFile(file, streamData ?
+						VGMFile::LoadMode::streamedData : VGMFile::LoadMode::deferredData, fileStats);
+				applyTags(vgmFile, tags);
+				vgm::GZipSettings fileGZipSettings(gzipSettings);
+				vgm::CompressionStats stats = {0, 0, 0};
+				if (compressionReport) {
+					fileGZipSettings.stats = &stats;
+				}
+				vgmFile.save(file, resolveOutputFormat(vgmFile, file, true, forceVGM, forceVGZ), fileGZipSettings,
+						saveSettings);
+				if (stats.compressedSize != 0) {
+					std::ostringstream out;
+					out << file << ": ";
+					printCompressionReport(stats, out);
+					result.output = out.str();
+				}
+			}
+		}
+		catch (afc::Exception &ex) {
+			result.error = ex.what();
+		}
+		catch (std::exception &ex) {
+			result.error = ex.what();
+		}
+		catch (...) {
+			result.error = "Unknown error.";
+		}
+	};
+
+	auto report = [&](const std::size_t i)
+	{
+		Result &result = results[i];
+		if (!result.output.empty()) {
+			std::cout << result.output;
+			if (showInfo && infoFormat == OutputFormat::text && i + 1 < fileCount) {
+				std::cout << '\n';
+			}
+		}
+		if (result.invalid) {
+			failed = true;
+		}
+		if (phaseStats != nullptr) {
+			phaseStats->merge(result.stats);
+		}
+		if (!result.error.empty()) {
+			failed = true;
+			std::cout.flush();
+			std::cerr << files[i].c_str() << ": " << result.error.c_str() << std::endl;
+		}
+		// The result is not needed any more.
+		Result().output.swap(result.output);
+	};
+
+	if (showInfo && infoFormat == OutputFormat::tsv) {
+		printTSVHeader(std::cout, scan);
+	}
+	runOrdered(fileCount, threadCount, process, report);
+	std::cout.flush();
+
+	return failed ? 1 : 0;
+}
+
+int updateCatalog(const char * const dir, const unsigned threadCount)
+{
+	using std::operator<<;
+
+	vgm::CatalogUpdate update;
+	try {
+		update = vgm::updateCatalog(dir, threadCount, [](const std::string &path, const char * const message)
+				{
+					std::cerr << path.c_str() << ": " << message << std::endl;
+				});
+	}
+	catch (afc::Exception &ex) {
+		std::cerr << "Unable to update the catalog of '" << dir << "':\n  " << ex.what() << std::endl;
+		return 1;
+	}
+	std::cout << update.fileCount << " files catalogued: " << update.parsedCount << " parsed (" <<
+			update.failedCount << " invalid), " << update.removedCount << " removed." << std::endl;
+	return update.failedCount == 0 ? 0 : 1;
+}
+
+bool parseTagName(const std::string &name, Tag &tag)
+{
+	for (int i = static_cast<int>(Tag::title); i <= static_cast<int>(Tag::notes); ++i) {
+		if (name == options[i].name) {
+			tag = static_cast<Tag>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parses TAG=VALUE or TAG~VALUE. The value is converted from the system encoding to UTF-16.
+bool parsePredicate(const char * const str, vgm::TagPredicate &predicate)
+{
+	const char * const separator = std::strpbrk(str, "=~");
+	if (separator == nullptr || !parseTagName(std::string(str, separator), predicate.tag)) {
+		return false;
+	}
+	predicate.type = *separator == '=' ? vgm::TagPredicate::Type::exact : vgm::TagPredicate::Type::substring;
+	predicate.ignoreCase = false;
+	const afc::U16String value(fromSystemEncoding(separator + 1));
+	predicate.value.assign(value.data(), value.size());
+	return true;
+}
+
+bool parseDateOption(const char * const str, const bool upperBound, uint32_t &date)
+{
+	const afc::U16String value(fromSystemEncoding(str));
+	uint32_t from, to;
+	if (!vgm::parseDate(value.data(), value.size(), from, to)) {
+		return false;
+	}
+	date = upperBound ? to : from;
+	return true;
+}
+
+int searchTree(const char * const dir, const vgm::SearchQuery &query, const OutputFormat format,
+		const unsigned threadCount)
+{
+	using std::operator<<;
+
+	bool failed = false;
+	if (format == OutputFormat::tsv) {
+		printTSVHeader(std::cout);
+	}
+	try {
+		vgm::searchTree(dir, query, threadCount, [&](const vgm::SearchMatch &match)
+				{
+					printRecord(format, std::string(dir) + '/' + match.path, match.format, match.version,
+							[&match](const Tag tag) -> const std::u16string & { return match.tags[static_cast<int>(tag)]; },
+							std::cout);
+				},
+				[&](const std::string &path, const char * const message)
+				{
+					failed = true;
+					std::cout.flush();
+					std::cerr << path.c_str() << ": " << message << std::endl;
+				});
+	}
+	catch (afc::Exception &ex) {
+		std::cout.flush();
+		std::cerr << "Unable to search '" << dir << "':\n  " << ex.what() << std::endl;
+		return 1;
+	}
+	std::cout.flush();
+	return failed ? 1 : 0;
+}
+
+int transcodeTree(const char * const srcDir, const char * const destDir, const vgm::TranscodeSettings &settings)
+{
+	using std::operator<<;
+
+	vgm::TranscodeResult result;
+	try {
+		result = vgm::transcodeTree(srcDir, destDir, settings, [](const std::string &path, const char * const message)
+				{
+					std::cerr << path.c_str() << ": " << message << std::endl;
+				});
+	}
+	catch (afc::Exception &ex) {
+		std::cerr << "Unable to convert '" << srcDir << "' to '" << destDir << "':\n  " << ex.what() << std::endl;
+		return 1;
+	}
+	std::cout << result.fileCount - result.failedCount << " files converted (" << result.failedCount <<
+			" failed): " << result.bytesRead << " octets read, " << result.bytesWritten << " octets written." <<
+			std::endl;
+	return result.failedCount == 0 ? 0 : 1;
+}
+
+/* Sets the tags of the files listed in the manifest (see parseManifest()) in place, or only displays the changes
+ * to be made if dryRun is true. The files are processed concurrently but the results are reported in the order
+ * of the rows. Files which tags already have the values given are not written. Returns the exit code of the
+ * program.
+ */
+int applyManifest(const char * const manifestFile, const unsigned threadCount, const bool dryRun,
+		const vgm::GZipSettings &gzipSettings, const vgm::SaveSettings &saveSettings, const bool streamData)
+{
+	using std::operator<<;
+
+	std::vector<vgm::ManifestRow> rows;
+	{
+		std::string content;
+		if (!readContent(manifestFile, content)) {
+			std::cerr << "Unable to read the manifest from '" << manifestFile << "'." << std::endl;
+			return 1;
+		}
+		vgm::ManifestError error;
+		if (!vgm::parseManifest(content.data(), content.size(), rows, error)) {
+			std::cerr << manifestFile << ':' << error.line << ": " << error.message << '.' << std::endl;
+			return 1;
+		}
+	}
+
+	struct Result
+	{
+		std::string output;
+		std::string error;
+		bool changed;
+	};
+
+	const std::size_t rowCount = rows.size();
+	std::vector<Result> results(rowCount);
+
+	// The rows that refer to a file listed before are rejected since the file would be updated concurrently.
+	{
+		std::map<std::pair<dev_t, ino_t>, std::size_t> firstRows;
+		for (std::size_t i = 0; i < rowCount; ++i) {
+			struct stat fileStat;
+			if (::stat(rows[i].path.c_str(), &fileStat) != 0) {
+				continue; // the error is reported when the file is loaded
+			}
+			const auto entry = firstRows.emplace(std::make_pair(fileStat.st_dev, fileStat.st_ino), i);
+			if (!entry.second) {
+				std::ostringstream out;
+				out << "The file is already listed at line " << rows[entry.first->second].line << " of the manifest.";
+				results[i].error = out.str();
+			}
+		}
+	}
+
+	auto process = [&](const std::size_t i)
+	{
+		const vgm::ManifestRow &row = rows[i];
+		const char * const file = row.path.c_str();
+		Result &result = results[i];
+		if (!result.error.empty()) {
+			return;
+		}
+		try {
+			// A dry run only compares the tags, so the VGM data is not needed.
+			VGMFile vgmFile = loadFile(file, dryRun ? VGMFile::LoadMode::tagsOnly : streamData ?
+					VGMFile::LoadMode::streamedData : VGMFile::LoadMode::deferredData);
+			std::ostringstream diff;
+			for (std::size_t j = 0; j < vgm::ManifestRow::TAG_COUNT; ++j) {
+				if (!row.hasTag[j]) {
+					continue;
+				}
+				const Tag tag = static_cast<Tag>(j);
+				const afc::U16String &current = vgmFile.getTag(tag);
+				const std::u16string &value = row.tags[j];
+				if (current.size() == value.size() && std::equal(value.begin(), value.end(), current.data())) {
+					continue;
+				}
+				result.changed = true;
+				if (dryRun) {
+					diff << '-' << options[j].name << '\t';
+					printValue(OutputFormat::tsv, toUTF8(current.data(), current.size()), diff);
+					diff << "\n+" << options[j].name << '\t';
+					printValue(OutputFormat::tsv, toUTF8(value.data(), value.size()), diff);
+					diff << '\n';
+				} else {
+					vgmFile.setTag(tag, value.data(), value.size());
+				}
+			}
+			if (result.changed && !dryRun) {
+				vgmFile.save(file, vgmFile.getFormat(), gzipSettings, saveSettings);
+			}
+			result.output.append(file).append(": ").append(!result.changed ? "unchanged.\n" :
+					dryRun ? "to be updated.\n" : "updated.\n").append(diff.str());
+		}
+		catch (afc::Exception &ex) {
+			result.error = ex.what();
+		}
+		catch (std::exception &ex) {
+			result.error = ex.what();
+		}
+		catch (...) {
+			result.error = "Unknown error.";
+		}
+	};
+
+	std::size_t changedCount = 0, failedCount = 0;
+	auto report = [&](const std::size_t i)
+	{
+		Result &result = results[i];
+		std::cout << result.output;
+		if (!result.error.empty()) {
+			++failedCount;
+			std::cout.flush();
+			std::cerr << rows[i].path.c_str() << " (line " << rows[i].line << "): " << result.error.c_str() <<
+					std::endl;
+		} else if (result.changed) {
+			++changedCount;
+		}
+		// The result is not needed any more.
+		Result().output.swap(result.output);
+	};
+
+	runOrdered(rowCount, threadCount, process, report);
+	std::cout << changedCount << (dryRun ? " files to be updated, " : " files updated, ") <<
+			rowCount - changedCount - failedCount << " unchanged, " << failedCount << " failed." << std::endl;
+	return failedCount == 0 ? 0 : 1;
+}
+
+// The number of files which tag info is kept by the server.
+const std::size_t SERVER_CACHE_CAPACITY = 4096;
+
+/* Handles a request of a client of --serve (see printUsage()). The paths must be absolute since the server
+ * does not share the working directory of the client. The requests that access the same path are serialised.
+ */
+bool handleRequest(const std::vector<std::string> &request, std::string &response, vgm::TagInfoCache &cache,
+		vgm::PathLocks &locks)
+{
+	const std::string &name = request[0];
+	const std::size_t argCount = request.size() - 1;
+	const std::size_t pathCount = name == "transcode" ? 2 : 1;
+	for (std::size_t i = 1; i <= pathCount && i <= argCount; ++i) {
+		if (request[i].empty() || request[i][0] != '/') {
+			response = "The path must be absolute.";
+			return false;
+		}
+	}
+	try {
+		if (name == "info" && argCount == 1) {
+			const std::string &path = request[1];
+			std::shared_ptr<const vgm::TagInfo> info;
+			{
+				const vgm::PathLocks::Guard guard(locks, path);
+				info = cache.get(path);
+			}
+			std::ostringstream out;
+			printRecord(OutputFormat::json, path, info->format, info->version,
+					[&info](const Tag tag) -> const std::u16string & { return info->tags[static_cast<int>(tag)]; },
+					out);
+			response = out.str();
+			return true;
+		}
+		if (name == "set-tags" && argCount >= 2) {
+			const std::string &path = request[1];
+			std::vector<std::pair<Tag, std::u16string>> values(argCount - 1);
+			for (std::size_t i = 2; i <= argCount; ++i) {
+				const std::string &arg = request[i];
+				const std::size_t separator = arg.find('=');
+				std::pair<Tag, std::u16string> &value = values[i - 2];
+				if (separator == std::string::npos || !parseTagName(arg.substr(0, separator), value.first)) {
+					response = "Invalid tag: '" + arg + "'.";
+					return false;
+				}
+				if (!vgm::utf8ToUTF16(arg.data() + separator + 1, arg.size() - separator - 1, value.second)) {
+					response = "Invalid UTF-8 value: '" + arg + "'.";
+					return false;
+				}
+			}
+			const vgm::PathLocks::Guard guard(locks, path);
+			VGMFile vgmFile = loadFile(path.c_str(), VGMFile::LoadMode::deferredData);
+			for (const std::pair<Tag, std::u16string> &value : values) {
+				vgmFile.setTag(value.first, value.second.data(), value.second.size());
+			}
+			vgmFile.save(path.c_str(), vgmFile.getFormat());
+			cache.erase(path);
+			return true;
+		}
+		if (name == "transcode" && argCount == 3 && (request[3] == "vgm" || request[3] == "vgz")) {
+			const std::string &src = request[1];
+			const std::string &dest = request[2];
+			// The paths are locked in the same order by all requests so that they cannot deadlock.
+			const vgm::PathLocks::Guard firstGuard(locks, std::min(src, dest));
+			std::unique_ptr<vgm::PathLocks::Guard> secondGuard;
+			if (src != dest) {
+				secondGuard.reset(new vgm::PathLocks::Guard(locks, std::max(src, dest)));
+			}
+			const bool saveToSameFile = vgm::isSameFile(src.c_str(), dest.c_str());
+			VGMFile vgmFile = loadFile(src.c_str(), saveToSameFile ?
+					VGMFile::LoadMode::deferredData : VGMFile::LoadMode::mappedData);
+			vgmFile.save(dest.c_str(), request[3] == "vgz" ? Format::vgz : Format::vgm);
+			cache.erase(dest);
+			return true;
+		}
+		response = "Unknown request or invalid arguments: '" + name + "'.";
+	}
+	catch (afc::Exception &ex) {
+		response = ex.what();
+	}
+	catch (std::exception &ex) {
+		response = ex.what();
+	}
+	catch (...) {
+		response = "Unknown error.";
+	}
+	return false;
+}
+
+int serve(const char * const socketPath, const unsigned threadCount)
+{
+	using std::operator<<;
+
+	vgm::TagInfoCache cache(SERVER_CACHE_CAPACITY);
+	vgm::PathLocks locks;
+	try {
+		vgm::serve(socketPath, threadCount, [&](const std::vector<std::string> &request, std::string &response)
+				{
+					return handleRequest(request, response, cache, locks);
+				});
+	}
+	catch (afc::Exception &ex) {
+		std::cerr << "Unable to serve on '" << socketPath << "':\n  " << ex.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+/* Sends the request given by the arguments to the server and displays the response. The paths of the files
+ * are made absolute, and the tag values are converted to UTF-8. Returns the exit code of the program.
+ */
+int sendRequest(const char * const socketPath, char * const args[], const std::size_t argCount)
+{
+	using std::operator<<;
+
+	std::vector<std::string> request(args, args + argCount);
+	const std::string &name = request[0];
+	const std::size_t pathCount = name == "transcode" ? 2 : name == "info" || name == "set-tags" ? 1 : 0;
+	for (std::size_t i = 1; i <= pathCount && i < argCount; ++i) {
+		if (!request[i].empty() && request[i][0] != '/') {
+			char * const dir = ::getcwd(nullptr, 0);
+			if (dir != nullptr) {
+				request[i] = std::string(dir) + '/' + request[i];
+				std::free(dir);
+			}
+		}
+	}
+	if (name == "set-tags") {
+		for (std::size_t i = 2; i < argCount; ++i) {
+			const afc::U16String value(fromSystemEncoding(args[i]));
+			request[i] = toUTF8(value.data(), value.size());
+		}
+	}
+
+	std::string response;
+	bool succeeded;
+	try {
+		succeeded = vgm::sendRequest(socketPath, request, response);
+	}
+	catch (afc::Exception &ex) {
+		std::cerr << "Unable to send the request to '" << socketPath << "':\n  " << ex.what() << std::endl;
+		return 1;
+	}
+	if (succeeded) {
+		std::cout << response;
+		std::cout.flush();
+		return 0;
+	}
+	std::cerr << response << std::endl;
+	return 1;
+}
+
+std::string formatFingerprint(const vgm::Fingerprint &fingerprint)
+{
+	char buf[17];
+	std::snprintf(buf, sizeof(buf), "%016" PRIx64, fingerprint.hash);
+	return buf;
+}
+
+/* Displays the groups of the files in dir with the same fingerprint (or the fingerprint of each file if the
+ * format is not text). Returns the exit code of the program.
+ */
+int fingerprintTree(const char * const dir, const OutputFormat format, const unsigned threadCount)
+{
+	using std::operator<<;
+
+	bool failed = false;
+	std::vector<vgm::FingerprintedFile> files;
+	try {
+		files = vgm::fingerprintTree(dir, threadCount, [&](const std::string &path, const char * const message)
+				{
+					failed = true;
+					std::cerr << path.c_str() << ": " << message << std::endl;
+				});
+	}
+	catch (afc::Exception &ex) {
+		std::cerr << "Unable to fingerprint '" << dir << "':\n  " << ex.what() << std::endl;
+		return 1;
+	}
+
+	if (format == OutputFormat::text) {
+		bool first = true;
+		for (const std::vector<const vgm::FingerprintedFile *> &group : vgm::findDuplicates(files)) {
+			if (!first) {
+				std::cout << '\n';
+			}
+			first = false;
+			for (const vgm::FingerprintedFile * const file : group) {
+				std::cout << formatFingerprint(file->fingerprint) << "  " << dir << '/' << file->path << '\n';
+			}
+		}
+	} else {
+		if (format == OutputFormat::tsv) {
+			std::cout << "path\tfingerprint\n";
+		}
+		for (const vgm::FingerprintedFile &file : files) {
+			std::cout << (format == OutputFormat::json ? "{\"path\":" : "");
+			printValue(format, std::string(dir) + '/' + file.path, std::cout);
+			std::cout << (format == OutputFormat::json ? ",\"fingerprint\":\"" : "\t") <<
+					formatFingerprint(file.fingerprint) << (format == OutputFormat::json ? "\"}\n" : "\n");
+		}
+	}
+	std::cout.flush();
+	return failed ? 1 : 0;
+}
+
+/* Displays the info of the catalogued files with the given paths relative to dir (or of all valid catalogued
+ * files if there are no paths) in the format of --info in the batch mode. Returns the exit code of the program.
+ */
+int listCatalog(const char * const dir, char * const paths[], const std::size_t pathCount,
+		const OutputFormat format, const bool failSafeInfo)
+{
+	using std::operator<<;
+
+	const std::string catalogFile = std::string(dir) + '/' + vgm::Catalog::FILE_NAME;
+	if (::access(catalogFile.c_str(), F_OK) != 0) {
+		std::cerr << "There is no catalog in '" << dir << "'. Run the program with --catalog=" << dir <<
+				" to create it." << std::endl;
+		return 1;
+	}
+	const vgm::Catalog catalog(catalogFile);
+
+	bool failed = false;
+	bool first = true;
+	auto print = [&](const vgm::CatalogEntry &entry)
+	{
+		const char * const path = catalog.path(entry);
+		// The tags are read from the catalog first so that a malformed entry is not reported as an encoding error.
+		std::u16string tags[static_cast<std::size_t>(Tag::notes) + 1];
+		for (std::size_t i = 0; i <= static_cast<std::size_t>(Tag::notes); ++i) {
+			const Tag tag = static_cast<Tag>(i);
+			tags[i].assign(catalog.tag(entry, tag), catalog.tagSize(entry, tag));
+		}
+		const Format fileFormat = entry.format == 0 ? Format::vgm : Format::vgz;
+		std::ostringstream out;
+		if (format != OutputFormat::text) {
+			printRecord(format, std::string(dir) + '/' + path, fileFormat, entry.version, [&tags](const Tag tag)
+					{
+						return tags[static_cast<std::size_t>(tag)];
+					}, std::cout);
+			return;
+		}
+		out << "File:\t\t\t" << dir << '/' << path << '\n';
+		try {
+			printInfo(fileFormat, [&tags](const Tag tag)
+					{
+						const std::u16string &value = tags[static_cast<std::size_t>(tag)];
+						return toU16String(value.data(), value.size());
+					}, failSafeInfo, out);
+		}
+		catch (afc::Exception &ex) {
+			failed = true;
+			std::cout.flush();
+			std::cerr << dir << '/' << path << ": There are characters in the GD3 tags that cannot be mapped to "
+					"the system encoding. Try to run the program with the --info-failsafe option." << std::endl;
+			return;
+		}
+		if (!first) {
+			std::cout << '\n';
+		}
+		first = false;
+		std::cout << out.str();
+	};
+
+	if (format == OutputFormat::tsv) {
+		printTSVHeader(std::cout);
+	}
+	try {
+		if (pathCount == 0) {
+			for (std::size_t i = 0, n = catalog.size(); i < n; ++i) {
+				if (catalog[i].valid != 0) {
+					print(catalog[i]);
+				}
+			}
+		} else {
+			for (std::size_t i = 0; i < pathCount; ++i) {
+				const vgm::CatalogEntry * const entry = catalog.find(paths[i]);
+				if (entry == nullptr || entry->valid == 0) {
+					failed = true;
+					std::cout.flush();
+					std::cerr << paths[i] << ": " << (entry == nullptr ? "Not catalogued." : "Not a VGM/VGZ file.") <<
+							std::endl;
+				} else {
+					print(*entry);
+				}
+			}
+		}
+	}
+	catch (afc::Exception &ex) {
+		std::cout.flush();
+		std::cerr << "Unable to read the catalog of '" << dir << "':\n  " << ex.what() << std::endl;
+		return 1;
+	}
+	std::cout.flush();
+	return failed ? 1 : 0;
+}
+}
+
+// TODO add support of migrating to another VGM file version.
+int main(const int argc, char * argv[])
+try {
+	using std::operator<<;
+
+	initLocaleContext();
+
+	TagArray tags = {TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none(),
+			TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none(), TagValue::none()};
+	assert(!tags.back().hasValue()); // Ensuring that the array is initialised completely.
+
+	bool nonInfoSpecified = false;
+	bool forceVGM = false;
+	bool forceVGZ = false;
+	bool showInfo = false;
+	bool failSafeInfo = false;
+	bool batch = false;
+	const char *fileListFile = nullptr;
+	unsigned threadCount = defaultThreadCount();
+	vgm::GZipSettings gzipSettings;
+	bool gzipThreadCountSpecified = false;
+	bool compressionReport = false;
+	vgm::SaveSettings saveSettings;
+	bool saveModeSpecified = false;
+	bool streamData = false;
+	bool scan = false;
+	bool collectStats = false;
+	const char *catalogDir = nullptr;
+	const char *catalogListDir = nullptr;
+	const char *searchDir = nullptr;
+	const char *transcodeDir = nullptr;
+	std::size_t memoryBudget = vgm::TranscodeSettings::DEFAULT_MEMORY_BUDGET;
+	bool memoryBudgetSpecified = false;
+	const char *manifestFile = nullptr;
+	bool dryRun = false;
+	const char *serveSocket = nullptr;
+	const char *clientSocket = nullptr;
+	const char *fingerprintDir = nullptr;
+	vgm::SearchQuery query;
+	bool ignoreCase = false;
+	bool searchOptionSpecified = false;
+	OutputFormat recordFormat = OutputFormat::text;
+	int c;
+	int optionIndex = -1;
+	while ((c = ::getopt_long(argc, argv, "hmzbj:", options, &optionIndex)) != -1) {
+		if (c >= getopt_tagStartValue + static_cast<int>(Tag::title) &&
+				c <= getopt_tagStartValue + static_cast<int>(Tag::notes)) { // processing a tag argument
+			nonInfoSpecified = true;
+			const Tag tag = static_cast<Tag>(c - getopt_tagStartValue);
+			// TODO for Tag::notes - think about non-Unix platforms which use not \n as the line delimiter. The GD3 1.00 spec requires '\n'
+			tags[static_cast<int>(tag)] = TagValue(fromSystemEncoding(::optarg));
+		} else {
+			switch (c) {
+			case 'i':
+				showInfo = true;
+				break;
+			case 's':
+				showInfo = true;
+				failSafeInfo = true;
+				break;
+			case 'b':
+				batch = true;
+				break;
+			case 'f':
+				batch = true;
+				fileListFile = ::optarg;
+				break;
+			case 'j':
+				if (!parseNumber(::optarg, 1, 1024, threadCount)) {
+					std::cerr << "Invalid number of jobs: '" << ::optarg << "'." << std::endl;
+					return 1;
+				}
+				break;
+			case 'c':
+				if (!parseCompression(::optarg, gzipSettings)) {
+					std::cerr << "Invalid compression settings: '" << ::optarg << "'." << std::endl;
+					return 1;
+				}
+				nonInfoSpecified = true;
+				break;
+			case 'r':
+				nonInfoSpecified = true;
+				compressionReport = true;
+				break;
+			case 'g':
+				if (!parseNumber(::optarg, 1, 1024, gzipSettings.threadCount)) {
+					std::cerr << "Invalid number of compression threads: '" << ::optarg << "'." << std::endl;
+					return 1;
+				}
+				nonInfoSpecified = true;
+				gzipThreadCountSpecified = true;
+				break;
+			case 'y':
+				if (std::strcmp(::optarg, "none") == 0) {
+					saveSettings.sync = vgm::SyncMode::none;
+				} else if (std::strcmp(::optarg, "file") == 0) {
+					saveSettings.sync = vgm::SyncMode::file;
+				} else if (std::strcmp(::optarg, "full") == 0) {
+					saveSettings.sync = vgm::SyncMode::full;
+				} else {
+					std::cerr << "Invalid fsync mode: '" << ::optarg << "'." << std::endl;
+					return 1;
+				}
+				nonInfoSpecified = true;
+				break;
+			case 'A':
+				saveSettings.inPlace = false;
+				saveModeSpecified = true;
+				nonInfoSpecified = true;
+				break;
+			case 'U':
+				saveSettings.inPlace = true;
+				saveModeSpecified = true;
+				nonInfoSpecified = true;
+				break;
+			case 'S':
+				streamData = true;
+				nonInfoSpecified = true;
+				break;
+			case 'n':
+				scan = true;
+				break;
+			case 'P':
+				collectStats = true;
+				break;
+			case 'a':
+				catalogDir = ::optarg;
+				break;
+			case 'l':
+				catalogListDir = ::optarg;
+				break;
+			case 'q':
+				searchDir = ::optarg;
+				break;
+			case 'x':
+				transcodeDir = ::optarg;
+				break;
+			case 'M': {
+				unsigned mebibytes;
+				if (!parseNumber(::optarg, 1, 1024 * 1024, mebibytes)) {
+					std::cerr << "Invalid memory budget: '" << ::optarg << "'." << std::endl;
+					return 1;
+				}
+				memoryBudget = static_cast<std::size_t>(mebibytes) * 1024 * 1024;
+				memoryBudgetSpecified = true;
+				break;
+			}
+			case 'e':
+				manifestFile = ::optarg;
+				nonInfoSpecified = true;
+				break;
+			case 'D':
+				dryRun = true;
+				nonInfoSpecified = true;
+				break;
+			case 'd':
+				serveSocket = ::optarg;
+				break;
+			case 'k':
+				clientSocket = ::optarg;
+				break;
+			case 'p':
+				fingerprintDir = ::optarg;
+				break;
+			case 'w':
+				query.predicates.emplace_back();
+				if (!parsePredicate(::optarg, query.predicates.back())) {
+					std::cerr << "Invalid condition: '" << ::optarg << "'." << std::endl;
+					return 1;
+				}
+				searchOptionSpecified = true;
+				break;
+			case 'I':
+				ignoreCase = true;
+				searchOptionSpecified = true;
+				break;
+			case 'F':
+			case 'T':
+				if (!query.hasDateRange) {
+					query.hasDateRange = true;
+					query.dateFrom = 0;
+					query.dateTo = UINT32_MAX;
+				}
+				if (!parseDateOption(::optarg, c == 'T', c == 'F' ? query.dateFrom : query.dateTo)) {
+					std::cerr << "Invalid date: '" << ::optarg << "'." << std::endl;
+					return 1;
+				}
+				searchOptionSpecified = true;
+				break;
+			case 'o':
+				if (std::strcmp(::optarg, "text") == 0) {
+					recordFormat = OutputFormat::text;
+				} else if (std::strcmp(::optarg, "tsv") == 0) {
+					recordFormat = OutputFormat::tsv;
+				} else if (std::strcmp(::optarg, "json") == 0) {
+					recordFormat = OutputFormat::json;
+				} else {
+					std::cerr << "Invalid output format: '" << ::optarg << "'." << std::endl;
+					return 1;
+				}
+				break;
+			case 'h':
+				printUsage(true);
+				return 0;
+			case 'v':
+				printVersion();
+				return 0;
+			case 'm':
+				nonInfoSpecified = true;
+				if (forceVGZ) {
+					printOutputFormatConflict();
+					return 1;
+				}
+				forceVGM = true;
+				break;
+			case 'z':
+				nonInfoSpecified = true;
+				if (forceVGM) {
+					printOutputFormatConflict();
+					return 1;
+				}
+				forceVGZ = true;
+				break;
+			case '?':
+				// getopt_long takes care of informing the user about the error option
+				printUsage(false);
+				return 1;
+			default:
+				std::cerr << "Unhandled option: ";
+				if (optionIndex == -1) {
+					std::cerr << '-' << static_cast<char>(c);
+				} else {
+					std::cerr << "--" << options[optionIndex].name;
+				}
+				std::cerr << std::endl;
+				return 1;
+			}
+		}
+		optionIndex = -1;
+	}
+	if (showInfo && nonInfoSpecified) {
+		std::cerr << "No other options can be specified with --info or --info-failsafe." << std::endl;
+		return 1;
+	}
+	if (scan && (!showInfo || catalogListDir != nullptr)) {
+		std::cerr << "--scan can be specified only with --info or --info-failsafe." << std::endl;
+		return 1;
+	}
+	if (collectStats && (catalogDir != nullptr || catalogListDir != nullptr || searchDir != nullptr ||
+			transcodeDir != nullptr || manifestFile != nullptr)) {
+		std::cerr << "--stats cannot be specified with --catalog, --catalog-list, --search, --transcode or "
+				"--apply-manifest." << std::endl;
+		return 1;
+	}
+	if (dryRun && manifestFile == nullptr) {
+		std::cerr << "--dry-run can be specified only with --apply-manifest." << std::endl;
+		return 1;
+	}
+	if (serveSocket != nullptr || clientSocket != nullptr) {
+		if (serveSocket != nullptr && clientSocket != nullptr) {
+			std::cerr << "Cannot specify both --serve and --client." << std::endl;
+			return 1;
+		}
+		if (nonInfoSpecified || showInfo || batch || collectStats || catalogDir != nullptr ||
+				catalogListDir != nullptr || searchDir != nullptr || transcodeDir != nullptr ||
+				fingerprintDir != nullptr || searchOptionSpecified || recordFormat != OutputFormat::text) {
+			std::cerr << "Only -j can be specified with --serve or --client." << std::endl;
+			return 1;
+		}
+		if (serveSocket != nullptr) {
+			if (optind < argc) {
+				std::cerr << "No FILE can be specified with --serve." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			return serve(serveSocket, threadCount);
+		}
+		if (optind == argc) {
+			std::cerr << "No REQUEST specified." << std::endl;
+			printUsage(false);
+			return 1;
+		}
+		return sendRequest(clientSocket, argv + optind, argc - optind);
+	}
+	if (memoryBudgetSpecified && transcodeDir == nullptr) {
+		std::cerr << "--memory-budget can be specified only with --transcode." << std::endl;
+		return 1;
+	}
+	vgm::Stats runStats;
+	const StatsReport statsReport(collectStats ? &runStats : nullptr);
+	vgm::Stats * const phaseStats = collectStats ? &runStats : nullptr;
+	if (searchDir != nullptr) {
+		if (nonInfoSpecified || showInfo || batch || catalogDir != nullptr || catalogListDir != nullptr ||
+				transcodeDir != nullptr || fingerprintDir != nullptr) {
+			std::cerr << "Only search options can be specified with --search." << std::endl;
+			return 1;
+		}
+		if (optind < argc) {
+			std::cerr << "No FILE can be specified with --search." << std::endl;
+			printUsage(false);
+			return 1;
+		}
+		for (vgm::TagPredicate &predicate : query.predicates) {
+			predicate.ignoreCase = ignoreCase;
+		}
+		// The text format is not suitable for search results since they are meant to be processed further.
+		return searchTree(searchDir, query, recordFormat == OutputFormat::json ? OutputFormat::json : OutputFormat::tsv,
+				threadCount);
+	}
+	if (searchOptionSpecified) {
+		std::cerr << "--where, --ignore-case, --date-from and --date-to can be specified only with --search." <<
+				std::endl;
+		return 1;
+	}
+	if (recordFormat != OutputFormat::text && !showInfo && catalogListDir == nullptr && fingerprintDir == nullptr) {
+		std::cerr << "--format can be specified only with --info, --info-failsafe, --search, --catalog-list or "
+				"--fingerprint." << std::endl;
+		return 1;
+	}
+	if (fingerprintDir != nullptr) {
+		if (nonInfoSpecified || showInfo || batch || collectStats || catalogDir != nullptr ||
+				catalogListDir != nullptr || transcodeDir != nullptr) {
+			std::cerr << "Only -j and --format can be specified with --fingerprint." << std::endl;
+			return 1;
+		}
+		if (optind < argc) {
+			std::cerr << "No FILE can be specified with --fingerprint." << std::endl;
+			printUsage(false);
+			return 1;
+		}
+		return fingerprintTree(fingerprintDir, recordFormat, threadCount);
+	}
+	if (catalogDir != nullptr || catalogListDir != nullptr) {
+		if (catalogDir != nullptr && catalogListDir != nullptr) {
+			std::cerr << "Cannot specify both --catalog and --catalog-list." << std::endl;
+			return 1;
+		}
+		if (nonInfoSpecified || batch || transcodeDir != nullptr || (catalogDir != nullptr && showInfo)) {
+			std::cerr << "No tags or output options can be specified with --catalog or --catalog-list." << std::endl;
+			return 1;
+		}
+		if (catalogDir != nullptr) {
+			if (optind < argc) {
+				std::cerr << "No FILE can be specified with --catalog." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			return updateCatalog(catalogDir, threadCount);
+		}
+		return listCatalog(catalogListDir, argv + optind, argc - optind, recordFormat, failSafeInfo);
+	}
+	if (transcodeDir != nullptr) {
+		const bool tagSpecified = std::any_of(tags.begin(), tags.end(),
+				[](const TagValue &tag) { return tag.hasValue(); });
+		if (showInfo || batch || tagSpecified || compressionReport || streamData || gzipThreadCountSpecified ||
+				saveModeSpecified || manifestFile != nullptr) {
+			std::cerr << "Only -m, -z, -j, --compression and --fsync can be specified with --transcode." << std::endl;
+			return 1;
+		}
+		if (!forceVGM && !forceVGZ) {
+			std::cerr << "The output format must be forced with -m or -z for --transcode." << std::endl;
+			return 1;
+		}
+		if (optind != argc - 1) {
+			std::cerr << "Exactly one DEST_DIR must be specified with --transcode." << std::endl;
+			printUsage(false);
+			return 1;
+		}
+		vgm::TranscodeSettings settings;
+		settings.format = forceVGZ ? Format::vgz : Format::vgm;
+		settings.gzipSettings = gzipSettings;
+		settings.threadCount = threadCount;
+		settings.memoryBudget = memoryBudget;
+		settings.sync = saveSettings.sync;
+		return transcodeTree(transcodeDir, argv[optind], settings);
+	}
+	if (manifestFile != nullptr) {
+		const bool tagSpecified = std::any_of(tags.begin(), tags.end(),
+				[](const TagValue &tag) { return tag.hasValue(); });
+		if (batch || tagSpecified || forceVGM || forceVGZ || compressionReport) {
+			std::cerr << "Only -j, --compression, --gzip-threads, --fsync, --atomic, --in-place, --stream and "
+					"--dry-run can be specified with --apply-manifest." << std::endl;
+			return 1;
+		}
+		if (optind < argc) {
+			std::cerr << "No FILE can be specified with --apply-manifest." << std::endl;
+			printUsage(false);
+			return 1;
+		}
+		if (!gzipThreadCountSpecified) {
+			gzipSettings.threadCount = 1; // the files themselves are processed in parallel
+		}
+		return applyManifest(manifestFile, threadCount, dryRun, gzipSettings, saveSettings, streamData);
+	}
+	if (batch) {
+		std::vector<std::string> files;
+		if (fileListFile != nullptr) {
+			if (optind < argc) {
+				std::cerr << "No FILE can be specified with --files0-from." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			if (!readFileList(fileListFile, files)) {
+				std::cerr << "Unable to read the list of files from '" << fileListFile << "'." << std::endl;
+				return 1;
+			}
+		} else {
+			files.assign(argv + optind, argv + argc);
+		}
+		if (files.empty()) {
+			std::cerr << "No FILE specified." << std::endl;
+			printUsage(false);
+			return 1;
+		}
+		if (!gzipThreadCountSpecified) {
+			gzipSettings.threadCount = 1; // the files themselves are processed in parallel
+		}
+		return processBatch(files, threadCount, tags, forceVGM, forceVGZ, showInfo, failSafeInfo, scan, recordFormat,
+				gzipSettings, saveSettings, streamData, compressionReport, phaseStats);
+	}
+
+	if (optind == argc) {
+		std::cerr << "No SOURCE file." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (optind < argc-2) {
+		std::cerr << "Only SOURCE and DEST files can be specified." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+
+	const char * const src(argv[optind]);
+
+	bool saveToSameFile;
+	const char *destFile;
+	if (optind < argc-1) { // there is DEST file
+		if (showInfo) {
+			std::cerr << "Only SOURCE can be specified with --info or --info-failsafe." << std::endl;
+			return 1;
+		}
+		saveToSameFile = false;
+		destFile = argv[optind+1];
+	} else { // there is no DEST file
+		saveToSameFile = true;
+		destFile = argv[optind];
+	}
+
+	if (!gzipThreadCountSpecified) {
+		gzipSettings.threadCount = defaultThreadCount();
+	}
+
+	runStats.fileCount = 1;
+	if (showInfo && scan) {
+		ScannedFile scanned;
+		{
+			PhaseTimer timer(phaseStats, Phase::scan);
+			scanFile(src, scanned);
+			timer.addBytesIn(scanned.dataSize);
+		}
+		if (recordFormat == OutputFormat::tsv) {
+			printTSVHeader(std::cout, true);
+		}
+		try {
+			PhaseTimer timer(phaseStats, Phase::info);
+			printInfo(scanned, src, recordFormat, failSafeInfo);
+		}
+		catch (afc::Exception &ex) {
+			printUnmappableTagsError();
+			return 1;
+		}
+		return scanned.stats.errors.empty() ? 0 : 1;
+	}
+	if (showInfo) {
+		VGMFile vgmFile = loadFile(src, VGMFile::LoadMode::tagsOnly, phaseStats);
+		if (recordFormat == OutputFormat::tsv) {
+			printTSVHeader(std::cout);
+		}
+		try {
+			PhaseTimer timer(phaseStats, Phase::info);
+			printInfo(vgmFile, src, recordFormat, failSafeInfo);
+		}
+		catch (afc::Exception &ex) {
+			printUnmappableTagsError();
+			return 1;
+		}
+		return 0;
+	}
+
+	/* The VGM data is not needed if only the GD3 info of the source file is to be updated.
+	 * Otherwise the VGM data is copied from SOURCE to DEST without being buffered if possible.
+	 */
+	VGMFile vgmFile = loadFile(src, streamData ? VGMFile::LoadMode::streamedData : saveToSameFile ?
+			VGMFile::LoadMode::deferredData : VGMFile::LoadMode::mappedData, phaseStats);
+
+	applyTags(vgmFile, tags);
+
+	const Format outputFormat = resolveOutputFormat(vgmFile, destFile, saveToSameFile, forceVGM, forceVGZ);
+
+	vgm::CompressionStats stats = {0, 0, 0};
+	if (compressionReport) {
+		gzipSettings.stats = &stats;
+	}
+	try {
+		vgmFile.save(destFile, outputFormat, gzipSettings, saveSettings);
+	}
+	catch (afc::Exception &ex) {
+		std::cerr << "Unable to save VGM/VGZ data to '" << destFile << "':\n  " << ex.what() << std::endl;
+		return 1;
+	}
+	if (stats.compressedSize != 0) {
+		printCompressionReport(stats, std::cout);
+		std::cout.flush();
 	}
 
 	return 0;
@@ -0,0 +1,260 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "manifest.h"
+#include "utf.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+using namespace vgm;
+
+namespace
+{
+	const size_t TAG_COUNT = ManifestRow::TAG_COUNT;
+	const char * const TAG_NAMES[TAG_COUNT] = {"title", "titleJP", "game", "gameJP", "system", "systemJP",
+			"author", "authorJP", "date", "converter", "notes"};
+	// The index of the path column among the columns of a manifest, next to the indices of the tags.
+	const size_t PATH_COLUMN = TAG_COUNT;
+
+	struct Field
+	{
+		string value;
+		// True if the value is "", which clears the tag instead of leaving it unchanged.
+		bool quoted;
+	};
+
+	enum class ReadResult
+	{
+		record, end, error
+	};
+
+	inline bool isLineEnd(const char * const p, const char * const end)
+	{
+		return *p == '\n' || (*p == '\r' && (p + 1 == end || p[1] == '\n'));
+	}
+
+	inline void skipLineEnd(const char *&p, const char * const end, size_t &line)
+	{
+		if (p != end) {
+			p += *p == '\r' && p + 1 != end ? 2 : 1;
+		}
+		++line;
+	}
+
+	// Skips empty lines. Returns false if the end of the content is reached.
+	inline bool skipEmptyLines(const char *&p, const char * const end, size_t &line)
+	{
+		while (p != end && isLineEnd(p, end)) {
+			skipLineEnd(p, end, line);
+		}
+		return p != end;
+	}
+
+	ReadResult readTSVRecord(const char *&p, const char * const end, size_t &line, vector<Field> &fields,
+			ManifestError &error)
+	{
+		fields.clear();
+		if (!skipEmptyLines(p, end, line)) {
+			return ReadResult::end;
+		}
+		fields.push_back(Field{string(), false});
+		for (; p != end && !isLineEnd(p, end); ++p) {
+			if (*p == '\t') {
+				fields.push_back(Field{string(), false});
+				continue;
+			}
+			if (*p != '\\') {
+				fields.back().value += *p;
+				continue;
+			}
+			if (++p == end) {
+				error = ManifestError{line, "Invalid escape sequence"};
+				return ReadResult::error;
+			}
+			switch (*p) {
+			case '\\':
+				fields.back().value += '\\';
+				break;
+			case 't':
+				fields.back().value += '\t';
+				break;
+			case 'n':
+				fields.back().value += '\n';
+				break;
+			case 'r':
+				fields.back().value += '\r';
+				break;
+			default:
+				error = ManifestError{line, "Invalid escape sequence"};
+				return ReadResult::error;
+			}
+		}
+		skipLineEnd(p, end, line);
+		for (Field &field : fields) {
+			if (field.value == "\"\"") {
+				field.value.clear();
+				field.quoted = true;
+			}
+		}
+		return ReadResult::record;
+	}
+
+	ReadResult readCSVRecord(const char *&p, const char * const end, size_t &line, vector<Field> &fields,
+			ManifestError &error)
+	{
+		fields.clear();
+		if (!skipEmptyLines(p, end, line)) {
+			return ReadResult::end;
+		}
+		const size_t recordLine = line;
+		for (;;) {
+			fields.push_back(Field{string(), false});
+			Field &field = fields.back();
+			if (p != end && *p == '"') {
+				field.quoted = true;
+				for (++p;; ++p) {
+					if (p == end) {
+						error = ManifestError{recordLine, "Unterminated quoted value"};
+						return ReadResult::error;
+					}
+					if (*p == '"') {
+						if (p + 1 == end || p[1] != '"') {
+							++p;
+							break;
+						}
+						++p; // a doubled double quote stands for one
+					} else if (*p == '\n') {
+						++line;
+					} else if (*p == '\r' && p + 1 != end && p[1] == '\n') {
+						continue; // line breaks within values are stored as LF as GD3 requires
+					}
+					field.value += *p;
+				}
+				if (p != end && *p != ',' && !isLineEnd(p, end)) {
+					error = ManifestError{line, "Unexpected characters after a quoted value"};
+					return ReadResult::error;
+				}
+			} else {
+				for (; p != end && *p != ',' && !isLineEnd(p, end); ++p) {
+					if (*p == '"') {
+						error = ManifestError{line, "Unexpected double quote in an unquoted value"};
+						return ReadResult::error;
+					}
+					field.value += *p;
+				}
+			}
+			if (p == end || *p != ',') {
+				break;
+			}
+			++p;
+		}
+		skipLineEnd(p, end, line);
+		return ReadResult::record;
+	}
+
+	// Returns the index of the column with the given name, or SIZE_MAX if there is no such column.
+	size_t columnIndex(const string &name)
+	{
+		if (name == "path") {
+			return PATH_COLUMN;
+		}
+		for (size_t i = 0; i < TAG_COUNT; ++i) {
+			if (name == TAG_NAMES[i]) {
+				return i;
+			}
+		}
+		return SIZE_MAX;
+	}
+}
+
+bool vgm::parseManifest(const char * const content, const size_t size, vector<ManifestRow> &rows,
+		ManifestError &error)
+{
+	const char *p = content;
+	const char * const end = content + size;
+	if (size >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0) {
+		p += 3;
+	}
+	size_t line = 1;
+	skipEmptyLines(p, end, line);
+	const size_t headerLine = line;
+	const char * const headerEnd = find(p, end, '\n');
+	auto readRecord = find(p, headerEnd, '\t') != headerEnd ? readTSVRecord : readCSVRecord;
+	vector<Field> fields;
+	ReadResult result = readRecord(p, end, line, fields, error);
+	if (result == ReadResult::error) {
+		return false;
+	}
+	if (result == ReadResult::end) {
+		error = ManifestError{line, "There is no header"};
+		return false;
+	}
+	vector<size_t> columns;
+	bool present[TAG_COUNT + 1] = {};
+	for (const Field &field : fields) {
+		const size_t column = columnIndex(field.value);
+		if (column == SIZE_MAX) {
+			error = ManifestError{headerLine, "Unknown column"};
+			return false;
+		}
+		if (present[column]) {
+			error = ManifestError{headerLine, "Duplicate column"};
+			return false;
+		}
+		present[column] = true;
+		columns.push_back(column);
+	}
+	if (!present[PATH_COLUMN]) {
+		error = ManifestError{headerLine, "There is no path column"};
+		return false;
+	}
+
+	for (;;) {
+		skipEmptyLines(p, end, line);
+		const size_t recordLine = line;
+		result = readRecord(p, end, line, fields, error);
+		if (result != ReadResult::record) {
+			return result == ReadResult::end;
+		}
+		if (fields.size() != columns.size()) {
+			error = ManifestError{recordLine, "The number of values differs from the number of columns"};
+			return false;
+		}
+		rows.emplace_back();
+		ManifestRow &row = rows.back();
+		row.line = recordLine;
+		fill(row.hasTag, row.hasTag + TAG_COUNT, false);
+		for (size_t i = 0, n = fields.size(); i < n; ++i) {
+			Field &field = fields[i];
+			const size_t column = columns[i];
+			if (column == PATH_COLUMN) {
+				if (field.value.empty()) {
+					error = ManifestError{recordLine, "The path is empty"};
+					return false;
+				}
+				row.path.swap(field.value);
+			} else if (!field.value.empty() || field.quoted) {
+				if (!utf8ToUTF16(field.value.data(), field.value.size(), row.tags[column])) {
+					error = ManifestError{recordLine, "Invalid UTF-8 value"};
+					return false;
+				}
+				row.hasTag[column] = true;
+			}
+		}
+	}
+}
@@ -0,0 +1,62 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_MANIFEST_H_
+#define VGM_MANIFEST_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "vgm.h"
+
+namespace vgm
+{
+	// The tags to be set in a file, as given by a row of a manifest.
+	struct ManifestRow
+	{
+		static const std::size_t TAG_COUNT = static_cast<std::size_t>(VGMFile::Tag::notes) + 1;
+
+		std::string path;
+		// The number of the line of the manifest the row starts at (the header is line 1).
+		std::size_t line;
+		// The i-th tag is to be set to tags[i] if hasTag[i] is true, and is left unchanged otherwise.
+		bool hasTag[TAG_COUNT];
+		std::u16string tags[TAG_COUNT];
+	};
+
+	struct ManifestError
+	{
+		std::size_t line;
+		const char *message;
+	};
+
+	/*
+	 * Parses a manifest: a table of UTF-8 text with a header row. The header names the columns: path and any
+	 * of the tags (title, titleJP, game etc.) in any order. Each following row gives the tags to be set in
+	 * the file at path. The manifest is tab-separated if its header contains a tab, and comma-separated
+	 * otherwise:
+	 * - in CSV, a value can be enclosed in double quotes to contain commas, line breaks and double quotes
+	 *   (doubled) as in RFC 4180;
+	 * - in TSV, a value can contain the escape sequences \\, \t, \n and \r as the TSV output of --info has.
+	 * An empty value leaves the tag unchanged while a value of "" clears it. Empty lines, a UTF-8 byte order
+	 * mark and CR LF line ends are accepted.
+	 * Returns false and stores the line and the cause of the first error to error if the manifest is invalid;
+	 * rows is unspecified then.
+	 */
+	bool parseManifest(const char *content, std::size_t size, std::vector<ManifestRow> &rows, ManifestError &error);
+}
+
+#endif // VGM_MANIFEST_H_
@@ -0,0 +1,101 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "parallel.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+	// The maximal number of tasks per worker thread that can be started ahead of the first incomplete one.
+	const size_t LOOKAHEAD_PER_THREAD = 4;
+}
+
+unsigned vgm::defaultThreadCount()
+{
+	const unsigned n = thread::hardware_concurrency();
+	return n == 0 ? 1 : n;
+}
+
+void vgm::runOrdered(const size_t n, const unsigned threadCount,
+		const function<void(size_t)> &task, const function<void(size_t)> &complete)
+{
+	const size_t workerCount = min(static_cast<size_t>(max(threadCount, 1u)), n);
+	if (workerCount <= 1) {
+		for (size_t i = 0; i < n; ++i) {
+			task(i);
+			complete(i);
+		}
+		return;
+	}
+
+	const size_t lookahead = workerCount * LOOKAHEAD_PER_THREAD;
+
+	mutex m;
+	condition_variable taskDone, slotFree;
+	vector<bool> done(n, false);
+	size_t next = 0; // The index of the next task to start.
+	size_t completed = 0; // The number of tasks completed by the calling thread.
+
+	auto worker = [&]()
+	{
+		for (;;) {
+			size_t i;
+			{
+				unique_lock<mutex> lock(m);
+				slotFree.wait(lock, [&]() { return next >= n || next < completed + lookahead; });
+				if (next >= n) {
+					return;
+				}
+				i = next++;
+			}
+			task(i);
+			{
+				lock_guard<mutex> lock(m);
+				done[i] = true;
+			}
+			taskDone.notify_one();
+		}
+	};
+
+	vector<thread> workers;
+	workers.reserve(workerCount);
+	for (size_t i = 0; i < workerCount; ++i) {
+		workers.emplace_back(worker);
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		{
+			unique_lock<mutex> lock(m);
+			taskDone.wait(lock, [&]() { return static_cast<bool>(done[i]); });
+		}
+		complete(i);
+		{
+			lock_guard<mutex> lock(m);
+			completed = i + 1;
+		}
+		slotFree.notify_all();
+	}
+
+	for (thread &t : workers) {
+		t.join();
+	}
+}
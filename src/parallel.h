@@ -0,0 +1,41 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_PARALLEL_H_
+#define VGM_PARALLEL_H_
+
+#include <cstddef>
+#include <functional>
+
+namespace vgm
+{
+	// Returns the number of worker threads to use by default, i.e. the number of hardware threads available.
+	unsigned defaultThreadCount();
+
+	/*
+	 * Executes task(i) for each i in [0, n) using up to threadCount worker threads, and executes complete(i)
+	 * in the calling thread for each i in the ascending order, as soon as task(i) and all tasks before it
+	 * are finished. This allows the results of the tasks to be reported in a deterministic order.
+	 *
+	 * Tasks are not started too far ahead of the first incomplete one, so that the number of results
+	 * that wait to be completed is bounded.
+	 *
+	 * Neither task nor complete must throw exceptions.
+	 */
+	void runOrdered(const std::size_t n, const unsigned threadCount,
+			const std::function<void(std::size_t)> &task, const std::function<void(std::size_t)> &complete);
+}
+
+#endif // VGM_PARALLEL_H_
@@ -0,0 +1,438 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "parser.h"
+#include "format.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <afc/cpu/primitive.h>
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+using namespace vgm;
+
+namespace
+{
+	static const afc::endianness LE = afc::endianness::LE;
+
+	// The size of the chunks the content is read, inflated and delivered to the handler in.
+	const size_t CHUNK_SIZE = 64 * 1024;
+
+	// A forward-only source of the content of a VGM file that knows its position.
+	class Source
+	{
+	public:
+		Source() : m_pos(0) {}
+		virtual ~Source() {}
+
+		// Reads up to n octets into buf. Returns 0 at the end of the content.
+		size_t read(unsigned char * const buf, const size_t n)
+		{
+			const size_t count = doRead(buf, n);
+			m_pos += count;
+			return count;
+		}
+
+		/* Consumes up to n octets that are available in memory and returns a pointer to them, with their
+		 * number stored in size. Returns nullptr if the source does not hold its content in memory.
+		 */
+		const unsigned char *readView(const size_t n, size_t &size)
+		{
+			const unsigned char * const view = doReadView(n, size);
+			m_pos += size;
+			return view;
+		}
+
+		void skip(const size_t n)
+		{
+			doSkip(n);
+			m_pos += n;
+		}
+
+		size_t pos() const { return m_pos; }
+	protected:
+		virtual size_t doRead(unsigned char *buf, size_t n) = 0;
+		virtual const unsigned char *doReadView(size_t n, size_t &size) { size = 0; return nullptr; }
+
+		// Skips exactly n octets. Decompressing and non-seekable sources read them into a fixed-size buffer.
+		virtual void doSkip(size_t n)
+		{
+			unsigned char buf[4096];
+			while (n > 0) {
+				const size_t count = doRead(buf, min(n, sizeof(buf)));
+				if (count == 0) {
+					throw Exception("Premature end of file"_s);
+				}
+				n -= count;
+			}
+		}
+	private:
+		size_t m_pos;
+	};
+
+	class MemorySource : public Source
+	{
+	public:
+		MemorySource(const unsigned char * const buf, const size_t size) : m_buf(buf), m_size(size), m_offset(0) {}
+	protected:
+		size_t doRead(unsigned char * const buf, const size_t n) override
+		{
+			size_t size;
+			const unsigned char * const view = doReadView(n, size);
+			if (size > 0) {
+				memcpy(buf, view, size);
+			}
+			return size;
+		}
+
+		const unsigned char *doReadView(const size_t n, size_t &size) override
+		{
+			size = min(n, m_size - m_offset);
+			const unsigned char * const view = m_buf + m_offset;
+			m_offset += size;
+			return view;
+		}
+
+		void doSkip(const size_t n) override
+		{
+			if (n > m_size - m_offset) {
+				throw Exception("Premature end of file"_s);
+			}
+			m_offset += n;
+		}
+	private:
+		const unsigned char * const m_buf;
+		const size_t m_size;
+		size_t m_offset;
+	};
+
+	class FdSource : public Source
+	{
+	public:
+		explicit FdSource(const int fd) : m_fd(fd)
+		{
+			struct stat fileStat;
+			m_seekable = ::fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode);
+		}
+	protected:
+		size_t doRead(unsigned char * const buf, const size_t n) override
+		{
+			for (;;) {
+				const ssize_t count = ::read(m_fd, buf, n);
+				if (count >= 0) {
+					return static_cast<size_t>(count);
+				}
+				if (errno != EINTR) {
+					throw Exception("Unable to read file"_s);
+				}
+			}
+		}
+
+		void doSkip(const size_t n) override
+		{
+			if (m_seekable) {
+				// The end of the file is not checked here; reading the next section detects it.
+				if (::lseek(m_fd, static_cast<off_t>(n), SEEK_CUR) == -1) {
+					throw Exception("Unable to read file"_s);
+				}
+			} else {
+				Source::doSkip(n);
+			}
+		}
+	private:
+		const int m_fd;
+		bool m_seekable;
+	};
+
+	// Thrown by ExtentSource when the content to read is not in memory.
+	struct MissingContent
+	{
+		size_t offset;
+		size_t size;
+	};
+
+	// The content of a file of which only some extents are in memory.
+	class ExtentSource : public Source
+	{
+	public:
+		ExtentSource(const Extent * const extents, const size_t extentCount) : m_extents(extents),
+				m_extentCount(extentCount), m_offset(0) {}
+	protected:
+		size_t doRead(unsigned char * const buf, const size_t n) override
+		{
+			for (size_t i = 0; i < m_extentCount; ++i) {
+				const Extent &extent = m_extents[i];
+				if (m_offset >= extent.offset && m_offset < extent.offset + extent.size) {
+					const size_t size = min(n, extent.offset + extent.size - m_offset);
+					memcpy(buf, extent.data + (m_offset - extent.offset), size);
+					m_offset += size;
+					return size;
+				}
+			}
+			throw MissingContent{m_offset, n};
+		}
+
+		void doSkip(const size_t n) override { m_offset += n; }
+	private:
+		const Extent * const m_extents;
+		const size_t m_extentCount;
+		size_t m_offset;
+	};
+
+	// Inflates the gzip stream read from another source. Concatenated gzip members are inflated as one stream.
+	class InflateSource : public Source
+	{
+	public:
+		/* The first prefixSize octets of the compressed stream are taken from prefix, which must be valid
+		 * during the lifetime of the source. The remainder is read from in.
+		 */
+		InflateSource(Source &in, const unsigned char * const prefix, const size_t prefixSize)
+			: m_in(in), m_prefix(prefix), m_prefixSize(prefixSize), m_end(false), m_buf(new unsigned char[CHUNK_SIZE])
+		{
+			m_stream.zalloc = Z_NULL;
+			m_stream.zfree = Z_NULL;
+			m_stream.opaque = Z_NULL;
+			m_stream.next_in = Z_NULL;
+			m_stream.avail_in = 0;
+			if (inflateInit2(&m_stream, 16 + MAX_WBITS) != Z_OK) {
+				throw Exception("Unable to initialise decompression"_s);
+			}
+		}
+
+		~InflateSource() { inflateEnd(&m_stream); }
+	protected:
+		size_t doRead(unsigned char * const buf, const size_t n) override
+		{
+			m_stream.next_out = buf;
+			m_stream.avail_out = static_cast<uInt>(n);
+			while (m_stream.avail_out > 0 && !m_end) {
+				if (m_stream.avail_in == 0 && !fillInput()) {
+					break; // the compressed stream is truncated; the caller detects the premature end
+				}
+				const int result = inflate(&m_stream, Z_NO_FLUSH);
+				if (result == Z_STREAM_END) {
+					// Another gzip member may follow.
+					if (m_stream.avail_in == 0 && !fillInput()) {
+						m_end = true;
+					} else if (inflateReset(&m_stream) != Z_OK) {
+						throw Exception("Corrupted VGZ file"_s);
+					}
+				} else if (result != Z_OK && result != Z_BUF_ERROR) {
+					throw Exception("Corrupted VGZ file"_s);
+				}
+			}
+			return n - m_stream.avail_out;
+		}
+	private:
+		bool fillInput()
+		{
+			if (m_prefixSize > 0) {
+				m_stream.next_in = const_cast<unsigned char *>(m_prefix);
+				m_stream.avail_in = static_cast<uInt>(m_prefixSize);
+				m_prefixSize = 0;
+				return true;
+			}
+			size_t size;
+			const unsigned char *view = m_in.readView(CHUNK_SIZE, size);
+			if (view == nullptr) {
+				size = m_in.read(m_buf.get(), CHUNK_SIZE);
+				view = m_buf.get();
+			}
+			m_stream.next_in = const_cast<unsigned char *>(view);
+			m_stream.avail_in = static_cast<uInt>(size);
+			return size > 0;
+		}
+
+		Source &m_in;
+		const unsigned char *m_prefix;
+		size_t m_prefixSize;
+		bool m_end;
+		z_stream m_stream;
+		unique_ptr<unsigned char[]> m_buf;
+	};
+
+	inline void readBytes(Source &in, unsigned char *buf, size_t n)
+	{
+		while (n > 0) {
+			const size_t count = in.read(buf, n);
+			if (count == 0) {
+				throw Exception("Premature end of file"_s);
+			}
+			buf += count;
+			n -= count;
+		}
+	}
+
+	inline void setPos(Source &in, const size_t pos)
+	{
+		if (pos < in.pos()) {
+			// The content is read in a single forward pass.
+			throw Exception("Overlapping VGM file sections"_s);
+		}
+		in.skip(pos - in.pos());
+	}
+
+	// The in.pos() octets already read from in must be stored at the start of header.
+	VGMSections readHeader(Source &in, unsigned char header[format::LONG_HEADER_SIZE])
+	{
+		// The base header is required for all versions of the VGM format.
+		readBytes(in, header + in.pos(), format::SHORT_HEADER_SIZE - in.pos());
+		uint32_t elements[format::SHORT_HEADER_SIZE / 4];
+		for (size_t i = 0; i < format::SHORT_HEADER_SIZE / 4; ++i) {
+			elements[i] = UInt32<>::fromBytes<LE>(header + 4*i);
+		}
+		const format::Layout layout = format::readLayout(elements);
+		readBytes(in, header + format::SHORT_HEADER_SIZE, layout.headerSize - format::SHORT_HEADER_SIZE);
+
+		VGMSections sections;
+		sections.version = elements[format::IDX_VERSION];
+		sections.headerSize = layout.headerSize;
+		sections.dataOffset = layout.dataOffset;
+		sections.dataSize = layout.dataSize;
+		sections.gd3Offset = layout.gd3Offset;
+		sections.gd3Size = layout.gd3Size;
+		sections.fileSize = layout.fileSize;
+		return sections;
+	}
+
+	void readGD3Info(Source &in, const VGMSections &sections, ParseHandler &handler)
+	{
+		setPos(in, sections.gd3Offset);
+
+		unsigned char gd3Header[format::GD3_HEADER_SIZE];
+		readBytes(in, gd3Header, format::GD3_HEADER_SIZE);
+		const uint32_t length = format::readGD3Header(gd3Header, sections.gd3Size);
+
+		const size_t blockSize = length & ~static_cast<size_t>(1); // UTF-16 code units are read only
+		vector<unsigned char> block(blockSize);
+		readBytes(in, block.data(), blockSize);
+		if (blockSize != length) {
+			in.skip(1);
+		}
+
+		// The tags are decoded all at once and passed to the handler as views into the decoded block.
+		size_t offsets[format::GD3_TAG_COUNT], sizes[format::GD3_TAG_COUNT];
+		format::splitGD3Tags(block.data(), blockSize, offsets, sizes);
+		vector<char16_t> chars(blockSize / 2);
+		format::decodeUTF16LE(block.data(), chars.size(), chars.data());
+		for (size_t i = 0; i < format::GD3_TAG_COUNT; ++i) {
+			handler.tag(static_cast<VGMFile::Tag>(i), chars.data() + offsets[i] / 2, sizes[i] / 2);
+		}
+	}
+
+	void readData(Source &in, const VGMSections &sections, ParseHandler &handler)
+	{
+		setPos(in, sections.dataOffset);
+		if (!handler.wantsData()) {
+			in.skip(sections.dataSize);
+			return;
+		}
+		unique_ptr<unsigned char[]> buf;
+		for (size_t remaining = sections.dataSize; remaining > 0;) {
+			size_t size;
+			const unsigned char *chunk = in.readView(min(remaining, CHUNK_SIZE), size);
+			if (chunk == nullptr) {
+				if (buf == nullptr) {
+					buf.reset(new unsigned char[CHUNK_SIZE]);
+				}
+				size = in.read(buf.get(), min(remaining, CHUNK_SIZE));
+				chunk = buf.get();
+			}
+			if (size == 0) {
+				throw Exception("Premature end of file"_s);
+			}
+			handler.data(chunk, size);
+			remaining -= size;
+		}
+	}
+
+	// Parses the content of the VGM file. The octets already read from in must be stored at the start of header.
+	void parseContent(Source &in, unsigned char header[format::LONG_HEADER_SIZE], const VGMFile::Format fileFormat,
+			ParseHandler &handler)
+	{
+		VGMSections sections = readHeader(in, header);
+		sections.format = fileFormat;
+		handler.header(header, sections.headerSize);
+		handler.sections(sections);
+
+		// The sections are read in the ascending order of their offsets so that the input is read in a single pass.
+		if (sections.gd3Offset != 0 && sections.gd3Offset < sections.dataOffset) { // header -> gd3 -> data -> eof
+			readGD3Info(in, sections, handler);
+			readData(in, sections, handler);
+		} else {
+			readData(in, sections, handler);
+			if (sections.gd3Offset != 0) {
+				readGD3Info(in, sections, handler);
+			}
+		}
+	}
+
+	void parseSource(Source &in, ParseHandler &handler)
+	{
+		unsigned char header[format::LONG_HEADER_SIZE];
+		readBytes(in, header, 4);
+		if (header[0] == 0x1f && header[1] == 0x8b) { // GZip file magic header is {0x1f, 0x8b}
+			InflateSource inflated(in, header, 4);
+			unsigned char uncompressedHeader[format::LONG_HEADER_SIZE];
+			parseContent(inflated, uncompressedHeader, VGMFile::Format::vgz, handler);
+		} else {
+			parseContent(in, header, VGMFile::Format::vgm, handler);
+		}
+	}
+}
+
+void vgm::parse(const unsigned char * const buf, const size_t size, ParseHandler &handler)
+{
+	MemorySource in(buf, size);
+	parseSource(in, handler);
+}
+
+void vgm::parse(const int fd, ParseHandler &handler)
+{
+	FdSource in(fd);
+	parseSource(in, handler);
+}
+
+bool vgm::parse(const Extent extents[], const size_t extentCount, ParseHandler &handler,
+		size_t &missingOffset, size_t &missingSize)
+{
+	ExtentSource in(extents, extentCount);
+	try {
+		unsigned char header[format::LONG_HEADER_SIZE];
+		readBytes(in, header, 4);
+		if (header[0] == 0x1f && header[1] == 0x8b) {
+			throw Exception("Compressed content cannot be parsed in pieces"_s);
+		}
+		parseContent(in, header, VGMFile::Format::vgm, handler);
+	}
+	catch (const MissingContent &missing) {
+		missingOffset = missing.offset;
+		missingSize = missing.size;
+		return false;
+	}
+	return true;
+}
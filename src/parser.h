@@ -0,0 +1,142 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_PARSER_H_
+#define VGM_PARSER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "vgm.h"
+
+namespace vgm
+{
+	// The location of the sections of a VGM file. All offsets are absolute offsets in the uncompressed content.
+	struct VGMSections
+	{
+		VGMFile::Format format;
+		uint32_t version;
+		// The number of header octets stored in the file.
+		std::size_t headerSize;
+		std::size_t dataOffset;
+		std::size_t dataSize;
+		// The offset of the GD3 info, or 0 if the file has no GD3 info.
+		std::size_t gd3Offset;
+		/* The space between the GD3 info offset and the next section (or the end of the file), or 0 if the file
+		 * has no GD3 info. It is the size of the GD3 info including its 12-octet header in well-formed files.
+		 */
+		std::size_t gd3Size;
+		// The size of the uncompressed content as declared by the EOF offset.
+		std::size_t fileSize;
+	};
+
+	/*
+	 * Receives the constituents of a VGM file from parse(). The callbacks are invoked in the following order:
+	 * header(), sections(), then tag() for each tag and data() for each chunk of the VGM data in the order
+	 * the GD3 info and the VGM data are stored in the file. The pointers passed are valid only during the call.
+	 *
+	 * The default implementations ignore what they receive.
+	 */
+	class ParseHandler
+	{
+	public:
+		virtual ~ParseHandler() {}
+
+		// The header as stored in the file (little-endian), of VGMSections::headerSize octets.
+		virtual void header(const unsigned char *header, std::size_t size) {}
+
+		virtual void sections(const VGMSections &sections) {}
+
+		/* A tag value as UTF-16 code units in the platform byte order, without the NUL terminator.
+		 * If the file has no GD3 info then tag() is not called at all.
+		 */
+		virtual void tag(VGMFile::Tag tag, const char16_t *value, std::size_t size) {}
+
+		/* If false is returned then the VGM data is skipped without being read into memory (the data of
+		 * uncompressed files on seekable descriptors is not read at all), and data() is not called.
+		 */
+		virtual bool wantsData() const { return false; }
+
+		// A chunk of the VGM data. The concatenation of all chunks is the VGM data.
+		virtual void data(const unsigned char *chunk, std::size_t size) {}
+	};
+
+	// The format, the version and the tags of a file as parsed from its header and GD3 info.
+	struct TagInfo
+	{
+		VGMFile::Format format = VGMFile::Format::vgm;
+		uint32_t version = 0;
+		std::u16string tags[static_cast<std::size_t>(VGMFile::Tag::notes) + 1];
+	};
+
+	// Collects the TagInfo of a file. The VGM data is not wanted.
+	class TagInfoHandler : public ParseHandler
+	{
+	public:
+		explicit TagInfoHandler(TagInfo &info) : m_info(info) {}
+
+		void sections(const VGMSections &sections) override
+		{
+			m_info.format = sections.format;
+			m_info.version = sections.version;
+		}
+
+		void tag(const VGMFile::Tag tag, const char16_t * const value, const std::size_t size) override
+		{
+			m_info.tags[static_cast<std::size_t>(tag)].assign(value, size);
+		}
+	private:
+		TagInfo &m_info;
+	};
+
+	/*
+	 * Parses the VGM or VGZ file stored in the buffer and delivers its constituents to the handler.
+	 * If the file is not compressed then the chunks of the VGM data passed to the handler point into the buffer.
+	 *
+	 * Throws afc::Exception if the content is not a valid VGM/VGZ file. Exceptions thrown by the handler are
+	 * propagated.
+	 */
+	void parse(const unsigned char *buf, std::size_t size, ParseHandler &handler);
+
+	/*
+	 * Parses the VGM or VGZ file read from fd (from its current position) and delivers its constituents to
+	 * the handler. The descriptor can be a pipe or a socket; the content is read in a single forward pass then.
+	 * The descriptor is not closed.
+	 */
+	void parse(int fd, ParseHandler &handler);
+
+	// A piece of the content of a file that is in memory.
+	struct Extent
+	{
+		std::size_t offset;
+		const unsigned char *data;
+		std::size_t size;
+	};
+
+	/*
+	 * Parses the uncompressed VGM file of which only the given extents are in memory, e.g. the pieces read
+	 * around the header and the GD3 info. The extents can be in any order and can overlap. The VGM data is
+	 * skipped without being read, as for seekable descriptors, unless the handler wants it.
+	 *
+	 * Returns false if the content needed is not in the extents, and stores the offset and the size of the
+	 * first missing piece to missingOffset and missingSize. The handler may have received a part of the
+	 * callbacks then. Throws afc::Exception if the content is not a valid VGM file.
+	 */
+	bool parse(const Extent extents[], std::size_t extentCount, ParseHandler &handler,
+			std::size_t &missingOffset, std::size_t &missingSize);
+}
+
+#endif // VGM_PARSER_H_
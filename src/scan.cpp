@@ -0,0 +1,314 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "scan.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <afc/cpu/primitive.h>
+
+using namespace afc;
+using namespace std;
+
+namespace
+{
+	static const afc::endianness LE = afc::endianness::LE;
+
+	// Absolute positions of the header values that describe the command stream.
+	const size_t POS_TOTAL_SAMPLES = 0x18, POS_LOOP = 0x1c, POS_LOOP_SAMPLES = 0x20;
+
+	const unsigned CMD_WAIT = 0x61, CMD_END = 0x66, CMD_DATA_BLOCK = 0x67, CMD_PCM_RAM_WRITE = 0x68;
+	// The compatibility octet that follows the data block and PCM RAM write opcodes.
+	const unsigned char CMD_COMPATIBILITY = 0x66;
+
+	/* The length in octets of each command by its opcode, including the opcode itself, or 0 for the opcodes
+	 * that are not defined. Reserved opcodes have the lengths the specification assigns to their ranges.
+	 * The length of a data block (0x67) is that of its fixed part; its content follows.
+	 */
+	constexpr unsigned char COMMAND_LENGTHS[256] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x20
+		2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 0x30
+		3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 2, // 0x40
+		2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // 0x50
+		0, 3, 1, 1, 4, 0, 1, 7, 12, 0, 0, 0, 0, 0, 0, 0, // 0x60
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+		5, 5, 6, 11, 2, 5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x90
+		3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // 0xa0
+		3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // 0xb0
+		4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xc0
+		4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xd0
+		5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, // 0xe0
+		5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5  // 0xf0
+	};
+
+	/* The number of samples each command waits for by its opcode. The wait of 0x61 is its operand.
+	 * 0x8n writes to the YM2612 DAC and then waits for n samples.
+	 */
+	constexpr uint16_t COMMAND_WAITS[256] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x20
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x30
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x40
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x50
+		0, 0, 735, 882, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x60
+		1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, // 0x70
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, // 0x80
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x90
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xa0
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xb0
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xc0
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xd0
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xe0
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0  // 0xf0
+	};
+
+	static_assert(COMMAND_LENGTHS[CMD_DATA_BLOCK] == 7 && COMMAND_LENGTHS[CMD_PCM_RAM_WRITE] == 12,
+			"the fixed part of the data block commands must be scanned as a whole");
+
+	const char * const DATA_BLOCK_STREAM_NAMES[] = {"YM2612 PCM", "RF5C68 PCM", "RF5C164 PCM", "PWM PCM",
+			"OKIM6258 ADPCM", "HuC6280 PCM", "SCSP PCM", "NES APU DPCM", "Mikey PCM"};
+	const char * const DATA_BLOCK_COMPRESSED_NAMES[] = {"YM2612 PCM (compressed)", "RF5C68 PCM (compressed)",
+			"RF5C164 PCM (compressed)", "PWM PCM (compressed)", "OKIM6258 ADPCM (compressed)",
+			"HuC6280 PCM (compressed)", "SCSP PCM (compressed)", "NES APU DPCM (compressed)",
+			"Mikey PCM (compressed)"};
+	const char * const DATA_BLOCK_ROM_NAMES[] = {"SegaPCM ROM", "YM2608 DELTA-T ROM", "YM2610 ADPCM ROM",
+			"YM2610 DELTA-T ROM", "YMF278B ROM", "YMF271 ROM", "YMZ280B ROM", "YMF278B RAM", "Y8950 DELTA-T ROM",
+			"MultiPCM ROM", "uPD7759 ROM", "OKIM6295 ROM", "K054539 ROM", "C140 ROM", "K053260 ROM",
+			"Q-Sound ROM", "ES5505/ES5506 ROM", "X1-010 ROM", "C352 ROM", "GA20 ROM"};
+	const char * const DATA_BLOCK_RAM_NAMES[] = {"RF5C68 RAM", "RF5C164 RAM", "NES APU RAM"};
+	const char * const DATA_BLOCK_LARGE_RAM_NAMES[] = {"SCSP RAM", "ES5503 RAM"};
+
+	template<size_t n>
+	inline const char *nameAt(const char * const (&names)[n], const unsigned i)
+	{
+		return i < n ? names[i] : nullptr;
+	}
+}
+
+vgm::StreamHeader vgm::readStreamHeader(const unsigned char * const header, const size_t size,
+		const size_t dataOffset)
+{
+	auto value = [header, size](const size_t pos) -> uint32_t
+	{
+		return pos + 4 <= size ? UInt32<>::fromBytes<LE>(header + pos) : 0;
+	};
+
+	StreamHeader result;
+	result.dataOffset = dataOffset;
+	result.totalSamples = value(POS_TOTAL_SAMPLES);
+	const uint32_t loop = value(POS_LOOP);
+	result.loopOffset = loop == 0 ? 0 : POS_LOOP + loop;
+	result.loopSamples = value(POS_LOOP_SAMPLES);
+	return result;
+}
+
+const char *vgm::dataBlockTypeName(const unsigned type)
+{
+	if (type < 0x40) {
+		return nameAt(DATA_BLOCK_STREAM_NAMES, type);
+	} else if (type < 0x7f) {
+		return nameAt(DATA_BLOCK_COMPRESSED_NAMES, type - 0x40);
+	} else if (type == 0x7f) {
+		return "decompression table";
+	} else if (type < 0xc0) {
+		return nameAt(DATA_BLOCK_ROM_NAMES, type - 0x80);
+	} else if (type < 0xe0) {
+		return nameAt(DATA_BLOCK_RAM_NAMES, type - 0xc0);
+	} else {
+		return nameAt(DATA_BLOCK_LARGE_RAM_NAMES, type - 0xe0);
+	}
+}
+
+vgm::CommandScanner::CommandScanner(const StreamHeader &header)
+	: m_header(header), m_state(State::commands), m_pos(0), m_skip(0),
+	  m_loopPos(header.loopOffset < header.dataOffset ? SIZE_MAX : header.loopOffset - header.dataOffset),
+	  m_loopStart(0), m_carrySize(0), m_trailingSize(0)
+{
+	m_stats.totalSamples = 0;
+	m_stats.loopSamples = 0;
+	m_stats.loopFound = false;
+	fill(begin(m_stats.dataBlockBytes), end(m_stats.dataBlockBytes), 0);
+	if (header.loopOffset != 0 && m_loopPos == SIZE_MAX) {
+		error(SIZE_MAX, "the loop offset points before the VGM data");
+	}
+}
+
+void vgm::CommandScanner::error(const size_t offset, const char * const message)
+{
+	if (offset == SIZE_MAX) {
+		m_stats.errors.emplace_back(message);
+		return;
+	}
+	char buf[128];
+	std::snprintf(buf, sizeof(buf), "0x%zx: %s", m_header.dataOffset + offset, message);
+	m_stats.errors.emplace_back(buf);
+}
+
+inline void vgm::CommandScanner::command(const unsigned char * const p, const size_t offset)
+{
+	if (offset == m_loopPos) {
+		m_stats.loopFound = true;
+		m_loopStart = m_stats.totalSamples;
+	}
+	const unsigned op = p[0];
+	m_stats.totalSamples += COMMAND_WAITS[op];
+	switch (op) {
+	case CMD_WAIT:
+		m_stats.totalSamples += UInt16<>::fromBytes<LE>(p + 1);
+		break;
+	case CMD_END:
+		m_state = State::ended;
+		break;
+	case CMD_DATA_BLOCK:
+		if (p[1] != CMD_COMPATIBILITY) {
+			error(offset, "malformed data block");
+			m_state = State::broken;
+		} else {
+			// The most significant bit of the size of ROM and RAM dumps marks the second chip.
+			const uint32_t size = UInt32<>::fromBytes<LE>(p + 3) & 0x7fffffff;
+			m_stats.dataBlockBytes[p[2]] += size;
+			m_skip = size;
+		}
+		break;
+	case CMD_PCM_RAM_WRITE:
+		if (p[1] != CMD_COMPATIBILITY) {
+			error(offset, "malformed PCM RAM write");
+			m_state = State::broken;
+		}
+		break;
+	}
+}
+
+inline size_t vgm::CommandScanner::scanCommands(const unsigned char * const p, const size_t n)
+{
+	size_t i = 0;
+	while (i < n) {
+		const unsigned op = p[i];
+		const size_t length = COMMAND_LENGTHS[op];
+		if (length == 0) {
+			char message[32];
+			std::snprintf(message, sizeof(message), "unknown command 0x%02x", op);
+			error(m_pos + i, message);
+			m_state = State::broken;
+			return n;
+		}
+		if (length > n - i) {
+			break;
+		}
+		command(p + i, m_pos + i);
+		i += length;
+		if (m_state != State::commands) {
+			break;
+		}
+		if (m_skip != 0) {
+			const size_t skipped = static_cast<size_t>(min(m_skip, static_cast<uint64_t>(n - i)));
+			i += skipped;
+			m_skip -= skipped;
+		}
+	}
+	return i;
+}
+
+void vgm::CommandScanner::scan(const unsigned char *chunk, size_t size)
+{
+	while (size > 0) {
+		if (m_state != State::commands) {
+			if (m_state == State::ended) {
+				m_trailingSize += size;
+			}
+			m_pos += size;
+			return;
+		}
+		if (m_skip != 0) {
+			const size_t skipped = static_cast<size_t>(min(m_skip, static_cast<uint64_t>(size)));
+			chunk += skipped;
+			size -= skipped;
+			m_pos += skipped;
+			m_skip -= skipped;
+			continue;
+		}
+		if (m_carrySize != 0) {
+			// The command started in the previous chunk is completed first.
+			const size_t length = COMMAND_LENGTHS[m_carry[0]];
+			const size_t n = min(length - m_carrySize, size);
+			memcpy(m_carry + m_carrySize, chunk, n);
+			m_carrySize += n;
+			chunk += n;
+			size -= n;
+			if (m_carrySize < length) {
+				return;
+			}
+			command(m_carry, m_pos);
+			m_pos += length;
+			m_carrySize = 0;
+			continue;
+		}
+		const size_t consumed = scanCommands(chunk, size);
+		chunk += consumed;
+		size -= consumed;
+		m_pos += consumed;
+		if (size > 0 && m_state == State::commands && m_skip == 0) {
+			// Only an incomplete command can be left.
+			memcpy(m_carry, chunk, size);
+			m_carrySize = size;
+			return;
+		}
+	}
+}
+
+const vgm::CommandStats &vgm::CommandScanner::finish()
+{
+	if (m_state == State::commands) {
+		if (m_carrySize != 0) {
+			error(m_pos, "truncated command");
+		} else if (m_skip != 0) {
+			error(m_pos, "truncated data block");
+		}
+		error(m_pos + m_carrySize, "no end of sound data command");
+	} else if (m_state == State::ended && m_trailingSize != 0) {
+		char message[64];
+		std::snprintf(message, sizeof(message), "%zu octets after the end of sound data", m_trailingSize);
+		error(m_pos - m_trailingSize, message);
+	}
+	if (m_state == State::broken) {
+		// The number of samples is unknown.
+		return m_stats;
+	}
+
+	if (m_stats.totalSamples != m_header.totalSamples) {
+		char message[96];
+		std::snprintf(message, sizeof(message), "the stream has %llu samples but the header declares %u",
+				static_cast<unsigned long long>(m_stats.totalSamples), m_header.totalSamples);
+		error(SIZE_MAX, message);
+	}
+	if (m_stats.loopFound) {
+		m_stats.loopSamples = m_stats.totalSamples - m_loopStart;
+		if (m_stats.loopSamples != m_header.loopSamples) {
+			char message[96];
+			std::snprintf(message, sizeof(message), "the loop has %llu samples but the header declares %u",
+					static_cast<unsigned long long>(m_stats.loopSamples), m_header.loopSamples);
+			error(m_loopPos, message);
+		}
+	} else if (m_loopPos != SIZE_MAX) {
+		error(m_loopPos, "the loop offset does not point to a command");
+	}
+	return m_stats;
+}
@@ -0,0 +1,111 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_SCAN_H_
+#define VGM_SCAN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vgm
+{
+	// The values of the VGM header that describe the command stream.
+	struct StreamHeader
+	{
+		// The absolute offset of the VGM data.
+		std::size_t dataOffset;
+		// The number of samples of the whole stream.
+		uint32_t totalSamples;
+		// The absolute offset of the loop point, or 0 if the stream does not loop.
+		std::size_t loopOffset;
+		// The number of samples of the looped part of the stream.
+		uint32_t loopSamples;
+	};
+
+	/* Reads the stream values from the header as stored in the file (size octets, little-endian).
+	 * dataOffset is the absolute offset of the VGM data.
+	 */
+	StreamHeader readStreamHeader(const unsigned char *header, std::size_t size, std::size_t dataOffset);
+
+	struct CommandStats
+	{
+		// The number of samples (at 44100 Hz) that the wait commands of the stream add up to.
+		uint64_t totalSamples;
+		// The number of samples from the loop point to the end of the stream, if the loop point is found.
+		uint64_t loopSamples;
+		bool loopFound;
+		// The number of octets of the data blocks (command 0x67) by their type.
+		uint64_t dataBlockBytes[256];
+		// The structural errors of the stream and the mismatches with the header, in the order found.
+		std::vector<std::string> errors;
+	};
+
+	// Returns the name of the data block type (e.g. "YM2612 PCM"), or nullptr if the type is reserved.
+	const char *dataBlockTypeName(unsigned type);
+
+	/*
+	 * Scans the VGM command stream in a single forward pass. The data can be fed in chunks of any size,
+	 * so the stream does not have to be in memory at once. The length of each command is looked up in
+	 * a table by its opcode, and the data blocks are skipped without being looked into.
+	 *
+	 * Scanning stops at the first unknown command since the length of the commands after it is not known.
+	 */
+	class CommandScanner
+	{
+	public:
+		explicit CommandScanner(const StreamHeader &header);
+
+		// Scans the next chunk of the VGM data.
+		void scan(const unsigned char *chunk, std::size_t size);
+
+		// Completes scanning and checks the stream against the header.
+		const CommandStats &finish();
+	private:
+		enum class State
+		{
+			commands, ended, broken
+		};
+
+		// Processes the complete command at p (without the content of a data block) at the given offset.
+		void command(const unsigned char *p, std::size_t offset);
+		// Processes the complete commands of the chunk and returns the number of octets consumed.
+		std::size_t scanCommands(const unsigned char *p, std::size_t n);
+		// Records the error at the given offset of the VGM data, or not bound to an offset if it is SIZE_MAX.
+		void error(std::size_t offset, const char *message);
+
+		// The longest command that is not a data block has 12 octets.
+		static const std::size_t MAX_COMMAND_SIZE = 12;
+
+		const StreamHeader m_header;
+		CommandStats m_stats;
+		State m_state;
+		// The offset of the next octet to be scanned, relative to the start of the VGM data.
+		std::size_t m_pos;
+		// The number of data block octets still to be skipped.
+		uint64_t m_skip;
+		// The offset of the loop point relative to the start of the VGM data, or SIZE_MAX.
+		std::size_t m_loopPos;
+		uint64_t m_loopStart;
+		// The first octets of a command that continues in the next chunk.
+		unsigned char m_carry[MAX_COMMAND_SIZE];
+		std::size_t m_carrySize;
+		// The number of octets after the end of sound data command.
+		std::size_t m_trailingSize;
+	};
+}
+
+#endif // VGM_SCAN_H_
@@ -0,0 +1,231 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "search.h"
+#include "bulkparse.h"
+#include "tree.h"
+
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+using namespace vgm;
+
+namespace
+{
+	/* Simple case folding (as defined by CaseFolding.txt of Unicode) of the letters of the scripts that are used
+	 * in GD3 tags the most. The letters of the other blocks are left as is.
+	 */
+	inline char16_t foldCase(const char16_t c)
+	{
+		if (c < 0x80) { // ASCII
+			return c >= u'A' && c <= u'Z' ? c + 0x20 : c;
+		}
+		if (c >= 0xc0 && c <= 0xde && c != 0xd7) { // Latin-1 Supplement, except the multiplication sign
+			return c + 0x20;
+		}
+		if (c == 0xb5) { // micro sign
+			return 0x3bc;
+		}
+		// Latin Extended-A: upper case letters are at even positions (dotted I and dotless i have no simple folding)
+		if ((c >= 0x100 && c <= 0x12f) || (c >= 0x132 && c <= 0x137) || (c >= 0x14a && c <= 0x177)) {
+			return c | 1;
+		}
+		if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e)) { // ... or at odd positions
+			return (c & 1) != 0 ? c + 1 : c;
+		}
+		if (c == 0x178) { // Y with diaeresis
+			return 0xff;
+		}
+		if (c == 0x17f) { // long s
+			return u's';
+		}
+		if (c >= 0x391 && c <= 0x3ab && c != 0x3a2) { // Greek
+			return c + 0x20;
+		}
+		if (c == 0x3c2) { // final sigma
+			return 0x3c3;
+		}
+		if (c == 0x386) { // Greek with tonos
+			return 0x3ac;
+		}
+		if (c >= 0x388 && c <= 0x38a) {
+			return c + 0x25;
+		}
+		if (c == 0x38c) {
+			return 0x3cc;
+		}
+		if (c == 0x38e || c == 0x38f) {
+			return c + 0x3f;
+		}
+		if (c >= 0x410 && c <= 0x42f) { // Cyrillic
+			return c + 0x20;
+		}
+		if (c >= 0x400 && c <= 0x40f) {
+			return c + 0x50;
+		}
+		if (c >= 0xff21 && c <= 0xff3a) { // full-width Latin
+			return c + 0x20;
+		}
+		return c;
+	}
+
+	inline bool equalIgnoreCase(const char16_t c1, const char16_t c2)
+	{
+		return c1 == c2 || foldCase(c1) == foldCase(c2);
+	}
+
+	bool matches(const TagPredicate &predicate, const u16string &value)
+	{
+		const u16string &pattern = predicate.value;
+		if (predicate.type == TagPredicate::Type::exact) {
+			return predicate.ignoreCase ?
+					value.size() == pattern.size() && equal(value.begin(), value.end(), pattern.begin(), equalIgnoreCase) :
+					value == pattern;
+		}
+		return predicate.ignoreCase ?
+				search(value.begin(), value.end(), pattern.begin(), pattern.end(), equalIgnoreCase) != value.end() :
+				value.find(pattern) != u16string::npos;
+	}
+
+	// Parses exactly n decimal digits.
+	inline bool parseDigits(const char16_t *&p, const char16_t * const end, const size_t n, uint32_t &result)
+	{
+		if (static_cast<size_t>(end - p) < n) {
+			return false;
+		}
+		result = 0;
+		for (size_t i = 0; i < n; ++i, ++p) {
+			if (*p < u'0' || *p > u'9') {
+				return false;
+			}
+			result = result * 10 + (*p - u'0');
+		}
+		return true;
+	}
+
+	inline bool isDateSeparator(const char16_t c)
+	{
+		return c == u'/' || c == u'-' || c == u'.';
+	}
+
+	// A file being parsed. The tags are collected into the match it becomes if it matches the query.
+	struct ParsingFile
+	{
+		ParsingFile() : match(new SearchMatch()), handler(*match) {}
+
+		unique_ptr<SearchMatch> match;
+		TagInfoHandler handler;
+	};
+
+	struct Result
+	{
+		unique_ptr<SearchMatch> match;
+		string error;
+	};
+}
+
+bool vgm::parseDate(const char16_t * const value, const size_t size, uint32_t &from, uint32_t &to)
+{
+	const char16_t *p = value;
+	const char16_t * const end = value + size;
+	uint32_t year, month, day;
+	if (!parseDigits(p, end, 4, year)) {
+		return false;
+	}
+	if (p == end || !isDateSeparator(*p) || !parseDigits(++p, end, 2, month) || month < 1 || month > 12) {
+		from = year * 10000 + 101;
+		to = year * 10000 + 1231;
+		return true;
+	}
+	if (p == end || !isDateSeparator(*p) || !parseDigits(++p, end, 2, day) || day < 1 || day > 31) {
+		from = year * 10000 + month * 100 + 1;
+		to = year * 10000 + month * 100 + 31; // the days are only compared
+		return true;
+	}
+	from = to = year * 10000 + month * 100 + day;
+	return true;
+}
+
+bool vgm::matches(const SearchQuery &query, const u16string tags[])
+{
+	for (const TagPredicate &predicate : query.predicates) {
+		if (!::matches(predicate, tags[static_cast<size_t>(predicate.tag)])) {
+			return false;
+		}
+	}
+	if (query.hasDateRange) {
+		const u16string &date = tags[static_cast<size_t>(VGMFile::Tag::date)];
+		uint32_t from, to;
+		// A partial date matches if the period it denotes is within the range.
+		if (!parseDate(date.data(), date.size(), from, to) || from < query.dateFrom || to > query.dateTo) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t vgm::searchTree(const string &dir, const SearchQuery &query, const unsigned threadCount,
+		const function<void(const SearchMatch &match)> &onMatch,
+		const function<void(const string &path, const char *message)> &onError)
+{
+	vector<FileInfo> files;
+	findVGMFiles(dir, files);
+
+	vector<string> paths;
+	paths.reserve(files.size());
+	for (const FileInfo &file : files) {
+		paths.push_back(dir + '/' + file.path);
+	}
+
+	/*
+	 * Only the tags of the files being parsed are kept. The files that match are reported in the order of their paths,
+	 * each as soon as it and all the files before it are parsed. done() is called in this thread so no locking is needed.
+	 */
+	vector<unique_ptr<ParsingFile>> parsing(files.size());
+	vector<Result> results(files.size());
+	vector<bool> parsed(files.size(), false);
+	size_t reported = 0;
+	parseFiles(paths, threadCount, [&](const size_t i) -> ParseHandler &
+			{
+				// The VGM data is skipped since the handler does not want it.
+				parsing[i].reset(new ParsingFile());
+				return parsing[i]->handler;
+			},
+			[&](const size_t i, const char * const error)
+			{
+				const unique_ptr<ParsingFile> file(move(parsing[i]));
+				Result &result = results[i];
+				if (error != nullptr) {
+					result.error = error;
+				} else if (vgm::matches(query, file->match->tags)) {
+					file->match->path = files[i].path;
+					result.match = move(file->match);
+				}
+				parsed[i] = true;
+
+				for (; reported < files.size() && parsed[reported]; ++reported) {
+					Result &next = results[reported];
+					if (next.match != nullptr) {
+						onMatch(*next.match);
+						next.match.reset();
+					} else if (!next.error.empty()) {
+						onError(paths[reported], next.error.c_str());
+						string().swap(next.error);
+					}
+				}
+			});
+	return files.size();
+}
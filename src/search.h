@@ -0,0 +1,88 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_SEARCH_H_
+#define VGM_SEARCH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "parser.h"
+
+namespace vgm
+{
+	/*
+	 * A condition on a tag value. Values are compared as UTF-16 code units. If ignoreCase is true then
+	 * both values are compared after simple case folding of the Latin letters U+0000-U+017F, the full-width
+	 * Latin letters, the modern Greek letters (U+0386-U+03CE) and the Cyrillic letters U+0400-U+045F.
+	 * The other characters are compared as is.
+	 */
+	struct TagPredicate
+	{
+		enum class Type
+		{
+			exact, substring
+		};
+
+		VGMFile::Tag tag;
+		Type type;
+		bool ignoreCase;
+		std::u16string value;
+	};
+
+	/*
+	 * A search query. A file matches it if all the predicates are true for it and, if hasDateRange is true,
+	 * the date tag of the file is within [dateFrom, dateTo]. Dates are represented as yyyymmdd numbers.
+	 */
+	struct SearchQuery
+	{
+		SearchQuery() : hasDateRange(false), dateFrom(0), dateTo(0) {}
+
+		std::vector<TagPredicate> predicates;
+		bool hasDateRange;
+		uint32_t dateFrom;
+		uint32_t dateTo;
+	};
+
+	struct SearchMatch : public TagInfo
+	{
+		// The path relative to the directory searched.
+		std::string path;
+	};
+
+	/*
+	 * Parses the date in the form yyyy, yyyy/mm or yyyy/mm/dd ('-' and '.' are accepted as separators too)
+	 * that may be followed by other characters, and stores the first and the last day it denotes to from and to.
+	 * Returns false if the value does not start with a date.
+	 */
+	bool parseDate(const char16_t *value, std::size_t size, uint32_t &from, uint32_t &to);
+
+	bool matches(const SearchQuery &query, const std::u16string tags[]);
+
+	/*
+	 * Searches the VGM/VGZ files in the directory and its subdirectories for the ones that match the query,
+	 * using up to threadCount threads. Only the header and the GD3 info of each file are read (see parseFiles()).
+	 * onMatch is called for each matching file, and onError for each file that cannot be parsed, in the order of
+	 * their paths, as soon as the file and all the files before it are parsed. Returns the number of files searched. Throws afc::Exception if the directory cannot be read.
+	 */
+	std::size_t searchTree(const std::string &dir, const SearchQuery &query, const unsigned threadCount,
+			const std::function<void(const SearchMatch &match)> &onMatch,
+			const std::function<void(const std::string &path, const char *message)> &onError);
+}
+
+#endif // VGM_SEARCH_H_
@@ -0,0 +1,523 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "server.h"
+#include "parser.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <afc/cpu/primitive.h>
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+using namespace std::chrono;
+using vgm::RequestHandler;
+using vgm::TagInfo;
+using vgm::TagInfoHandler;
+
+namespace
+{
+	static const afc::endianness LE = afc::endianness::LE;
+
+	// The frames that are larger are rejected by closing the connection.
+	const size_t MAX_REQUEST_SIZE = 1024 * 1024;
+	const size_t MAX_RESPONSE_SIZE = 64 * 1024 * 1024;
+	// The connections that send no request for this long are closed.
+	const seconds IDLE_TIMEOUT(60);
+	const int IDLE_CHECK_INTERVAL_MS = 1000;
+	// The time a frame can take to be received or sent once it is started.
+	const time_t IO_TIMEOUT_SECONDS = 10;
+
+	inline bool readFully(const int fd, unsigned char *buf, size_t n)
+	{
+		while (n > 0) {
+			const ssize_t count = ::read(fd, buf, n);
+			if (count > 0) {
+				buf += count;
+				n -= static_cast<size_t>(count);
+			} else if (count == 0 || errno != EINTR) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// The peer closing the connection is reported as an error rather than by SIGPIPE.
+	inline bool writeFully(const int fd, const unsigned char *buf, size_t n)
+	{
+		while (n > 0) {
+			const ssize_t count = ::send(fd, buf, n, MSG_NOSIGNAL);
+			if (count >= 0) {
+				buf += count;
+				n -= static_cast<size_t>(count);
+			} else if (errno != EINTR) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Returns false if the connection is closed, or if the frame is larger than maxSize.
+	bool readFrame(const int fd, const size_t maxSize, string &payload)
+	{
+		unsigned char sizeBuf[4];
+		if (!readFully(fd, sizeBuf, 4)) {
+			return false;
+		}
+		const uint32_t size = UInt32<>::fromBytes<LE>(sizeBuf);
+		if (size > maxSize) {
+			return false;
+		}
+		payload.resize(size);
+		return size == 0 || readFully(fd, reinterpret_cast<unsigned char *>(&payload[0]), size);
+	}
+
+	// Writes the frame whose payload follows the first 4 octets of frame, which are reserved for its size.
+	inline bool writeFrame(const int fd, string &frame)
+	{
+		UInt32<>(static_cast<uint32_t>(frame.size() - 4)).toBytes<LE>(reinterpret_cast<unsigned char *>(&frame[0]));
+		return writeFully(fd, reinterpret_cast<const unsigned char *>(frame.data()), frame.size());
+	}
+
+	void socketAddress(const string &path, sockaddr_un &address)
+	{
+		if (path.size() >= sizeof(address.sun_path)) {
+			throw Exception("The socket path is too long"_s);
+		}
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	}
+
+	// Returns the descriptor of the connection, or -1 if there is no server listening at the address.
+	int connectTo(const sockaddr_un &address)
+	{
+		const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1) {
+			return -1;
+		}
+		int result;
+		do {
+			result = ::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address));
+		} while (result == -1 && errno == EINTR);
+		if (result == -1) {
+			::close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	/* The connections that have a request to serve, and those handed back by the workers once the request
+	 * is served so that the listening loop waits for the next request on them.
+	 */
+	class Connections
+	{
+	public:
+		explicit Connections(const int wakeFd) : m_wakeFd(wakeFd) {}
+
+		void push(const int fd)
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_ready.push_back(fd);
+			m_changed.notify_one();
+		}
+
+		// Returns false once the server is stopped.
+		bool pop(int &fd)
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_changed.wait(lock, [this]() { return !m_ready.empty() || m_stopped; });
+			if (m_stopped) {
+				return false;
+			}
+			fd = m_ready.front();
+			m_ready.pop_front();
+			m_busy.insert(fd);
+			return true;
+		}
+
+		// Hands the connection back to the listening loop, which is woken up through the wake descriptor.
+		void giveBack(const int fd)
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_busy.erase(fd);
+			if (m_stopped) {
+				::close(fd);
+				return;
+			}
+			m_idle.push_back(fd);
+			const uint64_t one = 1;
+			while (::write(m_wakeFd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+		}
+
+		void release(const int fd)
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_busy.erase(fd);
+			::close(fd);
+		}
+
+		// Moves the connections handed back since the last call to idle.
+		void takeIdle(vector<int> &idle)
+		{
+			lock_guard<mutex> lock(m_mutex);
+			idle.insert(idle.end(), m_idle.begin(), m_idle.end());
+			m_idle.clear();
+		}
+
+		/* Shuts the connections being served down so that the workers waiting for their requests are woken up,
+		 * and closes those waiting for a worker. The descriptors being served are closed by release() or
+		 * giveBack() only, so they cannot be reused meanwhile.
+		 */
+		void stop()
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_stopped = true;
+			for (const int fd : m_busy) {
+				::shutdown(fd, SHUT_RDWR);
+			}
+			for (const int fd : m_ready) {
+				::close(fd);
+			}
+			for (const int fd : m_idle) {
+				::close(fd);
+			}
+			m_ready.clear();
+			m_idle.clear();
+			m_changed.notify_all();
+		}
+	private:
+		const int m_wakeFd;
+		mutex m_mutex;
+		condition_variable m_changed;
+		list<int> m_ready;
+		vector<int> m_idle;
+		unordered_set<int> m_busy;
+		bool m_stopped = false;
+	};
+
+	// Tells if the peer of the connection runs as the effective user of the server, in case the socket is reachable anyway.
+	inline bool isServerUser(const int fd)
+	{
+		ucred credentials;
+		socklen_t size = sizeof(credentials);
+		return ::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 && credentials.uid == ::geteuid();
+	}
+
+	// Returns false if the connection is to be closed.
+	bool serveRequest(const int fd, const RequestHandler &handle)
+	{
+		string payload;
+		if (!readFrame(fd, MAX_REQUEST_SIZE, payload)) {
+			return false;
+		}
+		vector<string> request;
+		// The arguments are NUL-terminated, and there must be the name of the request at least.
+		bool ok = !payload.empty() && payload.back() == '\0';
+		for (size_t start = 0, n = payload.size(); ok && start < n;) {
+			const size_t end = payload.find('\0', start);
+			request.emplace_back(payload, start, end - start);
+			start = end + 1;
+		}
+		string response;
+		if (ok) {
+			ok = handle(request, response);
+		} else {
+			response = "Invalid request.";
+		}
+		string frame(4, '\0');
+		frame += static_cast<char>(ok ? 0 : 1);
+		frame += response;
+		return writeFrame(fd, frame);
+	}
+}
+
+shared_ptr<const TagInfo> vgm::TagInfoCache::get(const string &path)
+{
+	auto stampOf = [](const struct stat &fileStat)
+	{
+		return Stamp{static_cast<int64_t>(fileStat.st_mtim.tv_sec) * 1000000000 + fileStat.st_mtim.tv_nsec,
+				static_cast<uint64_t>(fileStat.st_size), static_cast<uint64_t>(fileStat.st_ino)};
+	};
+
+	struct stat fileStat;
+	if (::stat(path.c_str(), &fileStat) == 0) {
+		const Stamp stamp = stampOf(fileStat);
+		lock_guard<mutex> lock(m_mutex);
+		const auto entry = m_index.find(path);
+		if (entry != m_index.end() && entry->second->stamp == stamp) {
+			m_entries.splice(m_entries.begin(), m_entries, entry->second);
+			return entry->second->info;
+		}
+	}
+
+	// The stamp is taken from the descriptor parsed so that it matches the content even if the file is replaced.
+	const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		throw Exception("Unable to open file"_s);
+	}
+	shared_ptr<TagInfo> info(new TagInfo());
+	try {
+		if (::fstat(fd, &fileStat) != 0) {
+			throw Exception("Unable to read file"_s);
+		}
+		TagInfoHandler handler(*info);
+		parse(fd, handler);
+	}
+	catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+
+	lock_guard<mutex> lock(m_mutex);
+	const auto entry = m_index.find(path);
+	if (entry != m_index.end()) {
+		m_entries.erase(entry->second);
+		m_index.erase(entry);
+	}
+	m_entries.push_front(Entry{path, stampOf(fileStat), info});
+	m_index.emplace(path, m_entries.begin());
+	if (m_entries.size() > m_capacity) {
+		m_index.erase(m_entries.back().path);
+		m_entries.pop_back();
+	}
+	return info;
+}
+
+void vgm::TagInfoCache::erase(const string &path)
+{
+	lock_guard<mutex> lock(m_mutex);
+	const auto entry = m_index.find(path);
+	if (entry != m_index.end()) {
+		m_entries.erase(entry->second);
+		m_index.erase(entry);
+	}
+}
+
+void vgm::PathLocks::lock(const string &path)
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_unlocked.wait(lock, [&]() { return m_locked.count(path) == 0; });
+	m_locked.insert(path);
+}
+
+void vgm::PathLocks::unlock(const string &path)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_locked.erase(path);
+	m_unlocked.notify_all();
+}
+
+void vgm::serve(const string &socketPath, const unsigned threadCount, const RequestHandler &handle)
+{
+	sockaddr_un address;
+	socketAddress(socketPath, address);
+	const int listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFd == -1) {
+		throw Exception("Unable to create the socket"_s);
+	}
+	if (::bind(listenFd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1) {
+		bool bound = false;
+		if (errno == EADDRINUSE) {
+			const int probe = connectTo(address);
+			if (probe != -1) {
+				::close(probe);
+				::close(listenFd);
+				throw Exception("Another server is listening on the socket"_s);
+			}
+			// The socket file is left by a server that is not running any more.
+			bound = ::unlink(socketPath.c_str()) == 0 &&
+					::bind(listenFd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+		}
+		if (!bound) {
+			::close(listenFd);
+			throw Exception("Unable to bind the socket"_s);
+		}
+	}
+
+	// Only the user of the server can connect. The socket accepts no connections until listen() is called.
+	if (::chmod(socketPath.c_str(), S_IRUSR | S_IWUSR) == -1) {
+		::close(listenFd);
+		::unlink(socketPath.c_str());
+		throw Exception("Unable to set the permissions of the socket"_s);
+	}
+
+	/* The signals that stop the server are blocked before the workers are started so that they are blocked
+	 * in all threads, and are received through signalfd by the listening loop.
+	 */
+	sigset_t stopSignals, oldSignals;
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGINT);
+	sigaddset(&stopSignals, SIGTERM);
+	const int signalFd = ::signalfd(-1, &stopSignals, SFD_CLOEXEC);
+	if (signalFd == -1 || ::listen(listenFd, SOMAXCONN) == -1) {
+		if (signalFd != -1) {
+			::close(signalFd);
+		}
+		::close(listenFd);
+		::unlink(socketPath.c_str());
+		throw Exception("Unable to listen on the socket"_s);
+	}
+	const int wakeFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakeFd == -1) {
+		::close(signalFd);
+		::close(listenFd);
+		::unlink(socketPath.c_str());
+		throw Exception("Unable to listen on the socket"_s);
+	}
+	::pthread_sigmask(SIG_BLOCK, &stopSignals, &oldSignals);
+
+	Connections connections(wakeFd);
+	vector<thread> workers;
+	for (unsigned i = 0; i < threadCount; ++i) {
+		workers.emplace_back([&]()
+				{
+					int fd;
+					while (connections.pop(fd)) {
+						if (serveRequest(fd, handle)) {
+							connections.giveBack(fd);
+						} else {
+							connections.release(fd);
+						}
+					}
+				});
+	}
+
+	/* The connections waiting for their next request are polled here, so a worker is only taken by a request
+	 * that has arrived. The first entries of fds are the listening socket, the signals and the wake descriptor;
+	 * idleSince[i] is the time since when the connection fds[FIXED_FD_COUNT + i] has been idle.
+	 */
+	const size_t FIXED_FD_COUNT = 3;
+	vector<pollfd> fds = {{listenFd, POLLIN, 0}, {signalFd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+	vector<steady_clock::time_point> idleSince;
+	vector<int> handedBack;
+	for (;;) {
+		const int pollResult = ::poll(fds.data(), fds.size(), idleSince.empty() ? -1 : IDLE_CHECK_INTERVAL_MS);
+		if (pollResult == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents != 0) {
+			// The signal is consumed so that it is not delivered once it is unblocked.
+			signalfd_siginfo signal;
+			while (::read(signalFd, &signal, sizeof(signal)) == -1 && errno == EINTR) {}
+			break;
+		}
+
+		const steady_clock::time_point now = steady_clock::now();
+		// The ready and expired connections are removed by moving the last entry to their place.
+		for (size_t i = FIXED_FD_COUNT; i < fds.size();) {
+			const size_t j = i - FIXED_FD_COUNT;
+			const bool ready = fds[i].revents != 0;
+			if (ready || now - idleSince[j] >= IDLE_TIMEOUT) {
+				if (ready) {
+					connections.push(fds[i].fd);
+				} else {
+					::close(fds[i].fd);
+				}
+				fds[i] = fds.back();
+				fds.pop_back();
+				idleSince[j] = idleSince.back();
+				idleSince.pop_back();
+			} else {
+				++i;
+			}
+		}
+		if (fds[2].revents != 0) {
+			uint64_t count;
+			while (::read(wakeFd, &count, sizeof(count)) == -1 && errno == EINTR) {}
+			connections.takeIdle(handedBack);
+			for (const int fd : handedBack) {
+				fds.push_back(pollfd{fd, POLLIN, 0});
+				idleSince.push_back(now);
+			}
+			handedBack.clear();
+		}
+		if ((fds[0].revents & POLLIN) != 0) {
+			const int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd != -1 && !isServerUser(fd)) {
+				::close(fd);
+			} else if (fd != -1) {
+				// A client that stalls in the middle of a frame does not hold a worker for long.
+				const timeval timeout = {IO_TIMEOUT_SECONDS, 0};
+				::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+				fds.push_back(pollfd{fd, POLLIN, 0});
+				idleSince.push_back(now);
+			}
+		}
+	}
+
+	connections.stop();
+	for (thread &worker : workers) {
+		worker.join();
+	}
+	for (size_t i = FIXED_FD_COUNT; i < fds.size(); ++i) {
+		::close(fds[i].fd);
+	}
+	::close(wakeFd);
+	::close(signalFd);
+	::close(listenFd);
+	::unlink(socketPath.c_str());
+	::pthread_sigmask(SIG_SETMASK, &oldSignals, nullptr);
+}
+
+bool vgm::sendRequest(const string &socketPath, const vector<string> &request, string &response)
+{
+	string frame(4, '\0');
+	for (const string &arg : request) {
+		frame += arg;
+		frame += '\0';
+	}
+	if (frame.size() - 4 > MAX_REQUEST_SIZE) {
+		throw Exception("The request is too large"_s);
+	}
+
+	sockaddr_un address;
+	socketAddress(socketPath, address);
+	const int fd = connectTo(address);
+	if (fd == -1) {
+		throw Exception("Unable to connect to the server"_s);
+	}
+	string payload;
+	const bool received = writeFrame(fd, frame) && readFrame(fd, MAX_RESPONSE_SIZE, payload) && !payload.empty();
+	::close(fd);
+	if (!received) {
+		throw Exception("The connection to the server is lost"_s);
+	}
+	response.assign(payload, 1, string::npos);
+	return payload[0] == 0;
+}
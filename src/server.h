@@ -0,0 +1,129 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_SERVER_H_
+#define VGM_SERVER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "parser.h"
+
+namespace vgm
+{
+	/*
+	 * A cache of the tag info of the files parsed recently, keyed by path. An entry is used only while the
+	 * modification time, the size and the inode of the file are those it was parsed at; the least recently used
+	 * entries are evicted once there are capacity entries. Thread-safe.
+	 */
+	class TagInfoCache
+	{
+	public:
+		explicit TagInfoCache(const std::size_t capacity) : m_capacity(capacity) {}
+
+		/* Returns the tag info of the file, parsing it (only the header and the GD3 info are read) if there
+		 * is no up-to-date entry. Throws afc::Exception if the file cannot be parsed.
+		 */
+		std::shared_ptr<const TagInfo> get(const std::string &path);
+
+		void erase(const std::string &path);
+	private:
+		struct Stamp
+		{
+			int64_t mtime;
+			uint64_t size;
+			uint64_t inode;
+
+			bool operator==(const Stamp &o) const { return mtime == o.mtime && size == o.size && inode == o.inode; }
+		};
+
+		struct Entry
+		{
+			std::string path;
+			Stamp stamp;
+			std::shared_ptr<const TagInfo> info;
+		};
+
+		const std::size_t m_capacity;
+		std::mutex m_mutex;
+		// The most recently used entry is the first one.
+		std::list<Entry> m_entries;
+		std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+	};
+
+	// Serialises the access to files by path. Thread-safe.
+	class PathLocks
+	{
+	public:
+		// Holds the lock of a path while it exists.
+		class Guard
+		{
+		public:
+			Guard(PathLocks &locks, const std::string &path) : m_locks(locks), m_path(path) { locks.lock(path); }
+			~Guard() { m_locks.unlock(m_path); }
+		private:
+			Guard(const Guard &) = delete;
+			Guard &operator=(const Guard &) = delete;
+
+			PathLocks &m_locks;
+			const std::string m_path;
+		};
+
+		void lock(const std::string &path);
+		void unlock(const std::string &path);
+	private:
+		std::mutex m_mutex;
+		std::condition_variable m_unlocked;
+		std::unordered_set<std::string> m_locked;
+	};
+
+	/* Handles a request given as a list of arguments. Stores the output of the request, or the error message,
+	 * to response and returns true if the request succeeded. Must not throw exceptions.
+	 */
+	using RequestHandler = std::function<bool(const std::vector<std::string> &request, std::string &response)>;
+
+	/*
+	 * Listens on the Unix domain socket at socketPath and serves the requests of the connections accepted with
+	 * threadCount worker threads. A client sends any number of requests over a connection and receives
+	 * the response to each before sending the next one. The idle connections are polled by the listening thread,
+	 * and a worker is taken for each request that arrives, so idle clients hold no worker. A connection is
+	 * closed if it sends no request for a minute, or if a frame takes more than 10 seconds to receive or send.
+	 * Frames are:
+	 * - request: the size of the payload (4 octets, little-endian) followed by the arguments, each terminated
+	 *   by a NUL character;
+	 * - response: the size of the payload (4 octets, little-endian) followed by the status (0 if the request
+	 *   succeeded, 1 otherwise) and the response text.
+	 * The socket file is accessible to the user of the server only, and the connections of the processes of
+	 * other users are closed. A stale socket file left by a server that is not running is replaced. Returns once SIGINT or SIGTERM is
+	 * received, removing the socket file. Throws afc::Exception if the socket cannot be set up.
+	 */
+	void serve(const std::string &socketPath, const unsigned threadCount, const RequestHandler &handle);
+
+	/* Sends the request to the server listening at socketPath and stores the response text to response.
+	 * Returns the status of the response. Throws afc::Exception if the server cannot be reached.
+	 */
+	bool sendRequest(const std::string &socketPath, const std::vector<std::string> &request, std::string &response);
+}
+
+#endif // VGM_SERVER_H_
@@ -0,0 +1,86 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "stats.h"
+
+#include <ctime>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+	thread_local uint64_t allocationCount = 0;
+
+	const char * const PHASE_NAMES[] = {"open", "header", "skip", "data", "gd3", "tags", "close", "info", "scan",
+			"encode", "write", "commit"};
+
+	static_assert(sizeof(PHASE_NAMES) / sizeof(PHASE_NAMES[0]) == vgm::PHASE_COUNT, "a phase has no name");
+
+	inline double threadCPUSeconds()
+	{
+		struct timespec time;
+		if (::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) {
+			return 0;
+		}
+		return time.tv_sec + time.tv_nsec / 1e9;
+	}
+}
+
+const char *vgm::phaseName(const Phase phase)
+{
+	return PHASE_NAMES[static_cast<size_t>(phase)];
+}
+
+void vgm::Stats::merge(const Stats &other)
+{
+	fileCount += other.fileCount;
+	for (size_t i = 0; i < PHASE_COUNT; ++i) {
+		PhaseStats &dest = phases[i];
+		const PhaseStats &src = other.phases[i];
+		dest.calls += src.calls;
+		dest.wallSeconds += src.wallSeconds;
+		dest.cpuSeconds += src.cpuSeconds;
+		dest.bytesIn += src.bytesIn;
+		dest.bytesOut += src.bytesOut;
+		dest.allocations += src.allocations;
+	}
+}
+
+uint64_t &vgm::threadAllocationCount()
+{
+	return allocationCount;
+}
+
+vgm::PhaseTimer::PhaseTimer(Stats * const stats, const Phase phase)
+	: m_phase(stats == nullptr ? nullptr : &stats->phases[static_cast<size_t>(phase)]), m_cpuStart(0),
+	  m_allocationStart(0)
+{
+	if (m_phase != nullptr) {
+		m_wallStart = steady_clock::now();
+		m_cpuStart = threadCPUSeconds();
+		m_allocationStart = allocationCount;
+	}
+}
+
+vgm::PhaseTimer::~PhaseTimer()
+{
+	if (m_phase != nullptr) {
+		++m_phase->calls;
+		m_phase->wallSeconds += duration_cast<duration<double>>(steady_clock::now() - m_wallStart).count();
+		m_phase->cpuSeconds += threadCPUSeconds() - m_cpuStart;
+		m_phase->allocations += allocationCount - m_allocationStart;
+	}
+}
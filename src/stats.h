@@ -0,0 +1,106 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_STATS_H_
+#define VGM_STATS_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace vgm
+{
+	// The phases of loading, inspecting and saving VGM/VGZ files that are measured.
+	enum class Phase
+	{
+		// Opening the source file and detecting its format.
+		open,
+		header,
+		// Moving to the next section of the source file (decompressing the octets skipped, for VGZ files).
+		skip,
+		data,
+		// Reading the GD3 info block.
+		gd3,
+		// Splitting the tag block of the GD3 info, and decoding the tags on access.
+		tags,
+		close,
+		// Converting the tags for display.
+		info,
+		// Scanning the VGM command stream.
+		scan,
+		// Encoding the header and the GD3 info to be saved.
+		encode,
+		// Writing (and compressing) the content to be saved.
+		write,
+		// Flushing, closing and renaming the file saved.
+		commit
+	};
+
+	const std::size_t PHASE_COUNT = static_cast<std::size_t>(Phase::commit) + 1;
+
+	// Returns the name of the phase, e.g. "gd3".
+	const char *phaseName(Phase phase);
+
+	struct PhaseStats
+	{
+		uint64_t calls;
+		double wallSeconds;
+		// The CPU time of the thread that runs the phase; helper threads (e.g. of parallel compression) are not counted.
+		double cpuSeconds;
+		uint64_t bytesIn;
+		uint64_t bytesOut;
+		uint64_t allocations;
+	};
+
+	/*
+	 * The per-phase counters of loading and saving files. A Stats object is not thread-safe: each thread
+	 * collects into its own one, and they are merged afterwards.
+	 */
+	struct Stats
+	{
+		Stats() : fileCount(0), phases() {}
+
+		void merge(const Stats &other);
+
+		uint64_t fileCount;
+		PhaseStats phases[PHASE_COUNT];
+	};
+
+	/* The number of memory allocations made by the calling thread. The library does not count allocations
+	 * itself: a program that wants them in Stats increments this counter in its replacement of operator new.
+	 */
+	uint64_t &threadAllocationCount();
+
+	// Measures a phase from its construction to its destruction. If stats is null then nothing is measured.
+	class PhaseTimer
+	{
+	public:
+		PhaseTimer(Stats *stats, Phase phase);
+		~PhaseTimer();
+
+		void addBytesIn(const uint64_t n) { if (m_phase != nullptr) m_phase->bytesIn += n; }
+		void addBytesOut(const uint64_t n) { if (m_phase != nullptr) m_phase->bytesOut += n; }
+	private:
+		PhaseTimer(const PhaseTimer &) = delete;
+		PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+		PhaseStats * const m_phase;
+		std::chrono::steady_clock::time_point m_wallStart;
+		double m_cpuStart;
+		uint64_t m_allocationStart;
+	};
+}
+
+#endif // VGM_STATS_H_
@@ -0,0 +1,466 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "transcode.h"
+
+#include "parser.h"
+#include "tree.h"
+#include "writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <afc/cpu/primitive.h>
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+using vgm::FileInfo;
+using vgm::Span;
+using vgm::VGMFile;
+
+const size_t vgm::TranscodeSettings::DEFAULT_MEMORY_BUDGET;
+
+namespace
+{
+	static const afc::endianness LE = afc::endianness::LE;
+
+	// The number of files per thread of the consuming stage that can wait in a queue between two stages.
+	const size_t QUEUE_CAPACITY_PER_THREAD = 2;
+
+	// A file that goes through the pipeline.
+	struct Job
+	{
+		// The path relative to the source directory.
+		const string *path;
+		// The path relative to the destination directory.
+		string destPath;
+		// The number of octets of the memory budget held by the job.
+		size_t charge;
+		size_t sourceSize;
+		// The file as it is read.
+		vector<unsigned char> source;
+		// The uncompressed content of the file.
+		vector<unsigned char> content;
+		// The normalised header and GD3 info, and the spans of the file to write (if it is not compressed).
+		unique_ptr<unsigned char[]> headerAndGD3;
+		vector<Span> spans;
+		vector<unsigned char> compressed;
+		// If not empty then the job has failed and it is only passed on to be reported.
+		string error;
+	};
+
+	using JobPtr = unique_ptr<Job>;
+
+	/* Limits the number of octets the jobs hold in memory. A job that needs more than the whole budget
+	 * is admitted when no other job holds memory, so that any file can be processed.
+	 */
+	class MemoryBudget
+	{
+	public:
+		explicit MemoryBudget(const size_t limit) : m_limit(limit), m_used(0) {}
+
+		void acquire(Job &job, const size_t n)
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_released.wait(lock, [&]() { return m_used == 0 || m_used + n <= m_limit; });
+			m_used += n;
+			job.charge = n;
+		}
+
+		/* Charges the job for n more octets without waiting, since the job may already hold memory that
+		 * the jobs it would wait for need. The jobs admitted afterwards wait for the memory instead.
+		 */
+		void charge(Job &job, const size_t n)
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_used += n;
+			job.charge += n;
+		}
+
+		// Releases the memory of the job beyond the given number of octets it still needs.
+		void shrink(Job &job, const size_t required)
+		{
+			if (job.charge <= required) {
+				return;
+			}
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_used -= job.charge - required;
+			}
+			job.charge = required;
+			m_released.notify_all();
+		}
+	private:
+		const size_t m_limit;
+		size_t m_used;
+		mutex m_mutex;
+		condition_variable m_released;
+	};
+
+	/* A bounded FIFO queue of jobs between two stages. The queue is closed when all its producers are done,
+	 * and pop() returns false once a closed queue is empty.
+	 */
+	class JobQueue
+	{
+	public:
+		JobQueue(const size_t capacity, const unsigned producerCount) : m_capacity(capacity),
+				m_producerCount(producerCount) {}
+
+		void push(JobPtr job)
+		{
+			{
+				unique_lock<mutex> lock(m_mutex);
+				m_notFull.wait(lock, [&]() { return m_jobs.size() < m_capacity; });
+				m_jobs.push_back(move(job));
+			}
+			m_notEmpty.notify_one();
+		}
+
+		bool pop(JobPtr &job)
+		{
+			{
+				unique_lock<mutex> lock(m_mutex);
+				m_notEmpty.wait(lock, [&]() { return !m_jobs.empty() || m_producerCount == 0; });
+				if (m_jobs.empty()) {
+					return false;
+				}
+				job = move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+			m_notFull.notify_one();
+			return true;
+		}
+
+		void producerDone()
+		{
+			{
+				lock_guard<mutex> lock(m_mutex);
+				--m_producerCount;
+			}
+			m_notEmpty.notify_all();
+		}
+	private:
+		const size_t m_capacity;
+		unsigned m_producerCount;
+		deque<JobPtr> m_jobs;
+		mutex m_mutex;
+		condition_variable m_notEmpty, m_notFull;
+	};
+
+	inline void fail(Job &job, const char * const message, MemoryBudget &budget)
+	{
+		job.error = message;
+		vector<unsigned char>().swap(job.source);
+		vector<unsigned char>().swap(job.content);
+		vector<unsigned char>().swap(job.compressed);
+		job.headerAndGD3.reset();
+		job.spans.clear();
+		budget.shrink(job, 0);
+	}
+
+	/* Passes the jobs from one queue to another through process(job) in each of threadCount threads.
+	 * Failed jobs are passed on as they are.
+	 */
+	void runStage(JobQueue &in, JobQueue &out, const unsigned threadCount, MemoryBudget &budget,
+			const function<void(Job &job)> &process, vector<thread> &threads)
+	{
+		for (unsigned i = 0; i < threadCount; ++i) {
+			threads.emplace_back([&in, &out, &budget, process]()
+					{
+						for (JobPtr job; in.pop(job);) {
+							if (job->error.empty()) {
+								try {
+									process(*job);
+								}
+								catch (Exception &ex) {
+									fail(*job, ex.what(), budget);
+								}
+								catch (std::exception &ex) {
+									fail(*job, ex.what(), budget);
+								}
+							}
+							out.push(move(job));
+						}
+						out.producerDone();
+					});
+		}
+	}
+
+	inline void readAll(const int fd, unsigned char *buf, size_t n)
+	{
+		while (n > 0) {
+			const ssize_t count = ::read(fd, buf, n);
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			if (count <= 0) {
+				throw Exception("Unable to read file"_s);
+			}
+			buf += count;
+			n -= count;
+		}
+	}
+
+	inline bool isGZip(const unsigned char * const buf, const size_t size)
+	{
+		return size >= 2 && buf[0] == 0x1f && buf[1] == 0x8b;
+	}
+
+	/* Reads the file into job.source once the memory it needs is available. The memory needed is estimated
+	 * from the size of the file and, for VGZ files, from the uncompressed size stored in the gzip trailer.
+	 */
+	void readSource(const string &path, Job &job, const VGMFile::Format destFormat, MemoryBudget &budget)
+	{
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			throw Exception("Unable to open file"_s);
+		}
+		try {
+			struct stat fileStat;
+			if (::fstat(fd, &fileStat) != 0) {
+				throw Exception("Unable to read file"_s);
+			}
+			const size_t size = fileStat.st_size;
+			unsigned char magic[2], trailer[4];
+			const bool compressed = ::pread(fd, magic, 2, 0) == 2 && isGZip(magic, 2);
+			size_t contentSize = size;
+			if (compressed && size >= 4 && ::pread(fd, trailer, 4, size - 4) == 4) {
+				contentSize = vgm::inflatedSizeHint(size, UInt32<>::fromBytes<LE>(trailer));
+			}
+			budget.acquire(job, size + (compressed ? contentSize : 0) +
+					(destFormat == VGMFile::Format::vgz ? contentSize : 0));
+			job.source.resize(size);
+			readAll(fd, job.source.data(), size);
+			job.sourceSize = size;
+		}
+		catch (...) {
+			::close(fd);
+			throw;
+		}
+		::close(fd);
+	}
+
+	// Collects the constituents of the file and the spans of its VGM data, which point into the content parsed.
+	class Normaliser : public vgm::ParseHandler
+	{
+	public:
+		void header(const unsigned char * const header, const size_t size) override
+		{
+			m_writer.reset(new vgm::VGMWriter(header, size));
+		}
+
+		void tag(const VGMFile::Tag tag, const char16_t * const value, const size_t size) override
+		{
+			m_writer->setTag(tag, value, size);
+		}
+
+		bool wantsData() const override { return true; }
+
+		void data(const unsigned char * const chunk, const size_t size) override
+		{
+			m_data.push_back(Span{chunk, size});
+			m_dataSize += size;
+		}
+
+		// Encodes the normalised header and GD3 info, and lays out the spans of the file to write.
+		void finish(Job &job)
+		{
+			const size_t hdrSize = m_writer->headerSize();
+			const size_t gd3Size = m_writer->gd3InfoSize();
+			job.headerAndGD3.reset(new unsigned char[hdrSize + gd3Size]);
+			m_writer->encodeHeader(m_dataSize, job.headerAndGD3.get());
+			m_writer->encodeGD3Info(job.headerAndGD3.get() + hdrSize);
+			job.spans.clear();
+			job.spans.reserve(m_data.size() + 2);
+			job.spans.push_back(Span{job.headerAndGD3.get(), hdrSize});
+			job.spans.insert(job.spans.end(), m_data.begin(), m_data.end());
+			job.spans.push_back(Span{job.headerAndGD3.get() + hdrSize, gd3Size});
+		}
+	private:
+		unique_ptr<vgm::VGMWriter> m_writer;
+		vector<Span> m_data;
+		size_t m_dataSize = 0;
+	};
+
+	inline string destinationPath(const string &path, const VGMFile::Format format)
+	{
+		// Both the extensions are of the same length.
+		return path.substr(0, path.size() - 4) + (format == VGMFile::Format::vgz ? ".vgz" : ".vgm");
+	}
+
+	// Creates the directory dir/relDir and its missing parents within dir. The directories created are remembered.
+	void makeDirectories(const string &dir, const string &relDir, unordered_set<string> &created)
+	{
+		if (relDir.empty() || created.count(relDir) != 0) {
+			return;
+		}
+		const size_t slash = relDir.rfind('/');
+		if (slash != string::npos) {
+			makeDirectories(dir, relDir.substr(0, slash), created);
+		}
+		if (::mkdir((dir + '/' + relDir).c_str(), 0777) != 0 && errno != EEXIST) {
+			throw Exception("Unable to create directory"_s);
+		}
+		created.insert(relDir);
+	}
+
+	void writeDestination(const string &destDir, Job &job, const vgm::TranscodeSettings &settings,
+			unordered_set<string> &createdDirs, uint64_t &bytesWritten)
+	{
+		const size_t slash = job.destPath.rfind('/');
+		makeDirectories(destDir, slash == string::npos ? string() : job.destPath.substr(0, slash), createdDirs);
+
+		vgm::AtomicFile file((destDir + '/' + job.destPath).c_str());
+		if (settings.format == VGMFile::Format::vgz) {
+			vgm::writeAll(file.fd(), job.compressed.data(), job.compressed.size());
+			bytesWritten += job.compressed.size();
+		} else {
+			vector<struct iovec> iov;
+			iov.reserve(job.spans.size());
+			for (const Span &span : job.spans) {
+				iov.push_back(iovec{const_cast<unsigned char *>(span.data), span.size});
+				bytesWritten += span.size;
+			}
+			vgm::writeAllV(file.fd(), iov.data(), iov.size());
+		}
+		file.commit(settings.sync);
+	}
+}
+
+vgm::TranscodeResult vgm::transcodeTree(const string &srcDir, const string &destDir,
+		const TranscodeSettings &settings, const function<void(const string &path, const char *message)> &onError)
+{
+	vector<FileInfo> files;
+	findVGMFiles(srcDir, files);
+	if (::mkdir(destDir.c_str(), 0777) != 0 && errno != EEXIST) {
+		throw Exception("Unable to create directory"_s);
+	}
+
+	TranscodeResult result = {files.size(), 0, 0, 0};
+	const unsigned threadCount = max(settings.threadCount, 1u);
+	const VGMFile::Format format = settings.format;
+	GZipSettings gzipSettings(settings.gzipSettings);
+	gzipSettings.threadCount = 1;
+	gzipSettings.stats = nullptr;
+
+	MemoryBudget budget(settings.memoryBudget);
+	JobQueue toInflate(threadCount * QUEUE_CAPACITY_PER_THREAD, 1);
+	JobQueue toNormalise(QUEUE_CAPACITY_PER_THREAD, threadCount);
+	JobQueue toDeflate(threadCount * QUEUE_CAPACITY_PER_THREAD, 1);
+	JobQueue toWrite(QUEUE_CAPACITY_PER_THREAD, threadCount);
+	vector<thread> threads;
+
+	threads.emplace_back([&]()
+			{
+				// Different source files (e.g. a.vgm and a.vgz) can be converted to the same destination file.
+				unordered_set<string> destPaths;
+				for (const FileInfo &file : files) {
+					JobPtr job(new Job());
+					job->path = &file.path;
+					job->destPath = destinationPath(file.path, format);
+					job->charge = 0;
+					job->sourceSize = 0;
+					if (!destPaths.insert(job->destPath).second) {
+						job->error = "Another file is converted to the same destination file";
+					} else {
+						try {
+							readSource(srcDir + '/' + file.path, *job, format, budget);
+						}
+						catch (Exception &ex) {
+							fail(*job, ex.what(), budget);
+						}
+						catch (std::exception &ex) {
+							fail(*job, ex.what(), budget);
+						}
+					}
+					toInflate.push(move(job));
+				}
+				toInflate.producerDone();
+			});
+
+	runStage(toInflate, toNormalise, threadCount, budget, [&](Job &job)
+			{
+				if (isGZip(job.source.data(), job.source.size())) {
+					// The content may turn out larger than the estimate the job was admitted with.
+					inflateGZip(job.source.data(), job.source.size(), job.content,
+							[&](const size_t n) { budget.charge(job, n); });
+					vector<unsigned char>().swap(job.source);
+				} else {
+					job.content.swap(job.source);
+				}
+				const size_t size = job.content.size();
+				budget.shrink(job, format == VGMFile::Format::vgz ? 2 * size : size);
+			}, threads);
+
+	runStage(toNormalise, toDeflate, 1, budget, [](Job &job)
+			{
+				Normaliser normaliser;
+				parse(job.content.data(), job.content.size(), normaliser);
+				normaliser.finish(job);
+			}, threads);
+
+	runStage(toDeflate, toWrite, threadCount, budget, [&](Job &job)
+			{
+				if (format != VGMFile::Format::vgz) {
+					return;
+				}
+				deflateGZip(job.spans.data(), job.spans.size(), gzipSettings, job.compressed);
+				job.spans.clear();
+				job.headerAndGD3.reset();
+				vector<unsigned char>().swap(job.content);
+				budget.shrink(job, job.compressed.size());
+			}, threads);
+
+	unordered_set<string> createdDirs;
+	for (JobPtr job; toWrite.pop(job);) {
+		if (job->error.empty()) {
+			try {
+				writeDestination(destDir, *job, settings, createdDirs, result.bytesWritten);
+			}
+			catch (Exception &ex) {
+				job->error = ex.what();
+			}
+			catch (std::exception &ex) {
+				job->error = ex.what();
+			}
+		}
+		result.bytesRead += job->sourceSize;
+		if (!job->error.empty()) {
+			++result.failedCount;
+			onError(srcDir + '/' + *job->path, job->error.c_str());
+		}
+		budget.shrink(*job, 0);
+	}
+
+	for (thread &t : threads) {
+		t.join();
+	}
+	return result;
+}
@@ -0,0 +1,81 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_TRANSCODE_H_
+#define VGM_TRANSCODE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "fileio.h"
+#include "gzip.h"
+#include "vgm.h"
+
+namespace vgm
+{
+	struct TranscodeSettings
+	{
+		TranscodeSettings() : format(VGMFile::Format::vgz), threadCount(1), memoryBudget(DEFAULT_MEMORY_BUDGET),
+				sync(SyncMode::none) {}
+
+		static const std::size_t DEFAULT_MEMORY_BUDGET = 256 * 1024 * 1024;
+
+		// The format of the files written.
+		VGMFile::Format format;
+		// The compression settings of VGZ output. Each file is compressed in a single thread.
+		GZipSettings gzipSettings;
+		// The number of threads of each of the inflate and deflate stages.
+		unsigned threadCount;
+		/* The maximal number of octets of file content that are held in memory by all the stages at once.
+		 * A file that does not fit into the budget on its own is processed when no other file is in memory.
+		 */
+		std::size_t memoryBudget;
+		SyncMode sync;
+	};
+
+	struct TranscodeResult
+	{
+		// The number of files found in the source tree.
+		std::size_t fileCount;
+		// The number of files that could not be converted or written.
+		std::size_t failedCount;
+		uint64_t bytesRead;
+		uint64_t bytesWritten;
+	};
+
+	/*
+	 * Converts each VGM/VGZ file in the directory srcDir and its subdirectories into the file with the same path
+	 * relative to destDir, the extension replaced with that of the format given (.vgm or .vgz). Subdirectories
+	 * of destDir are created as needed, and the files written replace the existing ones atomically. The files
+	 * written have the normalised layout header -> data -> gd3 -> eof, as VGMFile::save() writes them.
+	 *
+	 * The files go through a pipeline of stages that run concurrently and are connected by bounded queues:
+	 * reading (one thread), decompressing VGZ files (settings.threadCount threads), normalising the header and
+	 * the GD3 info (one thread), compressing to VGZ (settings.threadCount threads) and writing (the calling
+	 * thread). Thus the disk and the CPU are kept busy at the same time, and memory consumption is bounded by
+	 * settings.memoryBudget rather than by the number of files in flight.
+	 *
+	 * The errors are reported with onError(path, message) in the calling thread, in the order the files leave
+	 * the pipeline. Throws afc::Exception if the source directory cannot be read or the destination directory
+	 * cannot be created.
+	 */
+	TranscodeResult transcodeTree(const std::string &srcDir, const std::string &destDir,
+			const TranscodeSettings &settings,
+			const std::function<void(const std::string &path, const char *message)> &onError);
+}
+
+#endif // VGM_TRANSCODE_H_
@@ -0,0 +1,81 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "tree.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+using vgm::FileInfo;
+
+namespace
+{
+	inline bool isVGMFileName(const char * const name)
+	{
+		const size_t size = strlen(name);
+		return size > 4 && (strcasecmp(name + size - 4, ".vgm") == 0 || strcasecmp(name + size - 4, ".vgz") == 0);
+	}
+
+	void walk(const string &root, const string &relDir, vector<FileInfo> &files)
+	{
+		const string dirPath = relDir.empty() ? root : root + '/' + relDir;
+		DIR * const dir = ::opendir(dirPath.c_str());
+		if (dir == nullptr) {
+			throw Exception("Unable to read directory"_s);
+		}
+		const int dirFd = ::dirfd(dir);
+		vector<string> subdirs;
+		for (const struct dirent *entry; (entry = ::readdir(dir)) != nullptr;) {
+			const char * const name = entry->d_name;
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+				continue;
+			}
+			struct stat fileStat;
+			if (::fstatat(dirFd, name, &fileStat, AT_SYMLINK_NOFOLLOW) != 0) {
+				continue; // the file was removed while walking
+			}
+			const string relPath = relDir.empty() ? string(name) : relDir + '/' + name;
+			if (S_ISDIR(fileStat.st_mode)) {
+				subdirs.push_back(relPath);
+			} else if (S_ISREG(fileStat.st_mode) && isVGMFileName(name)) {
+				files.push_back(FileInfo{relPath,
+						static_cast<int64_t>(fileStat.st_mtim.tv_sec) * 1000000000 + fileStat.st_mtim.tv_nsec,
+						static_cast<uint64_t>(fileStat.st_size)});
+			}
+		}
+		::closedir(dir);
+		for (const string &subdir : subdirs) {
+			walk(root, subdir, files);
+		}
+	}
+}
+
+void vgm::findVGMFiles(const string &root, vector<FileInfo> &files)
+{
+	const size_t start = files.size();
+	walk(root, string(), files);
+	sort(files.begin() + start, files.end(), [](const FileInfo &f1, const FileInfo &f2) { return f1.path < f2.path; });
+}
@@ -0,0 +1,43 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_TREE_H_
+#define VGM_TREE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vgm
+{
+	// A file found in a directory tree, and its metadata.
+	struct FileInfo
+	{
+		// The path relative to the root of the tree.
+		std::string path;
+		// The modification time in nanoseconds since the epoch.
+		int64_t mtime;
+		uint64_t size;
+	};
+
+	/*
+	 * Appends the regular files with the .vgm and .vgz extensions (in any case) that are in the directory root
+	 * or in its subdirectories to files, sorted by path. Symbolic links are not followed so that the walk cannot
+	 * loop. Throws afc::Exception if a directory cannot be read.
+	 */
+	void findVGMFiles(const std::string &root, std::vector<FileInfo> &files);
+}
+
+#endif // VGM_TREE_H_
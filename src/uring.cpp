@@ -0,0 +1,167 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "uring.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+
+namespace
+{
+	inline int ioUringSetup(const unsigned entryCount, io_uring_params &params)
+	{
+		return static_cast<int>(::syscall(__NR_io_uring_setup, entryCount, &params));
+	}
+
+	inline int ioUringEnter(const int fd, const unsigned submitCount, const unsigned waitCount, const unsigned flags)
+	{
+		return static_cast<int>(::syscall(__NR_io_uring_enter, fd, submitCount, waitCount, flags, nullptr, 0));
+	}
+
+	template<typename T>
+	inline T *at(void * const base, const unsigned offset)
+	{
+		return reinterpret_cast<T *>(static_cast<unsigned char *>(base) + offset);
+	}
+
+	inline void *mapRing(const int fd, const size_t size, const off_t offset)
+	{
+		void * const mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+		return mapping == MAP_FAILED ? nullptr : mapping;
+	}
+}
+
+vgm::IoRing::IoRing(const unsigned entryCount)
+	: m_sqRing(nullptr), m_sqRingSize(0), m_cqRing(nullptr), m_cqRingSize(0), m_sqes(nullptr), m_sqesSize(0),
+	  m_queued(0)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	m_fd = ioUringSetup(entryCount, params);
+	if (m_fd < 0) {
+		throw Exception("io_uring is not available"_s);
+	}
+	/* IORING_OP_READ appeared in Linux 5.6 together with IORING_FEAT_NODROP; the kernels that have the latter
+	 * support the former, too.
+	 */
+	if ((params.features & IORING_FEAT_NODROP) == 0) {
+		::close(m_fd);
+		throw Exception("io_uring is not available"_s);
+	}
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	const bool singleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMapping) {
+		m_sqRingSize = m_cqRingSize = max(m_sqRingSize, m_cqRingSize);
+	}
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqRing = mapRing(m_fd, m_sqRingSize, IORING_OFF_SQ_RING);
+	m_cqRing = singleMapping ? m_sqRing : mapRing(m_fd, m_cqRingSize, IORING_OFF_CQ_RING);
+	m_sqes = mapRing(m_fd, m_sqesSize, IORING_OFF_SQES);
+	if (m_sqRing == nullptr || m_cqRing == nullptr || m_sqes == nullptr) {
+		release();
+		throw Exception("Unable to map io_uring"_s);
+	}
+
+	m_sqEntryCount = params.sq_entries;
+	m_sqHead = at<unsigned>(m_sqRing, params.sq_off.head);
+	m_sqTail = at<unsigned>(m_sqRing, params.sq_off.tail);
+	m_sqMask = at<unsigned>(m_sqRing, params.sq_off.ring_mask);
+	m_sqArray = at<unsigned>(m_sqRing, params.sq_off.array);
+	m_cqHead = at<unsigned>(m_cqRing, params.cq_off.head);
+	m_cqTail = at<unsigned>(m_cqRing, params.cq_off.tail);
+	m_cqMask = at<unsigned>(m_cqRing, params.cq_off.ring_mask);
+	m_cqes = at<io_uring_cqe>(m_cqRing, params.cq_off.cqes);
+}
+
+void vgm::IoRing::release()
+{
+	if (m_sqes != nullptr) {
+		::munmap(m_sqes, m_sqesSize);
+	}
+	if (m_cqRing != nullptr && m_cqRing != m_sqRing) {
+		::munmap(m_cqRing, m_cqRingSize);
+	}
+	if (m_sqRing != nullptr) {
+		::munmap(m_sqRing, m_sqRingSize);
+	}
+	::close(m_fd);
+}
+
+bool vgm::IoRing::read(const int fd, void * const buf, const unsigned n, const uint64_t offset,
+		const uint64_t userData)
+{
+	// The kernel advances the head as it consumes the entries.
+	const unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+	const unsigned tail = *m_sqTail;
+	if (tail - head >= m_sqEntryCount) {
+		return false;
+	}
+	const unsigned index = tail & *m_sqMask;
+	io_uring_sqe &sqe = static_cast<io_uring_sqe *>(m_sqes)[index];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = fd;
+	sqe.off = offset;
+	sqe.addr = reinterpret_cast<uintptr_t>(buf);
+	sqe.len = n;
+	sqe.user_data = userData;
+	m_sqArray[index] = index;
+	// The entry must be visible to the kernel before the tail that publishes it.
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	++m_queued;
+	return true;
+}
+
+void vgm::IoRing::submit(const unsigned waitCount)
+{
+	const unsigned flags = waitCount > 0 ? IORING_ENTER_GETEVENTS : 0;
+	for (;;) {
+		const int submitted = ioUringEnter(m_fd, m_queued, waitCount, flags);
+		if (submitted >= 0) {
+			m_queued -= static_cast<unsigned>(submitted) < m_queued ? submitted : m_queued;
+			return;
+		}
+		if (errno != EINTR && errno != EAGAIN) {
+			throw Exception("Unable to submit I/O requests"_s);
+		}
+	}
+}
+
+bool vgm::IoRing::complete(uint64_t &userData, int &result)
+{
+	const unsigned head = *m_cqHead;
+	if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	const io_uring_cqe &cqe = static_cast<io_uring_cqe *>(m_cqes)[head & *m_cqMask];
+	userData = cqe.user_data;
+	result = cqe.res;
+	// The entry is released to the kernel only after it is read.
+	__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
@@ -0,0 +1,75 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_URING_H_
+#define VGM_URING_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace vgm
+{
+	/*
+	 * A minimal Linux io_uring instance that performs positional reads. It is driven with the raw system calls
+	 * so that liburing is not a dependency. Submissions and completions are handled by a single thread.
+	 *
+	 * The constructor throws afc::Exception if io_uring is not available, e.g. on kernels older than 5.6 or if
+	 * it is disabled by the system administrator or by a seccomp policy. The callers fall back to blocking I/O then.
+	 */
+	class IoRing
+	{
+	public:
+		// Creates the ring that can hold up to entryCount reads in flight.
+		explicit IoRing(unsigned entryCount);
+		~IoRing() { release(); }
+
+		unsigned capacity() const { return m_sqEntryCount; }
+
+		/* Queues the read of n octets at offset of fd into buf. userData is returned with the completion.
+		 * Returns false if the submission queue is full.
+		 */
+		bool read(int fd, void *buf, unsigned n, uint64_t offset, uint64_t userData);
+
+		// Submits the queued reads and waits until at least waitCount reads are completed.
+		void submit(unsigned waitCount);
+
+		/* Takes the next completed read. result is the number of octets read, or the negated errno.
+		 * Returns false if there are no completed reads.
+		 */
+		bool complete(uint64_t &userData, int &result);
+	private:
+		IoRing(const IoRing &) = delete;
+		IoRing &operator=(const IoRing &) = delete;
+
+		void release();
+
+		int m_fd;
+		void *m_sqRing;
+		std::size_t m_sqRingSize;
+		void *m_cqRing;
+		std::size_t m_cqRingSize;
+		void *m_sqes;
+		std::size_t m_sqesSize;
+
+		unsigned m_sqEntryCount;
+		unsigned *m_sqHead, *m_sqTail, *m_sqMask, *m_sqArray;
+		unsigned *m_cqHead, *m_cqTail, *m_cqMask;
+		void *m_cqes;
+		// The number of reads queued since the last submission.
+		unsigned m_queued;
+	};
+}
+
+#endif // VGM_URING_H_
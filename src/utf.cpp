@@ -0,0 +1,159 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "utf.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include <strings.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+bool vgm::isUTF8Charset(const char * const charset)
+{
+	return strcasecmp(charset, "UTF-8") == 0 || strcasecmp(charset, "UTF8") == 0;
+}
+
+bool vgm::utf16ToUTF8(const char16_t * const src, const size_t size, string &dest)
+{
+	// A code unit takes at most three octets (a surrogate pair takes four octets for two code units).
+	dest.resize(3 * size);
+	unsigned char * const start = reinterpret_cast<unsigned char *>(&dest[0]);
+	unsigned char *out = start;
+	bool valid = true;
+	size_t i = 0;
+	while (i < size) {
+		size_t blockEnd = size;
+#ifdef __SSE2__
+		// Runs of ASCII characters are converted eight code units at a time.
+		const __m128i nonASCIIMask = _mm_set1_epi16(static_cast<short>(0xff80));
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 8 <= size; i += 8, out += 8) {
+			const __m128i codeUnits = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+			const __m128i nonASCII = _mm_and_si128(codeUnits, nonASCIIMask);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonASCII, zero)) != 0xffff) {
+				break;
+			}
+			_mm_storel_epi64(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(codeUnits, codeUnits));
+		}
+		// The block that contains non-ASCII characters is converted one code point at a time.
+		blockEnd = min(i + 8, size);
+#endif
+		while (i < blockEnd) {
+			const uint32_t c = src[i++];
+			if (c < 0x80) {
+				*out++ = static_cast<unsigned char>(c);
+			} else if (c < 0x800) {
+				*out++ = static_cast<unsigned char>(0xc0 | (c >> 6));
+				*out++ = static_cast<unsigned char>(0x80 | (c & 0x3f));
+			} else if (c >= 0xd800 && c <= 0xdbff && i < size && src[i] >= 0xdc00 && src[i] <= 0xdfff) {
+				const uint32_t codePoint = 0x10000 + ((c - 0xd800) << 10) + (src[i++] - 0xdc00);
+				*out++ = static_cast<unsigned char>(0xf0 | (codePoint >> 18));
+				*out++ = static_cast<unsigned char>(0x80 | ((codePoint >> 12) & 0x3f));
+				*out++ = static_cast<unsigned char>(0x80 | ((codePoint >> 6) & 0x3f));
+				*out++ = static_cast<unsigned char>(0x80 | (codePoint & 0x3f));
+			} else {
+				uint32_t codePoint = c;
+				if (c >= 0xd800 && c <= 0xdfff) { // an unpaired surrogate
+					codePoint = 0xfffd;
+					valid = false;
+				}
+				*out++ = static_cast<unsigned char>(0xe0 | (codePoint >> 12));
+				*out++ = static_cast<unsigned char>(0x80 | ((codePoint >> 6) & 0x3f));
+				*out++ = static_cast<unsigned char>(0x80 | (codePoint & 0x3f));
+			}
+		}
+	}
+	dest.resize(out - start);
+	return valid;
+}
+
+bool vgm::utf8ToUTF16(const char * const src, const size_t size, u16string &dest)
+{
+	// An octet produces at most one code unit.
+	dest.resize(size);
+	char16_t * const start = &dest[0];
+	char16_t *out = start;
+	const unsigned char * const in = reinterpret_cast<const unsigned char *>(src);
+	size_t i = 0;
+	while (i < size) {
+		size_t blockEnd = size;
+#ifdef __SSE2__
+		// Runs of ASCII characters are converted sixteen octets at a time.
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= size; i += 16, out += 16) {
+			const __m128i octets = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+			if (_mm_movemask_epi8(octets) != 0) {
+				break;
+			}
+			// SSE2 is available on little-endian platforms only, so the code units are stored as is.
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi8(octets, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 8), _mm_unpackhi_epi8(octets, zero));
+		}
+		blockEnd = min(i + 16, size);
+#endif
+		while (i < blockEnd) {
+			const uint32_t c = in[i++];
+			if (c < 0x80) {
+				*out++ = static_cast<char16_t>(c);
+				continue;
+			}
+			size_t trailCount;
+			uint32_t codePoint, minCodePoint;
+			if (c >= 0xc2 && c <= 0xdf) {
+				trailCount = 1;
+				codePoint = c & 0x1f;
+				minCodePoint = 0x80;
+			} else if (c >= 0xe0 && c <= 0xef) {
+				trailCount = 2;
+				codePoint = c & 0x0f;
+				minCodePoint = 0x800;
+			} else if (c >= 0xf0 && c <= 0xf4) {
+				trailCount = 3;
+				codePoint = c & 0x07;
+				minCodePoint = 0x10000;
+			} else {
+				return false;
+			}
+			if (size - i < trailCount) {
+				return false;
+			}
+			for (size_t j = 0; j < trailCount; ++j, ++i) {
+				if ((in[i] & 0xc0) != 0x80) {
+					return false;
+				}
+				codePoint = (codePoint << 6) | (in[i] & 0x3f);
+			}
+			if (codePoint < minCodePoint || codePoint > 0x10ffff || (codePoint >= 0xd800 && codePoint <= 0xdfff)) {
+				return false;
+			}
+			if (codePoint < 0x10000) {
+				*out++ = static_cast<char16_t>(codePoint);
+			} else {
+				*out++ = static_cast<char16_t>(0xd800 + ((codePoint - 0x10000) >> 10));
+				*out++ = static_cast<char16_t>(0xdc00 + ((codePoint - 0x10000) & 0x3ff));
+			}
+			// The trailing octets of a multi-octet sequence may cross the end of the block.
+			blockEnd = max(blockEnd, i);
+		}
+	}
+	dest.resize(out - start);
+	return true;
+}
@@ -0,0 +1,42 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_UTF_H_
+#define VGM_UTF_H_
+
+#include <cstddef>
+#include <string>
+
+// Conversions between UTF-8 and UTF-16 that do not depend on iconv and the locale.
+namespace vgm
+{
+	// Returns true if charset is a name of the UTF-8 encoding, as returned by nl_langinfo(CODESET).
+	bool isUTF8Charset(const char *charset);
+
+	/*
+	 * Converts size UTF-16 code units (in the platform byte order) to UTF-8 and stores the result to dest.
+	 * Unpaired surrogates are replaced with U+FFFD. Returns false if there were unpaired surrogates.
+	 */
+	bool utf16ToUTF8(const char16_t *src, std::size_t size, std::string &dest);
+
+	/*
+	 * Converts size octets of UTF-8 to UTF-16 code units (in the platform byte order) and stores the result
+	 * to dest. Returns false if src is not valid UTF-8 (including overlong forms and encoded surrogates);
+	 * dest is unspecified then.
+	 */
+	bool utf8ToUTF16(const char *src, std::size_t size, std::u16string &dest);
+}
+
+#endif // VGM_UTF_H_
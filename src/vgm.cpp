@@ -15,10 +15,23 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include "vgm.h"
 
+#include "fileio.h"
+#include "format.h"
+
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <memory>
 #include <ostream>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include <afc/cpu/primitive.h>
 #include <afc/FastStringBuffer.hpp>
 #include <afc/SimpleString.hpp>
@@ -31,11 +44,6 @@ namespace
 {
 	static const afc::endianness LE = afc::endianness::LE;
 
-	// The minimal normalised header size of supported VGM file formats in octets.
-	const size_t SHORT_HEADER_SIZE = 0x40;
-	// The maximal normalised header size of supported VGM file formats in octets.
-	const size_t LONG_HEADER_SIZE = 0xc0;
-
 	/* For version 1.01 and earlier files:
 	 * - the feedback pattern (16 bits) should be assumed to be 0x0009;
 	 * - the shift register width (8 bits) should be assumed to be 16;
@@ -53,33 +61,17 @@ namespace
 		cursor += n;
 	}
 
-	inline unsigned readTag(afc::U16String &dest, InputStream &src, size_t &cursor)
-	{
-		unsigned char buf[2];
-		afc::FastStringBuffer<char16_t> result(15);
-		for (;;) {
-			readBytes(buf, 2, src, cursor);
-			const char16_t c = UInt16<>::fromBytes<LE>(buf);
-			if (c == 0) {
-				break;
-			}
-			result.reserveForOne();
-			result.append(c);
-		}
-		const std::size_t resultSize = result.size();
-		dest.attach(result.detach(), resultSize);
-		return 2*(resultSize+1);
-	}
-
-	inline void writeTag(const afc::U16String &src, OutputStream &out)
+	inline void decodeTag(afc::U16String &dest, const unsigned char * const src, const size_t charCount)
 	{
-		unsigned char buf[2];
-		for (size_t i = 0, n = src.size(); i < n; ++i) {
-			UInt16<>(src[i]).toBytes<LE>(buf);
-			out.write(buf, 2);
+		afc::FastStringBuffer<char16_t, afc::AllocMode::accurate> result(charCount);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		result.append(reinterpret_cast<const char16_t *>(src), charCount);
+#else
+		for (size_t i = 0; i < charCount; ++i) {
+			result.append(UInt16<>::fromBytes<LE>(src + 2*i));
 		}
-		UInt16<>(UInt16<>::type(0)).toBytes<LE>(buf);
-		out.write(buf, 2);
+#endif
+		dest.attach(result.detach(), charCount);
 	}
 
 	inline uint32_t readUInt32(InputStream &in, size_t &cursor)
@@ -89,215 +81,612 @@ namespace
 		return UInt32<>::fromBytes<LE>(buf);
 	}
 
-	inline void writeUInt32(const uint32_t val, OutputStream &out)
+	// The size of the buffer the skipped compressed content is decompressed into.
+	const size_t DISCARD_BUFFER_SIZE = 4096;
+	// The size of the buffer the VGM data is streamed through from the source file to the destination file.
+	const size_t STREAM_BUFFER_SIZE = 256 * 1024;
+
+	/* Skips n octets of the stream without seeking. Used for compressed streams so that the content
+	 * skipped is decompressed into a small fixed-size buffer and memory consumption stays constant.
+	 */
+	inline void discard(InputStream &s, size_t n)
 	{
-		unsigned char buf[4];
-		UInt32<>(val).toBytes<LE>(buf);
-		out.write(buf, 4);
+		unsigned char buf[DISCARD_BUFFER_SIZE];
+		while (n > 0) {
+			const size_t chunkSize = min(n, DISCARD_BUFFER_SIZE);
+			if (s.read(buf, chunkSize) != chunkSize) {
+				throw Exception("Premature end of file"_s);
+			}
+			n -= chunkSize;
+		}
 	}
 
-	inline void setPos(InputStream &s, const size_t pos, size_t &cursor)
+	inline void setPos(InputStream &s, const size_t pos, size_t &cursor, const bool seekable)
 	{
 		if (cursor == pos) {
 			return;
 		}
 		if (cursor < pos) {
-			s.skip(pos - cursor);
+			if (seekable) {
+				s.skip(pos - cursor);
+			} else {
+				discard(s, pos - cursor);
+			}
 		} else {
-			// TODO a more efficient implementation could be here
+			/* The sections are read in the order they are stored in the file, so only malformed files with
+			 * overlapping sections get here.
+			 */
 			s.reset();
-			s.skip(pos);
+			if (seekable) {
+				s.skip(pos);
+			} else {
+				discard(s, pos);
+			}
 		}
 		cursor = pos;
 	}
+
+	// Returns the current position of the file descriptor, which is the size of the content written to a new file.
+	inline size_t filePosition(const int fd)
+	{
+		const off_t pos = ::lseek(fd, 0, SEEK_CUR);
+		return pos < 0 ? 0 : pos;
+	}
+
+	inline void copyRange(const int srcFd, off_t srcOffset, const int destFd, off_t destOffset, size_t n)
+	{
+		// copy_file_range() may be unsupported for the given pair of files; sendfile() is tried then.
+		bool useSendfile = false;
+		while (n > 0) {
+			ssize_t copied;
+			if (!useSendfile) {
+				copied = ::copy_file_range(srcFd, &srcOffset, destFd, &destOffset, n, 0);
+				if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+					useSendfile = true;
+					if (::lseek(destFd, destOffset, SEEK_SET) == -1) {
+						throw Exception("Unable to write to file"_s);
+					}
+					continue;
+				}
+			} else {
+				copied = ::sendfile(destFd, srcFd, &srcOffset, n);
+				destOffset += copied > 0 ? copied : 0;
+			}
+			if (copied < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw Exception("Unable to copy VGM data"_s);
+			}
+			if (copied == 0) {
+				throw Exception("Premature end of file"_s);
+			}
+			n -= copied;
+		}
+	}
 }
 
-inline void vgm::VGMFile::readHeader(InputStream &in, size_t &cursor)
+inline void vgm::VGMFile::skipTo(InputStream &in, const size_t pos, size_t &cursor) const
 {
+	PhaseTimer timer(m_stats, Phase::skip);
+	const size_t start = cursor;
+	setPos(in, pos, cursor, m_format == Format::vgm);
+	// Uncompressed content is skipped by seeking.
+	if (m_format == Format::vgz) {
+		timer.addBytesIn(pos >= start ? pos - start : pos);
+	}
+}
+
+inline vgm::format::Layout vgm::VGMFile::readHeader(InputStream &in, size_t &cursor)
+{
+	PhaseTimer timer(m_stats, Phase::header);
+	const size_t start = cursor;
 	size_t i = 0; // Index of the header element to be read.
 
 	// Reading the base header. It is required for all versions of the VGM format.
-	for (size_t n = SHORT_HEADER_SIZE / 4; i < n; ++i) {
+	for (size_t n = format::SHORT_HEADER_SIZE / 4; i < n; ++i) {
 		m_header.elements[i] = readUInt32(in, cursor);
 	}
+	const format::Layout layout = format::readLayout(m_header.elements);
 
-	if (m_header.elements[VGMHeader::IDX_ID] != VGMHeader::VGM_FILE_ID) {
-		throw Exception("Not a VGM/VGZ file"_s);
+	// If the VGM data starts at an offset that is lower than 0xC0, all overlapping header values will be zero.
+	for (const size_t n = layout.headerSize / 4; i < n; ++i) {
+		m_header.elements[i] = readUInt32(in, cursor);
 	}
-
-	const uint32_t ver = version();
-	if (ver != VERSION_1_00 &&
-			ver != VERSION_1_01 &&
-			ver != VERSION_1_10 &&
-			ver != VERSION_1_50 &&
-			ver != VERSION_1_51 &&
-			ver != VERSION_1_60 &&
-			ver != VERSION_1_61) {
-		throw Exception("Unsupported VGM version"_s);
+	for (; i < VGMHeader::ELEMENT_COUNT; ++i) {
+		m_header.elements[i] = 0;
 	}
+	timer.addBytesIn(cursor - start);
+	return layout;
+}
 
-	if (ver >= VERSION_1_51) {
-		// If the VGM data starts at an offset that is lower than 0xC0, all overlapping header values will be zero.
-		const size_t realHeaderElemCount = min(absoluteVgmDataOffset() / 4, VGMHeader::ELEMENT_COUNT);
+inline void vgm::VGMFile::readGD3Info(InputStream &in, const size_t gd3Size, size_t &cursor)
+{
+	using std::operator<<;
 
-		for (; i < realHeaderElemCount; ++i) {
-			m_header.elements[i] = readUInt32(in, cursor);
-		}
+	for (GD3Info::TagSlot &slot : m_gd3Info.tags) {
+		slot = GD3Info::TagSlot{0, 0, false};
+	}
+	if (m_srcGD3Offset == 0) { // header -> data -> eof, all the tags are empty
+		m_gd3Info.dataSize = 0;
+		return;
+	}
 
-		for (; i < VGMHeader::ELEMENT_COUNT; ++i) {
-			m_header.elements[i] = 0;
-		}
+	skipTo(in, m_srcGD3Offset, cursor);
+
+	PhaseTimer readTimer(m_stats, Phase::gd3);
+	unsigned char gd3Header[GD3Info::HEADER_SIZE];
+	readBytes(gd3Header, GD3Info::HEADER_SIZE, in, cursor);
+	const uint32_t vgmGD3Length = format::readGD3Header(gd3Header, gd3Size);
+	/* The whole tag block is read at once since its length is known. The tags are then split by
+	 * their NUL terminators but are not decoded until getTag() asks for them.
+	 */
+	const size_t blockSize = vgmGD3Length & ~static_cast<size_t>(1); // UTF-16 code units are read only
+	unique_ptr<unsigned char[]> block(new unsigned char[blockSize]);
+	readBytes(block.get(), blockSize, in, cursor);
+	readTimer.addBytesIn(GD3Info::HEADER_SIZE + blockSize);
+
+	PhaseTimer decodeTimer(m_stats, Phase::tags);
+	size_t offsets[GD3Info::TAG_COUNT], sizes[GD3Info::TAG_COUNT];
+	const size_t pos = format::splitGD3Tags(block.get(), blockSize, offsets, sizes);
+	for (size_t i = 0; i < GD3Info::TAG_COUNT; ++i) {
+		m_gd3Info.tags[i] = GD3Info::TagSlot{offsets[i], sizes[i], false};
 	}
+	if (pos != vgmGD3Length) {
+		cerr << "skipping last " << vgmGD3Length - pos << " unused bytes of the VGM GD3 header" << endl;
+	}
+	m_srcGD3Block = move(block);
+	m_srcGD3Length = vgmGD3Length;
 }
 
-inline void vgm::VGMFile::readGD3Info(InputStream &in, size_t &cursor)
+inline void vgm::VGMFile::readData(InputStream &in, size_t &cursor)
 {
-	using std::operator<<;
-
-	setPos(in, VGMHeader::POS_GD3 + m_header.elements[VGMHeader::IDX_GD3_OFFSET], cursor);
+	skipTo(in, m_srcDataOffset, cursor);
+	PhaseTimer timer(m_stats, Phase::data);
+	unsigned char * const data = new unsigned char[m_dataSize];
+	m_data = data;
+	readBytes(data, m_dataSize, in, cursor);
+	timer.addBytesIn(m_dataSize);
+}
 
-	{ // VGM ID
-		const uint32_t vgmId = readUInt32(in, cursor);
-		if (vgmId != GD3Info::VGM_FILE_GD3_ID) {
-			throw Exception("Not a VGM file"_s);
-		}
+inline void vgm::VGMFile::mapData()
+{
+	PhaseTimer timer(m_stats, Phase::data);
+	if (m_dataSize == 0) { // empty files cannot be mapped
+		m_data = new unsigned char[0];
+		return;
 	}
-	{ // GD3 version
-		const uint32_t gd3Version = readUInt32(in, cursor);
-		if (gd3Version != GD3Info::VGM_FILE_GD3_VERSION) {
-			throw Exception("Unsupported GD3 version"_s);
-		}
+	const int fd = ::open(m_srcFile.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		throw Exception("Unable to open file"_s);
 	}
-
-	const uint32_t vgmGD3Length = readUInt32(in, cursor);
-	unsigned parsedCount = 0;
-	// reading tags
-	for (size_t i = static_cast<size_t>(Tag::title), n = static_cast<size_t>(Tag::notes); i <= n; ++i) {
-		parsedCount += readTag(m_gd3Info.tags[i], in, cursor);
+	// The mapping must start at a page boundary.
+	const size_t mappingOffset = m_srcDataOffset & ~(static_cast<size_t>(::sysconf(_SC_PAGESIZE)) - 1);
+	const size_t mappingSize = m_srcDataOffset - mappingOffset + m_dataSize;
+	struct stat fileStat;
+	if (::fstat(fd, &fileStat) != 0 || static_cast<size_t>(fileStat.st_size) < m_srcDataOffset + m_dataSize) {
+		::close(fd);
+		throw Exception("Premature end of file"_s);
 	}
-	if (parsedCount != vgmGD3Length) {
-		cerr << "skipping last " << vgmGD3Length - parsedCount << " unused bytes of the VGM GD3 header" << endl;
+	void * const mapping = ::mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, mappingOffset);
+	if (mapping == MAP_FAILED) {
+		::close(fd);
+		throw Exception("Unable to map file into memory"_s);
 	}
+	::madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+	m_mapping = mapping;
+	m_mappingSize = mappingSize;
+	m_srcFd = fd;
+	m_data = static_cast<const unsigned char *>(mapping) + (m_srcDataOffset - mappingOffset);
 }
 
-inline void vgm::VGMFile::readData(InputStream &in, size_t &cursor)
+void vgm::VGMFile::releaseData()
 {
-	const size_t absDataOffset = absoluteVgmDataOffset();
-	const size_t absoluteEOFOffset = m_header.elements[VGMHeader::IDX_EOF_OFFSET] + VGMHeader::POS_EOF;
-	const size_t gd3Offset = m_header.elements[VGMHeader::IDX_GD3_OFFSET];
-	if (gd3Offset == 0) { // header -> data -> eof
-		m_dataSize = absoluteEOFOffset - absDataOffset;
-	} else { // GD3 info exists, the data takes the space between the header and GD3
-		const size_t absoluteGD3Offset = gd3Offset + VGMHeader::POS_GD3;
-		if (absoluteGD3Offset > absDataOffset) { // header -> data -> gd3 -> eof
-			m_dataSize = absoluteGD3Offset - absDataOffset;
-		} else { // header -> gd3 -> data -> eof
-			m_dataSize = absoluteEOFOffset - absDataOffset;
-		}
+	if (m_mapping != nullptr) {
+		::munmap(m_mapping, m_mappingSize);
+		::close(m_srcFd);
+		m_mapping = nullptr;
+		m_srcFd = -1;
+	} else {
+		delete[] m_data;
 	}
-	setPos(in, absDataOffset, cursor);
-	m_data = new unsigned char[m_dataSize];
-	readBytes(m_data, m_dataSize, in, cursor);
+	m_data = nullptr;
 }
 
-vgm::VGMFile::VGMFile(const char * const srcFile)
+vgm::VGMFile::VGMFile(const char * const srcFile, const LoadMode mode, Stats * const stats)
 try
-	: m_data(0), m_dataSize(0)
+	: m_data(0), m_dataSize(0), m_loadMode(mode), m_srcFile(srcFile), m_srcDataOffset(0), m_srcGD3Offset(0),
+	  m_srcGD3Length(0), m_decodedTagMask(0), m_srcEndsWithGD3(false), m_mapping(nullptr), m_mappingSize(0), m_srcFd(-1), m_stats(stats)
 {
-	unique_ptr<InputStream> inPtr(new FileInputStream(srcFile));
-	unsigned char buf[4];
-	if (inPtr->read(buf, 4) != 4) {
-		throw Exception("Not a VGM/VGZ file"_s); // the file is too short to be either a VGM or VGZ file
-	}
-	if (buf[0] == 0x1f && buf[1] == 0x8b) { // a VGZ (GZip) file. GZip file magic header is {0x1f, 0x8b}
-		/* Ensure that the file is not opened twice at the same time.
-		   In addition, exceptions while closing could be caught by the caller,
-		   which is not the case with destructors. */
-		inPtr->close();
-		inPtr.reset(new GZipFileInputStream(srcFile));
-		m_format = Format::vgz;
-	} else if (UInt32<>::fromBytes<LE>(buf) == VGMHeader::VGM_FILE_ID) { // a GVM file
-		inPtr->reset();
-		m_format = Format::vgm;
+	unique_ptr<InputStream> inPtr;
+	{
+		PhaseTimer timer(stats, Phase::open);
+		inPtr.reset(new FileInputStream(srcFile));
+		unsigned char buf[4];
+		if (inPtr->read(buf, 4) != 4) {
+			throw Exception("Not a VGM/VGZ file"_s); // the file is too short to be either a VGM or VGZ file
+		}
+		timer.addBytesIn(4);
+		if (buf[0] == 0x1f && buf[1] == 0x8b) { // a VGZ (GZip) file. GZip file magic header is {0x1f, 0x8b}
+			/* Ensure that the file is not opened twice at the same time.
+			   In addition, exceptions while closing could be caught by the caller,
+			   which is not the case with destructors. */
+			inPtr->close();
+			inPtr.reset(new GZipFileInputStream(srcFile));
+			m_format = Format::vgz;
+		} else if (UInt32<>::fromBytes<LE>(buf) == VGMHeader::VGM_FILE_ID) { // a GVM file
+			inPtr->reset();
+			m_format = Format::vgm;
+		}
 	}
 
 	// cursor is used to indicate the current position within the file. Knowing the current position allows setPos()
 	// to move cursor forward faster for stream input
 	size_t cursor = 0;
-	readHeader(*inPtr, cursor);
-	readData(*inPtr, cursor);
-	readGD3Info(*inPtr, cursor);
+	const format::Layout layout = readHeader(*inPtr, cursor);
+	m_dataSize = layout.dataSize;
+	m_srcDataOffset = layout.dataOffset;
+	m_srcGD3Offset = layout.gd3Offset;
+	if (mode == LoadMode::mappedData && m_format == Format::vgm) {
+		mapData();
+		readGD3Info(*inPtr, layout.gd3Size, cursor);
+	} else if (mode == LoadMode::full || mode == LoadMode::mappedData ||
+			(mode == LoadMode::deferredData && m_format == Format::vgz)) {
+		/* The sections are read in the ascending order of their offsets so that the input is read
+		 * (and decompressed, for VGZ files) in a single forward pass.
+		 */
+		if (m_srcGD3Offset != 0 && m_srcGD3Offset < m_srcDataOffset) { // header -> gd3 -> data -> eof
+			readGD3Info(*inPtr, layout.gd3Size, cursor);
+			readData(*inPtr, cursor);
+		} else {
+			readData(*inPtr, cursor);
+			readGD3Info(*inPtr, layout.gd3Size, cursor);
+		}
+	} else {
+		readGD3Info(*inPtr, layout.gd3Size, cursor);
+	}
+	if (mode != LoadMode::tagsOnly && m_srcGD3Offset > m_srcDataOffset) {
+		// Checks if the layout is header -> data -> gd3 -> eof.
+		const size_t gd3End = m_srcGD3Offset + GD3Info::HEADER_SIZE + m_srcGD3Length;
+		if (m_format == Format::vgm) {
+			struct stat fileStat;
+			m_srcEndsWithGD3 = ::stat(srcFile, &fileStat) == 0 && static_cast<size_t>(fileStat.st_size) == gd3End;
+		} else {
+			/* The size of the content is unknown until it is decompressed up to the end. The GD3 info has been read
+			 * last, except for the odd octet of its length.
+			 */
+			unsigned char octet;
+			const size_t rest = gd3End - cursor;
+			m_srcEndsWithGD3 = (rest == 0 || inPtr->read(&octet, rest) == rest) && inPtr->read(&octet, 1) == 0;
+		}
+	}
 
+	PhaseTimer timer(stats, Phase::close);
 	inPtr->close(); // if close generates an exception it is not suppressed, as destructors must do.
 }
 catch (...) {
-	delete[] m_data;
+	releaseData();
 	throw;
 }
 
-inline void vgm::VGMFile::writeContent(OutputStream &out) const
+inline size_t vgm::VGMFile::headerSize() const
 {
-	const size_t headerElemCount = version() < VERSION_1_51 ? SHORT_HEADER_SIZE / 4 : VGMHeader::ELEMENT_COUNT;
-	// Writing the base header. It is required for all versions of the VGM format.
-	for (size_t i = 0; i < headerElemCount; ++i) {
-		writeUInt32(m_header.elements[i], out);
-	}
+	return format::headerSize(version());
+}
 
-	// write data
-	out.write(m_data, m_dataSize);
+inline void vgm::VGMFile::encodeHeader(unsigned char *dest) const
+{
+	for (size_t i = 0, n = headerSize() / 4; i < n; ++i, dest += 4) {
+		UInt32<>(m_header.elements[i]).toBytes<LE>(dest);
+	}
+}
 
-	// write GD3 info
-	writeUInt32(GD3Info::VGM_FILE_GD3_ID, out);
-	writeUInt32(GD3Info::VGM_FILE_GD3_VERSION, out);
-	writeUInt32(m_gd3Info.dataSize, out);
+inline void vgm::VGMFile::encodeGD3Info(unsigned char *dest) const
+{
+	format::encodeGD3Header(m_gd3Info.dataSize, dest);
+	dest += GD3Info::HEADER_SIZE;
 	for (size_t i = static_cast<size_t>(Tag::title), n = static_cast<size_t>(Tag::notes); i <= n; ++i) {
-		writeTag(m_gd3Info.tags[i], out);
+		// Tags are kept encoded so they are copied as is.
+		const size_t tagSize = m_gd3Info.tags[i].size;
+		if (tagSize > 0) {
+			memcpy(dest, tagData(i), tagSize);
+		}
+		dest += tagSize;
+		UInt16<>(UInt16<>::type(0)).toBytes<LE>(dest);
+		dest += 2;
 	}
 }
 
-void vgm::VGMFile::save(const char * const dest, const Format format)
+inline unique_ptr<unsigned char[]> vgm::VGMFile::encodeHeaderAndGD3Info() const
 {
-	normalise();
+	PhaseTimer timer(m_stats, Phase::encode);
+	const size_t hdrSize = headerSize();
+	unique_ptr<unsigned char[]> buf(new unsigned char[hdrSize + gd3InfoSize()]);
+	encodeHeader(buf.get());
+	encodeGD3Info(buf.get() + hdrSize);
+	return buf;
+}
 
-	if (format == Format::vgz) {
-		GZipFileOutputStream out(dest);
-		writeContent(out);
-		out.close(); // if close generates an exception it is not suppressed, as destructors must do.
-	} else {
-		FileOutputStream out(dest);
-		writeContent(out);
-		out.close(); // if close generates an exception it is not suppressed, as destructors must do.
+inline bool vgm::VGMFile::hasNormalisedLayout() const
+{
+	return m_srcGD3Offset != 0 && // header -> data -> gd3 -> eof, with the header being of the normalised size
+			m_srcDataOffset == headerSize() && m_srcGD3Offset == m_srcDataOffset + m_dataSize;
+}
+
+inline bool vgm::VGMFile::isUnchanged(const uint32_t srcHeader[]) const
+{
+	if (m_gd3Info.dataSize != m_srcGD3Length ||
+			!equal(srcHeader, srcHeader + headerSize() / 4, static_cast<const uint32_t *>(m_header.elements))) {
+		return false;
 	}
+	const unique_ptr<unsigned char[]> buf(new unsigned char[gd3InfoSize()]);
+	encodeGD3Info(buf.get());
+	return memcmp(buf.get() + GD3Info::HEADER_SIZE, m_srcGD3Block.get(), m_gd3Info.dataSize) == 0;
 }
 
-inline void vgm::VGMFile::normalise()
+inline void vgm::VGMFile::updateInPlace(const char * const dest, const SyncMode sync)
 {
-	size_t tagCharCount = 0;
-	for (size_t i = static_cast<size_t>(Tag::title), n = static_cast<size_t>(Tag::notes); i <= n; ++i) {
-		tagCharCount += m_gd3Info.tags[i].size() + 1; // '\0' must be counted too
+	const size_t hdrSize = headerSize();
+	const size_t gd3Size = gd3InfoSize();
+	const unique_ptr<unsigned char[]> buf(encodeHeaderAndGD3Info());
+
+	const int fd = ::open(dest, O_WRONLY);
+	if (fd == -1) {
+		throw Exception("Unable to open file"_s);
+	}
+	try {
+		PhaseTimer timer(m_stats, Phase::write);
+		// The GD3 info is written first so that the old header stays valid if the tail cannot be written.
+		writeAt(fd, buf.get() + hdrSize, gd3Size, m_srcGD3Offset);
+		if (::ftruncate(fd, m_srcGD3Offset + gd3Size) != 0) {
+			throw Exception("Unable to truncate file"_s);
+		}
+		writeAt(fd, buf.get(), hdrSize, 0);
+		timer.addBytesOut(hdrSize + gd3Size);
+	}
+	catch (...) {
+		::close(fd);
+		throw;
+	}
+
+	PhaseTimer timer(m_stats, Phase::commit);
+	// The file is neither created nor renamed so there is no directory entry to flush.
+	if (sync != SyncMode::none && ::fdatasync(fd) != 0) {
+		::close(fd);
+		throw Exception("Unable to flush file"_s);
+	}
+	closeFile(fd);
+}
+
+inline bool vgm::VGMFile::updateCompressedInPlace(const char * const dest, const GZipSettings &gzipSettings,
+		const SyncMode sync)
+{
+	const size_t hdrSize = headerSize();
+	const size_t gd3Size = gd3InfoSize();
+	const unique_ptr<unsigned char[]> buf(encodeHeaderAndGD3Info());
+	const Span content[] = {{buf.get(), hdrSize}, {m_data, m_dataSize}, {buf.get() + hdrSize, gd3Size}};
+
+	// Only the header and the GD3 info differ from the content of the source file.
+	unique_ptr<AtomicFile> file;
+	{
+		PhaseTimer timer(m_stats, Phase::write);
+		file = updateGZip(dest, content, 3, hdrSize, m_srcGD3Offset, gzipSettings);
+		if (file == nullptr) {
+			return false;
+		}
+		timer.addBytesOut(filePosition(file->fd()));
 	}
-	m_gd3Info.dataSize = tagCharCount * 2; // UTF16-LE is used for GD3
+	commit(*file, sync);
+	return true;
+}
+
+inline void vgm::VGMFile::commit(AtomicFile &file, const SyncMode sync) const
+{
+	PhaseTimer timer(m_stats, Phase::commit);
+	file.commit(sync);
+}
+
+inline void vgm::VGMFile::writeMappedContent(const char * const dest, const SyncMode sync) const
+{
+	const size_t hdrSize = headerSize();
+	const size_t gd3Size = gd3InfoSize();
+	const unique_ptr<unsigned char[]> buf(encodeHeaderAndGD3Info());
 
-	const uint32_t ver = version();
+	AtomicFile file(dest);
+	{
+		PhaseTimer timer(m_stats, Phase::write);
+		writeAt(file.fd(), buf.get(), hdrSize, 0);
+		copyRange(m_srcFd, m_srcDataOffset, file.fd(), hdrSize, m_dataSize);
+		writeAt(file.fd(), buf.get() + hdrSize, gd3Size, hdrSize + m_dataSize);
+		timer.addBytesIn(m_dataSize);
+		timer.addBytesOut(hdrSize + m_dataSize + gd3Size);
+	}
+	commit(file, sync);
+}
 
-	const size_t headerSize = ver < VERSION_1_51 ? SHORT_HEADER_SIZE : LONG_HEADER_SIZE;
-	const size_t fileSize = headerSize + m_dataSize + GD3Info::HEADER_SIZE + m_gd3Info.dataSize;
-	m_header.elements[VGMHeader::IDX_EOF_OFFSET] = fileSize - VGMHeader::POS_EOF;
+inline void vgm::VGMFile::writeCompressedContent(const char * const dest, const GZipSettings &gzipSettings,
+		const SyncMode sync) const
+{
+	const size_t hdrSize = headerSize();
+	const size_t gd3Size = gd3InfoSize();
+	const unique_ptr<unsigned char[]> buf(encodeHeaderAndGD3Info());
+	const Span content[] = {{buf.get(), hdrSize}, {m_data, m_dataSize}, {buf.get() + hdrSize, gd3Size}};
 
-	if (ver < VERSION_1_01) {
-		// VGM 1.00 files will have a value of 0. Overriding the real value in this case.
-		m_header.elements[VGMHeader::IDX_RATE] = 0;
+	AtomicFile file(dest);
+	{
+		PhaseTimer timer(m_stats, Phase::write);
+		writeGZip(file.fd(), content, 3, gzipSettings);
+		timer.addBytesOut(filePosition(file.fd()));
 	}
-	if (ver < VERSION_1_10) {
-		// For version 1.01 and earlier files, the YM2413 clock rate should be used for the clock rate of the YM2612.
-		m_header.elements[VGMHeader::IDX_YM2612_CLOCK] = 0;
-		// For version 1.01 and earlier files, the YM2413 clock rate should be used for the clock rate of the YM2151.
-		m_header.elements[VGMHeader::IDX_YM2151_CLOCK] = 0;
+	commit(file, sync);
+}
+
+inline void vgm::VGMFile::writeContent(const char * const dest, const SyncMode sync) const
+{
+	const size_t hdrSize = headerSize();
+	const size_t gd3Size = gd3InfoSize();
+	const unique_ptr<unsigned char[]> buf(encodeHeaderAndGD3Info());
+	struct iovec content[] = {{buf.get(), hdrSize}, {const_cast<unsigned char *>(m_data), m_dataSize},
+			{buf.get() + hdrSize, gd3Size}};
+
+	AtomicFile file(dest);
+	{
+		PhaseTimer timer(m_stats, Phase::write);
+		writeAllV(file.fd(), content, 3);
+		timer.addBytesOut(hdrSize + m_dataSize + gd3Size);
 	}
-	// TODO does this affect gd3Offset? If yes then gd3Offset must be normalised, too.
-	/* Forcing the VGM data to start at minimal absolute offset allowed for the given version of the VGM format.
-	 * For versions prior to 1.50, it should be 0 and the VGM data must start at offset 0x40.
+	commit(file, sync);
+}
+
+inline void vgm::VGMFile::writeStreamedContent(const char * const dest, const Format format,
+		const GZipSettings &gzipSettings, const SyncMode sync) const
+{
+	const size_t hdrSize = headerSize();
+	const size_t gd3Size = gd3InfoSize();
+	const unique_ptr<unsigned char[]> buf(encodeHeaderAndGD3Info());
+	const char * const srcFile = m_srcFile.c_str();
+
+	AtomicFile file(dest);
+	if (m_format == Format::vgm && format == Format::vgm) {
+		// Neither file is compressed so the data is copied in the kernel without being buffered at all.
+		PhaseTimer timer(m_stats, Phase::write);
+		const int srcFd = ::open(srcFile, O_RDONLY | O_CLOEXEC);
+		if (srcFd == -1) {
+			throw Exception("Unable to open file"_s);
+		}
+		try {
+			writeAt(file.fd(), buf.get(), hdrSize, 0);
+			copyRange(srcFd, m_srcDataOffset, file.fd(), hdrSize, m_dataSize);
+			writeAt(file.fd(), buf.get() + hdrSize, gd3Size, hdrSize + m_dataSize);
+		}
+		catch (...) {
+			::close(srcFd);
+			throw;
+		}
+		::close(srcFd);
+		timer.addBytesIn(m_dataSize);
+		timer.addBytesOut(hdrSize + m_dataSize + gd3Size);
+	} else {
+		PhaseTimer timer(m_stats, Phase::write);
+		unique_ptr<InputStream> inPtr(m_format == Format::vgz ?
+				static_cast<InputStream *>(new GZipFileInputStream(srcFile)) : new FileInputStream(srcFile));
+		unique_ptr<GZipWriter> gzip(format == Format::vgz ? new GZipWriter(file.fd(), gzipSettings) : nullptr);
+		auto write = [&](const unsigned char * const data, const size_t n)
+		{
+			if (gzip) {
+				gzip->write(data, n);
+			} else {
+				writeAll(file.fd(), data, n);
+			}
+		};
+
+		write(buf.get(), hdrSize);
+		size_t cursor = 0;
+		setPos(*inPtr, m_srcDataOffset, cursor, m_format == Format::vgm);
+		const unique_ptr<unsigned char[]> chunk(new unsigned char[STREAM_BUFFER_SIZE]);
+		for (size_t remaining = m_dataSize; remaining > 0;) {
+			const size_t chunkSize = min(remaining, STREAM_BUFFER_SIZE);
+			readBytes(chunk.get(), chunkSize, *inPtr, cursor);
+			write(chunk.get(), chunkSize);
+			remaining -= chunkSize;
+		}
+		write(buf.get() + hdrSize, gd3Size);
+		if (gzip) {
+			gzip->finish();
+		}
+		inPtr->close(); // if close generates an exception it is not suppressed, as destructors must do.
+		timer.addBytesIn(m_format == Format::vgz ? m_srcDataOffset + m_dataSize : m_dataSize);
+		timer.addBytesOut(filePosition(file.fd()));
+	}
+	commit(file, sync);
+}
+
+void vgm::VGMFile::setTag(const Tag name, const char16_t * const value, const size_t charCount)
+{
+	const size_t i = static_cast<size_t>(name);
+	/* The value is appended to the arena in its encoded form. A value that is replaced by a later one
+	 * is left there unused until the file is destroyed.
 	 */
-	m_header.elements[VGMHeader::IDX_VGM_DATA_OFFSET] = ver < VERSION_1_50 ?
-			0 : headerSize - VGMHeader::POS_VGM_DATA;
+	const size_t offset = m_tagArena.size();
+	m_tagArena.resize(offset + 2*charCount);
+	format::encodeUTF16LE(value, charCount, m_tagArena.data() + offset);
+	m_gd3Info.tags[i] = GD3Info::TagSlot{offset, 2*charCount, true};
+	m_decodedTagMask &= ~(1u << i);
+}
+
+const afc::U16String &vgm::VGMFile::getTag(const Tag name) const
+{
+	const size_t i = static_cast<size_t>(name);
+	lock_guard<mutex> lock(m_decodedTagsMutex);
+	if (m_decodedTags == nullptr) {
+		m_decodedTags.reset(new afc::U16String[GD3Info::TAG_COUNT]);
+	}
+	afc::U16String &tag = m_decodedTags[i];
+	if ((m_decodedTagMask & (1u << i)) == 0) {
+		PhaseTimer timer(m_stats, Phase::tags);
+		const size_t tagSize = m_gd3Info.tags[i].size;
+		if (tagSize > 0) {
+			decodeTag(tag, tagData(i), tagSize / 2);
+		} else { // there might be no block to point into
+			tag = afc::U16String();
+		}
+		m_decodedTagMask |= 1u << i;
+	}
+	return tag;
+}
+
+void vgm::VGMFile::save(const char * const dest, const Format format, const GZipSettings &gzipSettings,
+		const SaveSettings &saveSettings)
+{
+	if (m_data == nullptr && m_loadMode == LoadMode::tagsOnly) {
+		throw Exception("VGM data is not loaded"_s);
+	}
+
+	const VGMHeader srcHeader = m_header;
+	normalise();
+
+	const SyncMode sync = saveSettings.sync;
+	const bool toSource = isSameFile(m_srcFile.c_str(), dest);
+	if (format == m_format && hasNormalisedLayout() && toSource) {
+		if (m_srcEndsWithGD3 && isUnchanged(srcHeader.elements)) {
+			return;
+		}
+		// Once the source file is rewritten its content is not known to be equal to what has been loaded.
+		m_srcEndsWithGD3 = false;
+		if (format == Format::vgm && saveSettings.inPlace) {
+			updateInPlace(dest, sync);
+			return;
+		}
+		if (format == Format::vgz && m_data != nullptr && updateCompressedInPlace(dest, gzipSettings, sync)) {
+			return;
+		}
+	}
+
+	if (m_data == nullptr) {
+		// The VGM data is not loaded so it is streamed from the source file, which is replaced only afterwards.
+		writeStreamedContent(dest, format, gzipSettings, sync);
+		return;
+	}
+	if (m_mapping != nullptr && format == Format::vgm) {
+		// The source file is only replaced after the new file is written so its mapping stays valid.
+		writeMappedContent(dest, sync);
+		return;
+	}
+
+	if (format == Format::vgz) {
+		writeCompressedContent(dest, gzipSettings, sync);
+	} else {
+		writeContent(dest, sync);
+	}
+}
+
+inline void vgm::VGMFile::normalise()
+{
+	size_t tagsSize = 0;
+	for (size_t i = static_cast<size_t>(Tag::title), n = static_cast<size_t>(Tag::notes); i <= n; ++i) {
+		tagsSize += m_gd3Info.tags[i].size + 2; // '\0' must be counted too
+	}
+	m_gd3Info.dataSize = tagsSize;
+
+	format::normaliseHeader(m_header.elements, m_dataSize, gd3InfoSize());
 }
@@ -18,14 +18,35 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <afc/Exception.h>
 #include <afc/SimpleString.hpp>
 #include <afc/stream.h>
 
+#include "format.h"
+#include "gzip.h"
+#include "stats.h"
+
 namespace vgm
 {
+	struct SaveSettings
+	{
+		SaveSettings() : sync(SyncMode::none), inPlace(false) {}
+
+		// Defines whether the saved file is flushed to the storage device.
+		SyncMode sync;
+		/* If true then the source file is updated in place where possible (see VGMFile::save()). In-place
+		 * updates are not atomic: the file can be left inconsistent if writing it fails. Otherwise (the default)
+		 * the file is always written anew and replaces the old one atomically.
+		 */
+		bool inPlace;
+	};
+
 	class VGMFile
 	{
 	public:
@@ -34,13 +55,59 @@ namespace vgm
 			vgm, vgz
 		};
 
-		VGMFile(const char * const srcFile);
+		/*
+		 * Defines which parts of a VGM/VGZ file are loaded.
+		 * - full: the header, VGM data and GD3 info are loaded. The file can be saved;
+		 * - tagsOnly: only the header and GD3 info are loaded. The VGM data is skipped without being
+		 *   buffered, so that memory consumption does not depend on the size of the file. The file cannot be saved;
+		 * - deferredData: the same as tagsOnly for VGM files. The VGM data is read from the source file only if
+		 *   saving needs it, i.e. if the GD3 info cannot be updated in place. VGZ files are loaded fully since
+		 *   skipping compressed data costs as much as reading it;
+		 * - mappedData: the same as full but the VGM data of VGM files is a view into the source file mapped
+		 *   into memory instead of a copy. Saving to the VGM format copies the data from the source file to
+		 *   the destination file in the kernel. VGZ files are loaded fully;
+		 * - streamedData: the same as deferredData but VGZ files are not loaded fully either. Saving streams
+		 *   the VGM data from the source file to the destination file through a fixed-size buffer, so that
+		 *   memory consumption does not depend on the size of the file. The VGM data of VGZ files is
+		 *   decompressed twice then: once while loading to reach the GD3 info, and once while saving.
+		 */
+		enum class LoadMode
+		{
+			full, tagsOnly, deferredData, mappedData, streamedData
+		};
+
+		/* If stats is not null then the phases of loading the file, and of saving it later, are measured
+		 * there. The stats must outlive the VGMFile.
+		 */
+		VGMFile(const char * const srcFile, const LoadMode mode = LoadMode::full, Stats * const stats = nullptr);
 		VGMFile(VGMFile &&o) : m_header(o.m_header), m_gd3Info(o.m_gd3Info), m_data(o.m_data),
-				m_dataSize(o.m_dataSize), m_format(o.m_format) { o.m_data = nullptr; }
+				m_dataSize(o.m_dataSize), m_format(o.m_format), m_loadMode(o.m_loadMode),
+				m_srcFile(std::move(o.m_srcFile)), m_srcDataOffset(o.m_srcDataOffset),
+				m_srcGD3Offset(o.m_srcGD3Offset), m_srcGD3Block(std::move(o.m_srcGD3Block)),
+				m_srcGD3Length(o.m_srcGD3Length), m_tagArena(std::move(o.m_tagArena)),
+				m_decodedTags(std::move(o.m_decodedTags)), m_decodedTagMask(o.m_decodedTagMask),
+				m_srcEndsWithGD3(o.m_srcEndsWithGD3), m_mapping(o.m_mapping), m_mappingSize(o.m_mappingSize),
+				m_srcFd(o.m_srcFd), m_stats(o.m_stats)
+		{
+			o.m_data = nullptr;
+			o.m_mapping = nullptr;
+			o.m_srcFd = -1;
+		}
 
-		~VGMFile() { delete[] m_data; }
+		~VGMFile() { releaseData(); }
 
-		void save(const char * const dest, const Format format);
+		/*
+		 * Saves the file to dest in the given format. If dest is the source file in the same format and
+		 * the source has the layout header -> data -> gd3 -> eof with the header of the normalised size then:
+		 * - if the header and the GD3 info are unchanged then nothing is written at all;
+		 * - for VGM files only the header and the GD3 info are written in place if enabled by saveSettings;
+		 * - for VGZ files the compressed VGM data is copied as is, and only the header, the GD3 info and
+		 *   the data next to them are compressed again.
+		 * Otherwise the file is written to a temporary file that replaces dest atomically.
+		 * gzipSettings define how the content is compressed if the VGZ format is used.
+		 */
+		void save(const char * const dest, const Format format, const GZipSettings &gzipSettings = GZipSettings(),
+				const SaveSettings &saveSettings = SaveSettings());
 
 		/*
 		 * a) all tag values must be consecutive integers starting from 0
@@ -53,17 +120,19 @@ namespace vgm
 			author = 6, authorJP = 7, date = 8, converter = 9, notes = 10
 		};
 
-		void setTag(const Tag name, const afc::U16String &&value)
-		{
-			m_gd3Info.tags[static_cast<size_t>(name)] = std::move(value);
-		}
+		void setTag(const Tag name, const afc::U16String &&value) { setTag(name, value.data(), value.size()); }
+		// Sets the tag to charCount UTF-16 code units (in the platform byte order) at value.
+		void setTag(const Tag name, const char16_t *value, std::size_t charCount);
 
-		const afc::U16String &getTag(const Tag name) const
-		{
-			return m_gd3Info.tags[static_cast<size_t>(name)];
-		}
+		/* Tags are decoded from the GD3 info on first access. The reference returned stays valid until
+		 * the tag is set again or the file is destroyed. getTag() can be called from several threads at once,
+		 * but not concurrently with setTag() or any other non-const method.
+		 */
+		const afc::U16String &getTag(const Tag name) const;
 
 		Format getFormat() const { return m_format; }
+		uint32_t getVersion() const { return m_header.elements[VGMHeader::IDX_VERSION]; }
+		LoadMode getLoadMode() const { return m_loadMode; }
 	private:
 		static const uint32_t VERSION_1_00 = 0x00000100, VERSION_1_01 = 0x00000101, VERSION_1_10 = 0x00000110,
 				VERSION_1_50 = 0x00000150, VERSION_1_51 = 0x00000151, VERSION_1_60 = 0x00000160,
@@ -75,19 +144,41 @@ namespace vgm
 
 		void normalise();
 
-		void readHeader(afc::InputStream &in, size_t &cursor);
-		void readGD3Info(afc::InputStream &in, size_t &cursor);
+		// Reads the header and returns the layout of the file it describes (see format::readLayout()).
+		format::Layout readHeader(afc::InputStream &in, size_t &cursor);
+		// Reads the GD3 info that takes gd3Size octets of the file (see format::Layout).
+		void readGD3Info(afc::InputStream &in, const size_t gd3Size, size_t &cursor);
 		void readData(afc::InputStream &in, size_t &cursor);
+		// Moves the cursor of the source stream to pos.
+		void skipTo(afc::InputStream &in, const size_t pos, size_t &cursor) const;
 
-		void writeContent(afc::OutputStream &out) const;
+		void mapData();
+		void releaseData();
 
-		size_t version() const { return m_header.elements[VGMHeader::IDX_VERSION]; }
+		bool hasNormalisedLayout() const;
+		// Returns true if the normalised header and GD3 info are equal to those of the source file.
+		bool isUnchanged(const uint32_t srcHeader[]) const;
+		void updateInPlace(const char * const dest, const SyncMode sync);
+		bool updateCompressedInPlace(const char * const dest, const GZipSettings &gzipSettings, const SyncMode sync);
 
-		size_t absoluteVgmDataOffset() const
-		{
-			return VGMHeader::POS_VGM_DATA + (version() < VERSION_1_50 ?
-					VGMHeader::DEFAULT_VGM_DATA_OFFSET : m_header.elements[VGMHeader::IDX_VGM_DATA_OFFSET]);
-		}
+		// Writes the header, the VGM data and the GD3 info to dest in the VGM format with a single gather write.
+		void writeContent(const char * const dest, const SyncMode sync) const;
+		void writeMappedContent(const char * const dest, const SyncMode sync) const;
+		void writeCompressedContent(const char * const dest, const GZipSettings &gzipSettings,
+				const SyncMode sync) const;
+		void commit(AtomicFile &file, const SyncMode sync) const;
+		// Writes the content to dest reading the VGM data from the source file as it is written.
+		void writeStreamedContent(const char * const dest, const Format format, const GZipSettings &gzipSettings,
+				const SyncMode sync) const;
+
+		size_t headerSize() const;
+		size_t gd3InfoSize() const { return GD3Info::HEADER_SIZE + m_gd3Info.dataSize; }
+		void encodeHeader(unsigned char *dest) const;
+		void encodeGD3Info(unsigned char *dest) const;
+		// Encodes the header followed by the GD3 info into one buffer of headerSize() + gd3InfoSize() octets.
+		std::unique_ptr<unsigned char[]> encodeHeaderAndGD3Info() const;
+
+		size_t version() const { return m_header.elements[VGMHeader::IDX_VERSION]; }
 
 		struct VGMHeader
 		{
@@ -123,15 +214,68 @@ namespace vgm
 
 			static const uint32_t HEADER_SIZE = 0x0c;
 
+			static const size_t TAG_COUNT = static_cast<size_t>(Tag::notes) + 1;
+			static_assert(TAG_COUNT == format::GD3_TAG_COUNT, "The tags must be those of the GD3 info");
+
+			/* A tag value as UTF-16LE octets without the NUL terminator. It lies in the source GD3 block,
+			 * or in the tag arena if the tag has been set.
+			 */
+			struct TagSlot
+			{
+				size_t offset;
+				size_t size;
+				bool inArena;
+			};
+
 			size_t dataSize;
-			afc::U16String tags[static_cast<size_t>(Tag::notes) + 1];
+			TagSlot tags[TAG_COUNT];
 		};
 
+		// Returns the encoded value of the tag with the given index.
+		const unsigned char *tagData(const size_t i) const
+		{
+			const GD3Info::TagSlot &slot = m_gd3Info.tags[i];
+			return (slot.inArena ? m_tagArena.data() : m_srcGD3Block.get()) + slot.offset;
+		}
+
 		VGMHeader m_header;
 		GD3Info m_gd3Info;
-		unsigned char *m_data;
+		const unsigned char *m_data;
 		size_t m_dataSize;
 		Format m_format;
+		LoadMode m_loadMode;
+
+		// The properties of the source file that are needed to load the VGM data on demand or to save in place.
+		std::string m_srcFile;
+		size_t m_srcDataOffset;
+		// The absolute offset of the GD3 info in the source file, or 0 if there is no GD3 info.
+		size_t m_srcGD3Offset;
+		/* The tag block of the GD3 info as it is stored in the source file (its even part), and its declared
+		 * length. The tags that are not set are kept there, and they are compared with the tags to be saved
+		 * to detect that nothing has changed.
+		 */
+		std::unique_ptr<unsigned char[]> m_srcGD3Block;
+		size_t m_srcGD3Length;
+		// The values of the tags that are set, encoded as they are stored in the GD3 info.
+		std::vector<unsigned char> m_tagArena;
+		/* The tags that getTag() has decoded, allocated on first access. The i-th bit of the mask is set if
+		 * the i-th tag is decoded and is up to date.
+		 */
+		mutable std::unique_ptr<afc::U16String[]> m_decodedTags;
+		mutable unsigned m_decodedTagMask;
+		// Guards the decoded tags so that getTag() decodes each tag once even if it is called concurrently.
+		mutable std::mutex m_decodedTagsMutex;
+		// True if the source file ends right after the GD3 info, so it has no trailing garbage to clean up.
+		bool m_srcEndsWithGD3;
+
+		/* If the VGM data is mapped into memory then m_data points to the inside of m_mapping, and m_srcFd is
+		 * the descriptor of the source file that is kept open to copy the data from. Otherwise m_data is owned.
+		 */
+		void *m_mapping;
+		size_t m_mappingSize;
+		int m_srcFd;
+
+		Stats *m_stats;
 	};
 }
 
@@ -0,0 +1,118 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "writer.h"
+#include "fileio.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include <afc/cpu/primitive.h>
+#include <afc/Exception.h>
+#include <afc/StringRef.hpp>
+
+using namespace afc;
+using namespace std;
+
+namespace
+{
+	static const afc::endianness LE = afc::endianness::LE;
+}
+
+vgm::VGMWriter::VGMWriter(const unsigned char * const header, const size_t size)
+{
+	if (size < format::SHORT_HEADER_SIZE) {
+		throw Exception("Incomplete VGM header"_s);
+	}
+	const size_t elementCount = min(size, format::LONG_HEADER_SIZE) / 4;
+	for (size_t i = 0; i < elementCount; ++i) {
+		m_header[i] = UInt32<>::fromBytes<LE>(header + 4*i);
+	}
+	fill(m_header + elementCount, m_header + format::HEADER_ELEMENT_COUNT, 0);
+
+	if (m_header[format::IDX_ID] != format::VGM_FILE_ID) {
+		throw Exception("Not a VGM header"_s);
+	}
+	if (!format::isSupportedVersion(m_header[format::IDX_VERSION])) {
+		throw Exception("Unsupported VGM version"_s);
+	}
+}
+
+size_t vgm::VGMWriter::gd3InfoSize() const
+{
+	size_t tagCharCount = 0;
+	for (const u16string &tag : m_tags) {
+		tagCharCount += tag.size() + 1; // '\0' must be counted too
+	}
+	return format::GD3_HEADER_SIZE + tagCharCount * 2; // UTF16-LE is used for GD3
+}
+
+void vgm::VGMWriter::encodeHeader(const size_t dataSize, unsigned char *dest) const
+{
+	uint32_t header[format::HEADER_ELEMENT_COUNT];
+	copy(m_header, m_header + format::HEADER_ELEMENT_COUNT, header);
+	format::normaliseHeader(header, dataSize, gd3InfoSize());
+	for (size_t i = 0, n = headerSize() / 4; i < n; ++i, dest += 4) {
+		UInt32<>(header[i]).toBytes<LE>(dest);
+	}
+}
+
+void vgm::VGMWriter::encodeGD3Info(unsigned char *dest) const
+{
+	format::encodeGD3Header(gd3InfoSize() - format::GD3_HEADER_SIZE, dest);
+	dest += format::GD3_HEADER_SIZE;
+	for (const u16string &tag : m_tags) {
+		format::encodeUTF16LE(tag.data(), tag.size(), dest);
+		dest += 2*tag.size();
+		UInt16<>(UInt16<>::type(0)).toBytes<LE>(dest);
+		dest += 2;
+	}
+}
+
+void vgm::VGMWriter::write(const int fd, const Span data[], const size_t spanCount, const VGMFile::Format fileFormat,
+		const GZipSettings &gzipSettings) const
+{
+	size_t dataSize = 0;
+	for (size_t i = 0; i < spanCount; ++i) {
+		dataSize += data[i].size;
+	}
+	const size_t hdrSize = headerSize();
+	const size_t gd3Size = gd3InfoSize();
+	const unique_ptr<unsigned char[]> buf(new unsigned char[hdrSize + gd3Size]);
+	encodeHeader(dataSize, buf.get());
+	encodeGD3Info(buf.get() + hdrSize);
+
+	if (fileFormat == VGMFile::Format::vgz) {
+		vector<Span> content;
+		content.reserve(spanCount + 2);
+		content.push_back(Span{buf.get(), hdrSize});
+		content.insert(content.end(), data, data + spanCount);
+		content.push_back(Span{buf.get() + hdrSize, gd3Size});
+		writeGZip(fd, content.data(), content.size(), gzipSettings);
+	} else {
+		vector<struct iovec> content;
+		content.reserve(spanCount + 2);
+		content.push_back(iovec{buf.get(), hdrSize});
+		for (size_t i = 0; i < spanCount; ++i) {
+			content.push_back(iovec{const_cast<unsigned char *>(data[i].data), data[i].size});
+		}
+		content.push_back(iovec{buf.get() + hdrSize, gd3Size});
+		writeAllV(fd, content.data(), content.size());
+	}
+}
@@ -0,0 +1,70 @@
+/* vgmtag - a command-line tag editor of VGM/VGZ media files.
+Copyright (C) 2013-2016 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef VGM_WRITER_H_
+#define VGM_WRITER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "format.h"
+#include "gzip.h"
+#include "vgm.h"
+
+namespace vgm
+{
+	/*
+	 * Writes VGM/VGZ files from the constituents parse() delivers, without a source file. The files written
+	 * have the normalised layout header -> data -> gd3 -> eof, as VGMFile::save() writes them.
+	 */
+	class VGMWriter
+	{
+	public:
+		/* Takes the header as passed to ParseHandler::header(), which must be at least 0x40 octets long. The header
+		 * elements that are not in the given octets are set to zero. All the tags are empty initially.
+		 * Throws afc::Exception if the header is not a header of a supported VGM version.
+		 */
+		VGMWriter(const unsigned char *header, std::size_t size);
+
+		void setTag(VGMFile::Tag tag, const char16_t *value, std::size_t size)
+		{
+			m_tags[static_cast<std::size_t>(tag)].assign(value, size);
+		}
+
+		const std::u16string &getTag(const VGMFile::Tag tag) const { return m_tags[static_cast<std::size_t>(tag)]; }
+
+		std::size_t headerSize() const { return format::headerSize(m_header[format::IDX_VERSION]); }
+		std::size_t gd3InfoSize() const;
+
+		// Encodes the header of the file with dataSize octets of VGM data into headerSize() octets at dest.
+		void encodeHeader(std::size_t dataSize, unsigned char *dest) const;
+		// Encodes the GD3 info into gd3InfoSize() octets at dest.
+		void encodeGD3Info(unsigned char *dest) const;
+
+		/*
+		 * Writes the file whose VGM data is the concatenation of the spans to fd at its current position.
+		 * The descriptor can be a pipe or a socket. gzipSettings define how the content is compressed if
+		 * the VGZ format is used. Throws afc::Exception if the file cannot be written.
+		 */
+		void write(int fd, const Span data[], std::size_t spanCount, VGMFile::Format fileFormat,
+				const GZipSettings &gzipSettings = GZipSettings()) const;
+	private:
+		uint32_t m_header[format::HEADER_ELEMENT_COUNT];
+		std::u16string m_tags[static_cast<std::size_t>(VGMFile::Tag::notes) + 1];
+	};
+}
+
+#endif // VGM_WRITER_H_